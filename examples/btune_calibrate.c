@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <btune.h>
+#include "blosc2.h"
+
+
+// Calibrate the cost of the configurations Btune may try, so that BTUNE_COST_MODEL
+// can be used right away.  Run it once per machine (and typesize).
+int main(int argc, char* argv[]) {
+    blosc2_init();
+
+    // Input parameters
+    if (argc != 4) {
+        fprintf(stderr, "btune_calibrate <calibration.json> <typesize> <max threads>\n");
+        return 1;
+    }
+    const char* fname = argv[1];
+    int typesize = atoi(argv[2]);
+    int max_threads = atoi(argv[3]);
+
+    blosc_timestamp_t t0, t1;
+    blosc_set_timestamp(&t0);
+    int rc = btune_calibrate_costs(fname, typesize, max_threads);
+    blosc_set_timestamp(&t1);
+    if (rc < 0) {
+        fprintf(stderr, "Error %d calibrating the costs\n", rc);
+        blosc2_destroy();
+        return 1;
+    }
+    printf("Calibrated %d configurations in %.1f s, kept in %s\n",
+           rc, blosc_elapsed_secs(t0, t1), fname);
+
+    blosc2_destroy();
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#######################################################################
+# Copyright (c) 2019-present, Blosc Development Team <blosc@blosc.org>
+# All rights reserved.
+#
+# This source code is licensed under a BSD-style license (found in the
+# LICENSE file in the root directory of this source tree)
+#######################################################################
+
+# Convert the float Btune models in a models directory to int8 models.
+#
+# Usage: python quantize_models.py models models-int8
+#
+# The models are rebuilt as Keras models from the weights in the .tflite
+# files, checked against the originals, and converted with full integer
+# quantization.  The quantization parameters of the inputs and outputs are
+# also stored in the metadata (.json) files.  Needs TensorFlow.
+
+import json
+import os
+import sys
+
+import numpy as np
+import tensorflow as tf
+
+NSAMPLES = 1000
+
+
+def read_dense_layers(fname):
+    """Get the (kernel, bias) of the fully connected layers of a float model."""
+    interpreter = tf.lite.Interpreter(model_path=fname)
+    interpreter.allocate_tensors()
+    layers = []
+    for op in interpreter._get_ops_details():
+        if op["op_name"] == "FULLY_CONNECTED":
+            weights = interpreter.get_tensor(op["inputs"][1])
+            bias = interpreter.get_tensor(op["inputs"][2])
+            layers.append((weights.T, bias))
+        elif op["op_name"] not in ("SOFTMAX", "RELU", "RESHAPE"):
+            raise ValueError(f"Unsupported operator {op['op_name']} in {fname}")
+    return layers
+
+
+def build_model(layers):
+    """The Btune models: dense layers with ReLU and a final softmax."""
+    ninputs = layers[0][0].shape[0]
+    model = tf.keras.Sequential([tf.keras.Input(shape=(ninputs,))])
+    for i, (kernel, bias) in enumerate(layers):
+        activation = "softmax" if i == len(layers) - 1 else "relu"
+        dense = tf.keras.layers.Dense(kernel.shape[1], activation=activation)
+        model.add(dense)
+        dense.set_weights([kernel, bias])
+    return model
+
+
+def sample_inputs(n):
+    """Normalized cratio and speed, plus the tradeoff."""
+    rng = np.random.default_rng(0)
+    inputs = rng.standard_normal((n, 3)).astype(np.float32)
+    inputs[:, 2] = rng.uniform(0, 1, n)
+    return inputs
+
+
+def run_tflite(content, inputs):
+    interpreter = tf.lite.Interpreter(model_content=content)
+    interpreter.resize_tensor_input(0, inputs.shape)
+    interpreter.allocate_tensors()
+    input_details = interpreter.get_input_details()[0]
+    output_details = interpreter.get_output_details()[0]
+    if input_details["dtype"] == np.int8:
+        scale, zero_point = input_details["quantization"]
+        inputs = np.clip(np.round(inputs / scale) + zero_point, -128, 127).astype(np.int8)
+    interpreter.set_tensor(input_details["index"], inputs)
+    interpreter.invoke()
+    outputs = interpreter.get_tensor(output_details["index"])
+    if output_details["dtype"] == np.int8:
+        scale, zero_point = output_details["quantization"]
+        outputs = (outputs.astype(np.float32) - zero_point) * scale
+    return outputs
+
+
+def quantize(src_dir, dst_dir, name):
+    fname = os.path.join(src_dir, f"{name}.tflite")
+    with open(fname, "rb") as f:
+        original = f.read()
+    model = build_model(read_dense_layers(fname))
+
+    # Make sure that the model has been rebuilt correctly
+    inputs = sample_inputs(NSAMPLES)
+    expected = run_tflite(original, inputs)
+    if not np.allclose(model.predict(inputs, verbose=0), expected, atol=1e-5):
+        raise ValueError(f"Cannot rebuild the model in {fname}")
+
+    converter = tf.lite.TFLiteConverter.from_keras_model(model)
+    converter.optimizations = [tf.lite.Optimize.DEFAULT]
+    converter.representative_dataset = lambda: ([row[np.newaxis]] for row in inputs)
+    converter.target_spec.supported_ops = [tf.lite.OpsSet.TFLITE_BUILTINS_INT8]
+    converter.inference_input_type = tf.int8
+    converter.inference_output_type = tf.int8
+    quantized = converter.convert()
+
+    outputs = run_tflite(quantized, inputs)
+    agreement = np.mean(outputs.argmax(axis=1) == expected.argmax(axis=1))
+    print(f"{name}: {len(original)} -> {len(quantized)} bytes, "
+          f"{agreement * 100:.1f}% of the predictions unchanged")
+    with open(os.path.join(dst_dir, f"{name}.tflite"), "wb") as f:
+        f.write(quantized)
+
+    # Copy the metadata, adding the quantization parameters
+    interpreter = tf.lite.Interpreter(model_content=quantized)
+    input_scale, input_zero_point = interpreter.get_input_details()[0]["quantization"]
+    output_scale, output_zero_point = interpreter.get_output_details()[0]["quantization"]
+    with open(os.path.join(src_dir, f"{name}.json")) as f:
+        metadata = json.load(f)
+    metadata["quantization"] = {
+        "input": {"scale": float(input_scale), "zero_point": int(input_zero_point)},
+        "output": {"scale": float(output_scale), "zero_point": int(output_zero_point)},
+    }
+    with open(os.path.join(dst_dir, f"{name}.json"), "w") as f:
+        json.dump(metadata, f)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("Usage: python quantize_models.py <models dir> <int8 models dir>")
+    src_dir, dst_dir = sys.argv[1:]
+    os.makedirs(dst_dir, exist_ok=True)
+    for name in ("model_comp", "model_decomp"):
+        if os.path.exists(os.path.join(src_dir, f"{name}.tflite")):
+            quantize(src_dir, dst_dir, name)
@@ -6,8 +6,12 @@
 # v2.11.0 works both on Linux and Mac
 # v2.12.0 does not seem to work on neither Linux nor Mac (and static compiling)
 # v2.13.0-rc0 does seems to work again on both platforms
+# Not needed when building with the built-in inference engine (BTUNE_USE_TFLITE=OFF)
 TENSORFLOW_VERSION="v2.13.0-rc1"
-if [ ! -d "tensorflow_src" ]
+if [ "$BTUNE_USE_TFLITE" = "OFF" ]
+then
+  echo "Using the built-in inference engine, TensorFlow not needed"
+elif [ ! -d "tensorflow_src" ]
 then
   git clone --depth=1 -b $TENSORFLOW_VERSION https://github.com/tensorflow/tensorflow.git tensorflow_src
 else
@@ -18,6 +18,8 @@
 
 #include <stdbool.h>
 #include "context.h"
+#include "btune_bandit.h"
+#include "btune_threads.h"
 
 
 // Internal Btune compression parameters
@@ -56,6 +58,96 @@ typedef struct {
     // The decompression time obtained with this cparams
 } cparams_btune;
 
+// Maximum number of chunks that can be compressed concurrently with their own candidate
+#define BTUNE_MAX_INFLIGHT 64
+
+// Candidate handle, owned by a chunk from btune_next_cparams() until btune_update()
+typedef struct {
+    cparams_btune cparams;
+    // The cparams proposed for the chunk
+    btune_state state;
+    // The state which proposed the cparams
+    uint32_t epoch;
+    // The state epoch at the time the candidate was issued
+    int category;
+    // The category predicted by the model for the chunk, or -1
+    int arm;
+    // The arm chosen by the bandit for the chunk, or -1
+    double context[BTUNE_BANDIT_DIM];
+    // The context the arm was chosen with
+    bool in_use;
+    // Whether an in-flight chunk owns this handle
+    pthread_t owner;
+    // The thread compressing the chunk which owns this handle
+    bool warmup;
+    // Whether the compression of the chunk pays for starting up (see btune_update)
+    bool respawn;
+    // Whether the warmup is a start (or stop) of the threads of the context, or the first chunk
+} btune_candidate;
+
+// Maximum number of categories predicted by the model tried by CODEC_FILTER
+#define BTUNE_MAX_CHOICES 8
+
+// A category predicted by the model, to be tried by CODEC_FILTER
+typedef struct {
+    int compcode;
+    // The codec
+    uint8_t filter;
+    // The filter
+    int clevel;
+    // The compression level
+    int32_t splitmode;
+    // The split mode
+} btune_choice;
+
+// Running mean and variance (Welford's algorithm)
+typedef struct {
+    double n;
+    // Number of observations
+    double mean;
+    // Mean of the observations
+    double m2;
+    // Sum of the squared differences to the mean
+} btune_running_stats;
+
+// Features fed to the model which are normalized
+enum {
+  BTUNE_FEATURE_CRATIO,
+  BTUNE_FEATURE_SPEED,
+  BTUNE_NFEATURES,
+};
+
+// Aggregate statistics, updated without taking the tuner lock
+typedef struct {
+    uint64_t nchunks;
+    // Number of chunks compressed
+    uint64_t nbytes;
+    // Uncompressed bytes
+    uint64_t cbytes;
+    // Compressed bytes
+    uint64_t ctime_ns;
+    // Accumulated compression time in nanoseconds
+    uint64_t stale_updates;
+    // Updates whose candidate was issued in a previous state epoch
+    uint64_t warmups;
+    // Chunks whose timing was discarded because they paid for starting up
+    uint64_t respawns;
+    // Thread starts (or stops) timed apart, in compression (with BTUNE_TRACE) or decompression
+    int64_t respawn_ns;
+    // Accumulated overhead of the thread starts in nanoseconds (see btune_update)
+    int64_t first_chunk_ns;
+    // Accumulated overhead of the first chunks in nanoseconds (with BTUNE_TRACE)
+} btune_stats;
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BTUNE_ATOMIC_ADD(ptr, value) _InterlockedExchangeAdd64((volatile __int64 *)(ptr), (__int64)(value))
+#define BTUNE_ATOMIC_LOAD(ptr) _InterlockedOr64((volatile __int64 *)(ptr), 0)
+#else
+#define BTUNE_ATOMIC_ADD(ptr, value) __atomic_fetch_add((ptr), (value), __ATOMIC_RELAXED)
+#define BTUNE_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#endif
+
 // Btune struct
 typedef struct {
   btune_config config;
@@ -76,8 +168,26 @@ typedef struct {
   // Number of clevels used by Btune
   cparams_btune * best;
   // The best cparams optained with Btune
-  cparams_btune * aux_cparams;
-  // The aux cparams for updating the best
+  btune_candidate * candidates;
+  // The pool of candidate handles for the in-flight chunks
+  uint32_t epoch;
+  // Incremented every time the state machine moves, so that late updates can be detected
+  int trials_issued;
+  // The candidates issued in the current state epoch
+  int trials_reported;
+  // The candidates of the current state epoch released, with or without a score
+  int trials_scored;
+  // The candidates of the current state epoch whose score moved the state machine
+  bool draining;
+  // Whether the state has ended, and the next one waits for the trials still in flight
+  pthread_mutex_t lock;
+  // Protects the state machine and the best cparams
+  pthread_mutex_t model_lock;
+  // Protects the inference counts
+  pthread_mutex_t dctx_lock;
+  // Protects dctx when measuring decompression times
+  btune_stats stats;
+  // Aggregate statistics (lock-free)
   double * current_scores;
   // The aux array of scores to calculate the mean
   double * current_cratios;
@@ -88,8 +198,8 @@ typedef struct {
   // The auxiliar index for state management
   int clevel_index;
   // The index for the clevel array
-  int steps_count;
-  // The count of steps made by Btune
+  uint64_t steps_count;
+  // The count of steps made by Btune (atomic)
   btune_state state;
   // The state of Btune
   int step_size;
@@ -106,22 +216,88 @@ typedef struct {
   // If Btune is making a hard or soft readapt, or is WAITING
   int max_threads;
   // The maximum number of threads used
+  int requested_threads;
+  // The maximum number of threads asked by the contexts, the limit of max_threads
+  blosc_timestamp_t threads_checked;
+  // When max_threads was last derived from the CPUs available (see limit_threads)
+  blosc_timestamp_t cpu_checked;
+  // When the CPU time of the process was last read
+  double cpu_time;
+  // The CPU time of the process at cpu_checked, -1 if unknown
   blosc2_context * dctx;
-  // The decompression context
+  // The decompression context (NULL for grouped tuners, see get_dctx())
+  const char * group;
+  // The name of the tuner group this tuner is shared by, or NULL if private
   int nthreads_decomp;
-  // The number of threads for decompression (used if dctx is NULL)
+  // The number of threads for decompression of the last cparams set (the dctx may lag behind)
   bool threads_for_comp;
   // Depending on this value the THREADS state will change the compression or decompression threads
-  void * interpreter;
-  // TF Lite model, used for inference
+  void * runtime;
+  // Process-wide model runtime (TF Lite model and interpreter pool), used for inference
   void * metadata;
-  // Metadata information used for model inference
+  // Metadata information used for model inference (shared, read-only)
+  float * category_weight;
+  // The number of times each category is inferred, decayed with the age of the chunks
+  float * category_mass;
+  // The probability of each category, accumulated over the inferred chunks (decayed)
+  double * category_score;
+  // The moving average of the score of the chunks compressed with each category, 0 if none
+  float margin;
+  // Probability of the last inferred category minus the one of the runner-up, protected by model_lock
+  btune_running_stats feature_stats[BTUNE_NFEATURES];
+  // The statistics of the features of the chunks seen, protected by model_lock
+  btune_choice choices[BTUNE_MAX_CHOICES];
+  // The categories tried by CODEC_FILTER after inference
+  int nchoices;
+  // Number of choices, only used when greater than 1
+  btune_bandit * bandit;
+  // The contextual bandit (BTUNE_POLICY_LINUCB), created on the first chunk
+  btune_choice * arms;
+  // The arms of the bandit
+  double reward_scale;
+  // Moving average of the scores, used to normalize the rewards of the bandit
+  int model_status;
+  // The model loading status (see btune_model_status), accessed atomically
+  char * model_dir;
+  // The directory of the model to load
+  pthread_t model_thread;
+  // The thread loading the model in background
+  bool model_thread_started;
+  // Whether model_thread must be joined
+  double model_load_time;
+  // The time spent loading the model, in seconds
+  void * pipeline;
+  // Helper thread probing chunks while they are compressed (pipelined mode)
   float zeros_speed;
-  // Entropy speed for a zeros chunk.
+  // Entropy speed for a zeros chunk, accessed atomically.
   int inference_count;
   // Number of times to run inference
   bool inference_ended;
   // Whether all desired ninferences were already performed.
+  int inference_skip;
+  // Number of chunks to go before the next scheduled inference
+  int inference_interval;
+  // The current interval between inferences (see btune_inference_schedule)
+  int inferred_category;
+  // The category of the last inference, or -1
+  double inferred_cratio;
+  // The cratio of the first chunk compressed after the last inference, or 0
+  bool inference_due;
+  // Whether the next chunk must run inference regardless of the schedule
+  bool filters_probed;
+  // Whether the filters to try have been chosen with the entropy probe (see probe_filters)
+  bool codecs_probed;
+  // Whether the codecs to try have been chosen with the codec proxies (see probe_codecs)
+  bool retry;
+  // Whether the next chunk must retry the cparams of a chunk whose timing was discarded
+  cparams_btune retry_cparams;
+  // The cparams to retry
+  uint32_t retry_epoch;
+  // The state epoch of the discarded chunk
+  btune_threads_fit threads_fit;
+  // The times sampled by the FIT thread search and the knee of their scaling curve
+  int nthread_trials;
+  // The chunks issued by the current FIT thread search, 0 before it starts
 } btune_struct;
 /// @endcond
 
@@ -12,11 +12,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #include <blosc2/filters-registry.h>
 #include <blosc2/tuners-registry.h>
 #include "btune.h"
+#include "btune_calib.h"
+#include "btune_cpus.h"
 #include "btune_model.h"
+#include "btune_pool.h"
 #include "entropy_probe.h"
 #include "btune-private.h"
 
@@ -41,6 +45,9 @@ enum {
   MAX_STATE_THREADS = 50,  // 50 magic number big enough to not tune threads this number of times
 };
 
+// Seconds between two checks of the CPUs available (the load average is updated every 5 s)
+#define CPUS_CHECK_INTERVAL 5.
+
 static const cparams_btune cparams_btune_default = {
   .compcode = BLOSC_LZ4,
   .filter = BLOSC_SHUFFLE,
@@ -116,9 +123,6 @@ static void btune_init_clevels(btune_struct *btune_params, int min, int max, int
   if (btune_params->best) {
     btune_params->best->clevel = start;
   }
-  if (btune_params->aux_cparams) {
-    btune_params->aux_cparams->clevel = start;
-  }
 
   btune_params->nclevels = max - min + 1;
   for (int i = 0; i < btune_params->nclevels; i++) {
@@ -129,6 +133,40 @@ static void btune_init_clevels(btune_struct *btune_params, int min, int max, int
   }
 }
 
+// Set the clevels to try around the clevel predicted by the model
+static void init_inferred_clevels(btune_struct *btune_params, int clevel) {
+  if (btune_params->config.perf_mode == BTUNE_PERF_DECOMP) {
+    btune_init_clevels(btune_params, clevel, clevel, clevel);
+  }
+  else {
+    int min = (clevel > 1) ? (clevel - 1) : clevel;
+    int max = (clevel < 9) ? (clevel + 1) : clevel;
+    btune_init_clevels(btune_params, min, max, clevel);
+  }
+}
+
+// Get the decompression context paired with cctx.  Grouped tuners are shared
+// by many super-chunks, so the dctx is looked up from the super-chunk instead.
+static blosc2_context * get_dctx(btune_struct *btune_params, blosc2_context *cctx) {
+  if (btune_params->group == NULL) {
+    return btune_params->dctx;
+  }
+  return (cctx->schunk != NULL) ? cctx->schunk->dctx : NULL;
+}
+
+// Whether the next (de)compression with ctx starts (or stops) its threads, which
+// blosc2 does inside the timed call
+static bool starts_threads(blosc2_context *ctx) {
+  if (btune_pool_installed()) {
+    // The jobs go to the workers of the pool, which are always there
+    return false;
+  }
+  if (ctx->new_nthreads != ctx->nthreads) {
+    return ctx->new_nthreads > 1 || ctx->nthreads > 1;
+  }
+  return ctx->new_nthreads > 1 && ctx->threads_started == 0;
+}
+
 // Extract the cparams_btune inside blosc2_context
 static void extract_btune_cparams(blosc2_context *context, cparams_btune *cparams){
   cparams->compcode = context->compcode;
@@ -139,10 +177,11 @@ static void extract_btune_cparams(blosc2_context *context, cparams_btune *cparam
   cparams->shufflesize = context->typesize;
   cparams->nthreads_comp = context->nthreads;
   btune_struct *btune_params = (btune_struct *) context->tuner_params;
-  if (btune_params->dctx == NULL) {
+  blosc2_context *dctx = get_dctx(btune_params, context);
+  if (dctx == NULL) {
     cparams->nthreads_decomp = btune_params->nthreads_decomp;
   } else {
-    cparams->nthreads_decomp = btune_params->dctx->nthreads;
+    cparams->nthreads_decomp = dctx->nthreads;
   }
 }
 
@@ -176,6 +215,16 @@ static bool has_ended_threads(btune_struct *btune_params) {
           (!best->increasing_nthreads && (nthreads == MIN_THREADS)));
 }
 
+// The knee of the scaling curve fitted to the sampled times (see btune_threads_fit_knee)
+static int fit_threads_knee(const btune_struct *btune_params) {
+  double sigma, kappa;
+  const btune_threads_fit *fit = &btune_params->threads_fit;
+  int knee = btune_threads_fit_knee(fit, &sigma, &kappa);
+  BTUNE_TRACE("Thread scaling fit: sigma=%.3g kappa=%.3g, knee at %d threads%s", sigma, kappa,
+              knee, (fit->counts[fit->ncounts - 1] < btune_params->max_threads) ? " (saturated)" : "");
+  return knee;
+}
+
 // Init a soft readapt
 static void init_soft(btune_struct *btune_params) {
   if (has_ended_clevel(btune_params)) {
@@ -191,6 +240,7 @@ static void init_hard(btune_struct *btune_params) {
   btune_params->state = CODEC_FILTER;
   btune_params->step_size = HARD_STEP_SIZE;
   btune_params->readapt_from = HARD;
+  btune_params->nthread_trials = 0;
   if (btune_params->config.perf_mode == BTUNE_PERF_DECOMP) {
     btune_params->threads_for_comp = false;
   } else {
@@ -312,15 +362,48 @@ static const char* repeat_mode_to_str(btune_repeat_mode repeat_mode) {
 }
 
 
-// Init btune_struct inside blosc2_context
-// TODO CHECK CONFIG ENUMS (bandwidth range...)
-void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx) {
-  btune_config *config = (btune_config *)tuner_params;
+// Tuner groups: a single btune_struct shared by all the contexts attached to the same name
+typedef struct btune_group_s {
+  char *name;
+  // The group name
+  btune_struct *btune;
+  // The shared tuner
+  int refcount;
+  // Number of contexts attached to the tuner
+  struct btune_group_s *next;
+} btune_group;
+
+static btune_group *btune_groups = NULL;
+static pthread_once_t entropy_codec_once = PTHREAD_ONCE_INIT;
 
-  // Register entropy codec
+static void register_entropy_codec_once(void) {
   blosc2_codec codec;
   register_entropy_codec(&codec);
+}
+
+static pthread_mutex_t btune_groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static btune_group * find_group(const char *name) {
+  for (btune_group *group = btune_groups; group != NULL; group = group->next) {
+    if (strcmp(group->name, name) == 0) {
+      return group;
+    }
+  }
+  return NULL;
+}
+
+// Make cctx use btune
+static void attach_btune(btune_struct *btune, blosc2_context *cctx) {
+  // If the user does not fill the config, the next fields will be empty
+  // No need to do the same for dctx because btune is only used during compression
+  cctx->schunk->tuner_params = (void *) &btune->config;
+  cctx->schunk->storage->cparams->tuner_params = (void *) &btune->config;
+  cctx->tuner_params = btune;
+}
 
+// Init btune_struct inside blosc2_context
+// TODO CHECK CONFIG ENUMS (bandwidth range...)
+static void btune_create(btune_config *config, blosc2_context * cctx, blosc2_context * dctx) {
   // Allocate memory
   btune_struct *btune = calloc(sizeof(btune_struct), 1);
 
@@ -355,6 +438,20 @@ void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx
     }
   }
 
+  const char* policy = getenv("BTUNE_POLICY");
+  if (policy != NULL) {
+    if (strcmp(policy, "STATES") == 0) {
+      btune->config.policy = BTUNE_POLICY_STATES;
+    }
+    else if (strcmp(policy, "LINUCB") == 0) {
+      btune->config.policy = BTUNE_POLICY_LINUCB;
+    }
+    else {
+      BTUNE_TRACE("Unsupported %s policy, default to STATES", policy);
+      btune->config.policy = BTUNE_POLICY_STATES;
+    }
+  }
+
   char* envvar = getenv("BTUNE_TRADEOFF");
   if (envvar != NULL) {
     btune->config.tradeoff = atof(envvar);
@@ -366,13 +463,39 @@ void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx
   }
 
 
+  envvar = getenv("BTUNE_COST_MODEL");
+  if (envvar != NULL) {
+    btune->config.cost_model = (float) atof(envvar);
+  }
+  if (btune->config.cost_model < 0. || btune->config.cost_model > 1.) {
+    BTUNE_TRACE("Unsupported %f cost model weight, it must be between 0. and 1., "
+                "default to 0.", btune->config.cost_model);
+    btune->config.cost_model = 0;
+  }
+
+  envvar = getenv("BTUNE_THREAD_SEARCH");
+  if (envvar != NULL) {
+    if (strcmp(envvar, "STEP") == 0) {
+      btune->config.thread_search = BTUNE_THREADS_STEP;
+    }
+    else if (strcmp(envvar, "FIT") == 0) {
+      btune->config.thread_search = BTUNE_THREADS_FIT;
+    }
+    else {
+      BTUNE_TRACE("Unsupported %s thread search, default to STEP", envvar);
+      btune->config.thread_search = BTUNE_THREADS_STEP;
+    }
+  }
+
+  envvar = getenv("BTUNE_LIMIT_THREADS");
+  if (envvar != NULL) {
+    btune->config.limit_threads = atoi(envvar) != 0;
+  }
+
   btune->zeros_speed = -1; // This is initialized the first time inference is performed
 
-  // If the user does not fill the config, the next fields will be empty
-  // No need to do the same for dctx because btune is only used during compression
-  cctx->schunk->tuner_params = (void *) &btune->config;
-  cctx ->schunk->storage->cparams->tuner_params = (void *) &btune->config;
-  
+  attach_btune(btune, cctx);
+
   if (getenv("BTUNE_TRACE") != NULL) {
     printf("-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
     char bandwidth_str[12];
@@ -407,36 +530,38 @@ void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx
   btune->nhards = 0;
   btune->nwaitings = 0;
   btune->is_repeating = false;
-  cctx->tuner_params = btune;
+  btune->epoch = 0;
+  btune->trials_issued = 0;
+  btune->trials_reported = 0;
+  btune->trials_scored = 0;
+  btune->draining = false;
+  pthread_mutex_init(&btune->lock, NULL);
+  pthread_mutex_init(&btune->model_lock, NULL);
+  pthread_mutex_init(&btune->dctx_lock, NULL);
 
   // Initial compression parameters
   cparams_btune *best = malloc(sizeof(cparams_btune));
   *best = cparams_btune_default;
   btune->best = best;
-  cparams_btune *aux = malloc(sizeof(cparams_btune));
-  *aux = cparams_btune_default;
-  btune->aux_cparams = aux;
+  btune->candidates = calloc(BTUNE_MAX_INFLIGHT, sizeof(btune_candidate));
   best->compcode = btune->codecs[0];
-  aux->compcode = btune->codecs[0];
   if (2/3 <= btune->config.tradeoff <= 1.) {
     best->clevel = 8;
-    aux->clevel = 8;
   }
   best->shufflesize = cctx->typesize;  // TODO typesize -> shufflesize
-  aux->shufflesize = cctx->typesize;  // TODO typesize -> shufflesize
   best->nthreads_comp = cctx->nthreads;
-  aux->nthreads_comp = cctx->nthreads;
   if (dctx != NULL){
     btune->max_threads = (cctx->nthreads > dctx->nthreads) ? cctx->nthreads: dctx->nthreads;
     best->nthreads_decomp = dctx->nthreads;
-    aux->nthreads_decomp = dctx->nthreads;
     btune->nthreads_decomp = dctx->nthreads;
   } else {
     btune->max_threads = cctx->nthreads;
     best->nthreads_decomp = cctx->nthreads;
-    aux->nthreads_decomp = cctx->nthreads;
     btune->nthreads_decomp = cctx->nthreads;
   }
+  btune->requested_threads = btune->max_threads;
+  blosc_set_timestamp(&btune->cpu_checked);
+  btune->cpu_time = btune_cpus_process_time();
 
   // Aux arrays to calculate the mean
   btune->current_cratios = malloc(sizeof(double)) ;
@@ -451,7 +576,6 @@ void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx
   // cparams_hint
   if (config->cparams_hint) {
     extract_btune_cparams(cctx, btune->best);
-    extract_btune_cparams(cctx, btune->aux_cparams);
     add_codec(btune, cctx->compcode);
     if (btune->config.behaviour.nhards_before_stop > 0) {
       if (btune->config.behaviour.nsofts_before_hard > 0){
@@ -479,18 +603,164 @@ void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx
   btune_model_init(cctx);
 }
 
+void btune_init(void *tuner_params, blosc2_context * cctx, blosc2_context * dctx) {
+  btune_config *config = (btune_config *)tuner_params;
+  // Register entropy codec, once per process
+  pthread_once(&entropy_codec_once, register_entropy_codec_once);
+
+  const char *name = getenv("BTUNE_GROUP");
+  if (name == NULL && config != NULL) {
+    name = config->group;
+  }
+  if (name == NULL) {
+    btune_create(config, cctx, dctx);
+    return;
+  }
+
+  // The lock is held during creation, so that the group is only created once
+  pthread_mutex_lock(&btune_groups_lock);
+  btune_group *group = find_group(name);
+  if (group == NULL) {
+    btune_create(config, cctx, dctx);
+    group = malloc(sizeof(btune_group));
+    group->name = strdup(name);
+    group->btune = (btune_struct *) cctx->tuner_params;
+    group->refcount = 0;
+    group->next = btune_groups;
+    btune_groups = group;
+    // The dctx of the first super-chunk may be freed before the group
+    group->btune->dctx = NULL;
+    group->btune->group = group->name;
+    group->btune->config.group = group->name;
+    BTUNE_TRACE("Created tuner group '%s'", group->name);
+  } else {
+    attach_btune(group->btune, cctx);
+  }
+  group->refcount++;
+  pthread_mutex_unlock(&btune_groups_lock);
+}
+
 // Free btune_struct
 void btune_free(blosc2_context *context) {
-  btune_model_free(context);
   btune_struct *btune_params = (btune_struct *) context->tuner_params;
+  if (btune_params->group != NULL) {
+    // Grouped tuners are only freed when the last context detaches
+    pthread_mutex_lock(&btune_groups_lock);
+    btune_group **prev = &btune_groups;
+    while ((*prev)->btune != btune_params) {
+      prev = &(*prev)->next;
+    }
+    btune_group *group = *prev;
+    group->refcount--;
+    if (group->refcount > 0) {
+      pthread_mutex_unlock(&btune_groups_lock);
+      context->tuner_params = NULL;
+      return;
+    }
+    *prev = group->next;
+    pthread_mutex_unlock(&btune_groups_lock);
+    BTUNE_TRACE("Freed tuner group '%s'", group->name);
+    free(group->name);
+    free(group);
+  }
+  btune_model_free(context);
+  if (getenv("BTUNE_TRACE") != NULL) {
+    uint64_t nchunks = BTUNE_ATOMIC_LOAD(&btune_params->stats.nchunks);
+    uint64_t cbytes = BTUNE_ATOMIC_LOAD(&btune_params->stats.cbytes);
+    BTUNE_TRACE("Btune stats: chunks=%llu cratio=%.3gx ctime=%.3g s stale updates=%llu model load=%.3g s",
+                (unsigned long long) nchunks,
+                cbytes ? (double) BTUNE_ATOMIC_LOAD(&btune_params->stats.nbytes) / (double) cbytes : 0.,
+                (double) BTUNE_ATOMIC_LOAD(&btune_params->stats.ctime_ns) / 1e9,
+                (unsigned long long) BTUNE_ATOMIC_LOAD(&btune_params->stats.stale_updates),
+                btune_params->model_load_time);
+    BTUNE_TRACE("Btune warmups: discarded chunks=%llu thread respawns=%llu respawn overhead=%.3g s "
+                "first chunk overhead=%.3g s",
+                (unsigned long long) BTUNE_ATOMIC_LOAD(&btune_params->stats.warmups),
+                (unsigned long long) BTUNE_ATOMIC_LOAD(&btune_params->stats.respawns),
+                (double) BTUNE_ATOMIC_LOAD(&btune_params->stats.respawn_ns) / 1e9,
+                (double) BTUNE_ATOMIC_LOAD(&btune_params->stats.first_chunk_ns) / 1e9);
+  }
+  btune_bandit_free(btune_params->bandit);
+  free(btune_params->arms);
   free(btune_params->best);
-  free(btune_params->aux_cparams);
+  free(btune_params->candidates);
   free(btune_params->current_scores);
   free(btune_params->current_cratios);
+  pthread_mutex_destroy(&btune_params->lock);
+  pthread_mutex_destroy(&btune_params->model_lock);
+  pthread_mutex_destroy(&btune_params->dctx_lock);
   free(btune_params);
   context->tuner_params = NULL;
 }
 
+int btune_infer_chunks(blosc2_context *cctx, const void * const *srcs,
+                       const int32_t *sizes, int nchunks, btune_prediction *predictions) {
+  if (cctx->tuner_params == NULL || nchunks <= 0) {
+    return BLOSC2_ERROR_INVALID_PARAM;
+  }
+  int *categories = malloc(nchunks * sizeof(int));
+  if (categories == NULL) {
+    return BLOSC2_ERROR_MEMORY_ALLOC;
+  }
+  int rc = btune_model_inference_batch(cctx, srcs, sizes, nchunks, categories);
+  if (rc < 0) {
+    free(categories);
+    return rc;
+  }
+  int ninferred = 0;
+  for (int i = 0; i < nchunks; i++) {
+    btune_prediction *prediction = &predictions[i];
+    if (categories[i] < 0 ||
+        btune_model_category(cctx, categories[i], &prediction->compcode, &prediction->filter,
+                             &prediction->clevel, &prediction->splitmode) < 0) {
+      prediction->compcode = -1;
+      continue;
+    }
+    ninferred++;
+  }
+  free(categories);
+  return ninferred;
+}
+
+int btune_calibrate_costs(const char *calibration_file, int32_t typesize, int max_threads) {
+  static const int compcodes[] = {BLOSC_BLOSCLZ, BLOSC_LZ4, BLOSC_LZ4HC, BLOSC_ZLIB, BLOSC_ZSTD};
+  static const int filters[] = {BLOSC_NOFILTER, BLOSC_SHUFFLE, BLOSC_BITSHUFFLE,
+                                BLOSC_FILTER_BYTEDELTA};
+  int ncompcodes = sizeof(compcodes) / sizeof(compcodes[0]);
+  int nfilters = sizeof(filters) / sizeof(filters[0]);
+  if (typesize <= 0 || max_threads <= 0) {
+    return BLOSC2_ERROR_INVALID_PARAM;
+  }
+
+  // Every configuration the tuner may try, for the codecs of this blosc2 build
+  const char *all_codecs = blosc2_list_compressors();
+  btune_cost_key *keys = malloc(ncompcodes * nfilters * (BTUNE_MAX_CLEVELS + 1) * max_threads *
+                                sizeof(btune_cost_key));
+  if (keys == NULL) {
+    return BLOSC2_ERROR_MEMORY_ALLOC;
+  }
+  int nkeys = 0;
+  for (int c = 0; c < ncompcodes; c++) {
+    const char *compname;
+    blosc2_compcode_to_compname(compcodes[c], &compname);
+    if (compname == NULL || strstr(all_codecs, compname) == NULL) {
+      continue;
+    }
+    for (int f = 0; f < nfilters; f++) {
+      for (int clevel = 0; clevel <= BTUNE_MAX_CLEVELS; clevel++) {
+        for (int nthreads = 1; nthreads <= max_threads; nthreads++) {
+          btune_cost_key key = {compcodes[c], clevel, filters[f], typesize, nthreads};
+          keys[nkeys++] = key;
+        }
+      }
+    }
+  }
+  BTUNE_TRACE("Calibrating the cost of %d configurations", nkeys);
+  int rc = btune_calibration_sweep(keys, nkeys, calibration_file);
+  free(keys);
+  return rc;
+}
+
 // This must exist because unconditionally called by c-blosc2, otherwise there
 // will be a crash
 void btune_next_blocksize(blosc2_context *context) {
@@ -528,49 +798,506 @@ static void set_btune_cparams(blosc2_context * context, cparams_btune * cparams)
   }
   context->typesize = cparams->shufflesize;  // TODO typesize -> shufflesize
   context->new_nthreads = (int16_t) cparams->nthreads_comp;
-  if (btune_params->dctx != NULL) {
-    btune_params->dctx->new_nthreads = (int16_t) cparams->nthreads_decomp;
+  btune_params->nthreads_decomp = cparams->nthreads_decomp;
+  // Another chunk may be decompressing with the dctx (see btune_update), then the threads
+  // are set by the next chunk which takes it
+  blosc2_context *dctx = get_dctx(btune_params, context);
+  if (dctx != NULL && pthread_mutex_trylock(&btune_params->dctx_lock) == 0) {
+    dctx->new_nthreads = (int16_t) cparams->nthreads_decomp;
+    pthread_mutex_unlock(&btune_params->dctx_lock);
+  }
+}
+
+// The candidate handle owned by the chunk being compressed in this thread.
+// next_cparams and update are always called in pairs from the same thread.
+static _Thread_local btune_candidate *tls_candidate = NULL;
+static _Thread_local btune_struct *tls_owner = NULL;
+
+// Release a candidate handle.  A trial of the current state epoch counts as reported, and
+// the last one of an ended state lets the next state start.  Must be called with the tuner
+// lock held.
+static void release_candidate(btune_struct *btune_params, btune_candidate *candidate) {
+  if (!candidate->in_use) {
+    return;
+  }
+  candidate->in_use = false;
+  if (candidate->epoch != btune_params->epoch) {
+    return;
+  }
+  btune_params->trials_reported++;
+  if (btune_params->draining &&
+      btune_params->trials_reported >= btune_params->trials_issued) {
+    // Candidates issued from now on belong to the next state
+    btune_params->epoch++;
+    btune_params->trials_issued = 0;
+    btune_params->trials_reported = 0;
+    btune_params->trials_scored = 0;
+    btune_params->draining = false;
+  }
+}
+
+// Release the handles still owned by a previous chunk of this thread, which did not
+// reach btune_update (e.g. compression error).  Must be called with the tuner lock held.
+static void release_thread_candidates(btune_struct *btune_params) {
+  pthread_t self = pthread_self();
+  for (int i = 0; i < BTUNE_MAX_INFLIGHT; i++) {
+    btune_candidate *candidate = &btune_params->candidates[i];
+    if (candidate->in_use && pthread_equal(candidate->owner, self)) {
+      release_candidate(btune_params, candidate);
+    }
+  }
+}
+
+// Get a free candidate handle, or NULL if there are too many chunks in flight
+static btune_candidate * acquire_candidate(btune_struct *btune_params) {
+  for (int i = 0; i < BTUNE_MAX_INFLIGHT; i++) {
+    btune_candidate *candidate = &btune_params->candidates[i];
+    if (!candidate->in_use) {
+      candidate->in_use = true;
+      candidate->owner = pthread_self();
+      candidate->state = btune_params->state;
+      candidate->epoch = btune_params->epoch;
+      btune_params->trials_issued++;
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+// Relative change of the cratio which triggers a new inference in the ADAPTIVE schedule
+#define INFERENCE_CRATIO_DRIFT 1.5
+
+// Whether the current chunk must run inference, when inference is applied on every chunk
+static bool inference_scheduled(btune_struct *btune_params) {
+  if (btune_params->config.inference_schedule == BTUNE_INFER_ALWAYS) {
+    return true;
+  }
+  if (btune_params->inference_due || btune_params->inference_skip <= 0) {
+    btune_params->inference_due = false;
+    return true;
+  }
+  btune_params->inference_skip--;
+  return false;
+}
+
+// Set the number of chunks to skip after an inference which predicted category
+static void schedule_next_inference(btune_struct *btune_params, int category) {
+  btune_config *config = &btune_params->config;
+  int interval = btune_params->inference_interval;
+  switch (config->inference_schedule) {
+    case BTUNE_INFER_ALWAYS:
+      return;
+    case BTUNE_INFER_PERIODIC:
+      interval = config->inference_period;
+      break;
+    case BTUNE_INFER_BACKOFF:
+    case BTUNE_INFER_ADAPTIVE:
+      // Back off while the predictions are stable
+      if (category == btune_params->inferred_category) {
+        interval = (interval * 2 < config->inference_period) ? interval * 2 : config->inference_period;
+      } else {
+        interval = 1;
+      }
+      if (config->inference_schedule == BTUNE_INFER_ADAPTIVE &&
+          btune_model_margin(btune_params) < config->inference_margin) {
+        // The model is unsure, keep asking
+        interval = 1;
+      }
+      break;
+  }
+  btune_params->inference_interval = interval;
+  btune_params->inference_skip = interval - 1;
+  btune_params->inferred_category = category;
+  btune_params->inferred_cratio = 0;
+}
+
+// ADAPTIVE schedule: infer again as soon as the cratio moves away from the one after the last inference
+static void check_inference_drift(btune_struct *btune_params, double cratio) {
+  if (btune_params->config.inference_schedule != BTUNE_INFER_ADAPTIVE ||
+      btune_params->inference_count >= 0) {
+    return;
+  }
+  if (btune_params->inferred_cratio == 0) {
+    btune_params->inferred_cratio = cratio;
+  } else if (cratio > btune_params->inferred_cratio * INFERENCE_CRATIO_DRIFT ||
+             cratio * INFERENCE_CRATIO_DRIFT < btune_params->inferred_cratio) {
+    btune_params->inference_due = true;
+  }
+}
+
+// Filters (or codecs) whose estimated cratio is at least this fraction of the best one are tried
+#define PROBE_MARGIN 0.9
+
+// Narrow the filters tried by the hard readapts to the ones that the entropy
+// probe estimates close to the best for the chunk in context
+static void probe_filters(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->tuner_params;
+  static const uint8_t filters[ENTROPY_PROBE_NFILTERS] = {
+    BLOSC_NOFILTER, BLOSC_SHUFFLE, BLOSC_BITSHUFFLE, BLOSC_FILTER_BYTEDELTA,
+  };
+  // Probe out of the tuner lock, several chunks may do it concurrently
+  float cratios[ENTROPY_PROBE_NFILTERS];
+  int rc = btune_model_probe_filters(context, cratios);
+
+  pthread_mutex_lock(&btune_params->lock);
+  if (!btune_params->filters_probed) {
+    __atomic_store_n(&btune_params->filters_probed, true, __ATOMIC_RELEASE);
+    if (rc == 0) {
+      float best = 0;
+      for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+        best = (cratios[f] > best) ? cratios[f] : best;
+      }
+      btune_params->nfilters = 0;
+      for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+        if (cratios[f] >= best * PROBE_MARGIN) {
+          add_filter(btune_params, filters[f]);
+        }
+      }
+      BTUNE_TRACE("Filter probe cratios: nofilter=%.2f shuffle=%.2f bitshuffle=%.2f "
+                  "bytedelta=%.2f, trying %d filters",
+                  cratios[ENTROPY_PROBE_NOFILTER], cratios[ENTROPY_PROBE_SHUFFLE],
+                  cratios[ENTROPY_PROBE_BITSHUFFLE], cratios[ENTROPY_PROBE_BYTEDELTA],
+                  btune_params->nfilters);
+    }
+  }
+  pthread_mutex_unlock(&btune_params->lock);
+}
+
+// Bytes of the chunk sampled by the codec proxies
+#define CODEC_PROBE_SAMPLE (128 * 1024)
+
+// In HCR mode, narrow the codecs tried by the hard readapts to the ones that
+// the codec proxies estimate close to the best for the chunk in context
+static void probe_codecs(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->tuner_params;
+  entropy_probe_rank ranking[ENTROPY_PROBE_NCODECS];
+  int nranked = -1;
+  if (btune_params->config.tradeoff >= 0.666666) {
+    nranked = entropy_probe_rank_codecs(context->src, context->srcsize, CODEC_PROBE_SAMPLE, ranking);
+  }
+
+  pthread_mutex_lock(&btune_params->lock);
+  if (!btune_params->codecs_probed) {
+    __atomic_store_n(&btune_params->codecs_probed, true, __ATOMIC_RELEASE);
+    // The best ranked of the codecs that the hard readapts would try
+    float best = 0;
+    for (int i = 0; i < nranked; i++) {
+      for (int j = 0; j < btune_params->ncodecs; j++) {
+        if (ranking[i].compcode == btune_params->codecs[j] && ranking[i].cratio > best) {
+          best = ranking[i].cratio;
+        }
+      }
+    }
+    if (best > 0) {
+      int ncodecs = 0;
+      for (int j = 0; j < btune_params->ncodecs; j++) {
+        for (int i = 0; i < nranked; i++) {
+          if (ranking[i].compcode == btune_params->codecs[j] &&
+              ranking[i].cratio >= best * PROBE_MARGIN) {
+            btune_params->codecs[ncodecs++] = btune_params->codecs[j];
+          }
+        }
+      }
+      btune_params->ncodecs = ncodecs;
+      BTUNE_TRACE("Codec probe best cratio %.2f, trying %d codecs", best, ncodecs);
+    }
+  }
+  pthread_mutex_unlock(&btune_params->lock);
+}
+
+// Exploration strength of the LinUCB policy
+#define BANDIT_ALPHA 0.5
+// Weight of a new score in the moving average used to normalize the rewards
+#define BANDIT_REWARD_ALPHA 0.1
+
+// Create the bandit, with the categories of the model as arms, or else
+// the codecs, filters and splits that a hard readapt would sweep.
+// Returns 0, or a negative value if there are no arms or on allocation errors.
+static int bandit_init(blosc2_context *context, int ncategories) {
+  btune_struct *btune_params = (btune_struct*) context->tuner_params;
+  int nsplits = (btune_params->splitmode == BLOSC_AUTO_SPLIT) ? 2 : 1;
+  int narms;
+  btune_choice *arms;
+  if (ncategories > 0) {
+    narms = ncategories;
+    arms = malloc(narms * sizeof(btune_choice));
+    if (arms == NULL) {
+      return BLOSC2_ERROR_MEMORY_ALLOC;
+    }
+    for (int i = 0; i < narms; i++) {
+      btune_choice *arm = &arms[i];
+      btune_model_category(context, i, &arm->compcode, &arm->filter, &arm->clevel, &arm->splitmode);
+    }
   } else {
-    btune_params->nthreads_decomp = cparams->nthreads_decomp;
+    narms = btune_params->ncodecs * btune_params->nfilters * nsplits;
+    if (narms <= 0) {
+      return BLOSC2_ERROR_FAILURE;
+    }
+    arms = malloc(narms * sizeof(btune_choice));
+    if (arms == NULL) {
+      return BLOSC2_ERROR_MEMORY_ALLOC;
+    }
+    for (int i = 0; i < narms; i++) {
+      btune_choice *arm = &arms[i];
+      arm->compcode = btune_params->codecs[i / (btune_params->nfilters * nsplits)];
+      arm->filter = btune_params->filters[(i / nsplits) % btune_params->nfilters];
+      arm->clevel = btune_params->best->clevel;
+      arm->splitmode = (nsplits == 2) ? (i % 2) + 1 : btune_params->splitmode;
+    }
   }
+  btune_params->bandit = btune_bandit_new(narms, BANDIT_ALPHA);
+  if (btune_params->bandit == NULL) {
+    free(arms);
+    return BLOSC2_ERROR_MEMORY_ALLOC;
+  }
+  btune_params->arms = arms;
+  BTUNE_TRACE("LinUCB policy with %d arms (%s)", narms, (ncategories > 0) ? "model categories" : "codecs and filters");
+  return 0;
+}
+
+// Choose the cparams of the chunk with the contextual bandit.  Returns false if
+// the bandit cannot be created, and the STATES policy is used from then on.
+static bool bandit_next_cparams(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->tuner_params;
+
+  // The probe and the model loading run outside the tuner lock
+  int ncategories = 0;
+  if (btune_params->bandit == NULL) {
+    ncategories = btune_model_ncategories(context);
+  }
+  double x[BTUNE_BANDIT_DIM] = {1, 0, 0};
+  float cratio, speed;
+  if (context->srcsize >= BLOSC_MIN_BUFFERSIZE &&
+      btune_model_probe(context, &cratio, &speed) == 0 && cratio > 0 && speed > 0) {
+    x[1] = log(cratio);
+    x[2] = log(speed);
+  }
+
+  pthread_mutex_lock(&btune_params->lock);
+  if (getenv("BTUNE_TRACE") && context->schunk->nchunks == 0) {
+    printf("|    Codec   | Filter | Split | C.Level | Blocksize | Shufflesize | C.Threads | D.Threads |"
+           "   Score   |  C.Ratio   |   Btune State   | Readapt | Winner\n");
+  }
+  btune_candidate *candidate = NULL;
+  if (btune_params->bandit == NULL && ncategories != BTUNE_MODEL_NOT_READY &&
+      bandit_init(context, ncategories) < 0) {
+    BTUNE_TRACE("Cannot create the LinUCB policy, using the STATES one");
+    __atomic_store_n(&btune_params->config.policy, BTUNE_POLICY_STATES, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&btune_params->lock);
+    return false;
+  }
+  if (btune_params->bandit != NULL) {
+    candidate = acquire_candidate(btune_params);
+  }
+  if (candidate == NULL) {
+    // The model is still loading, or too many chunks in flight
+    cparams_btune best = *btune_params->best;
+    set_btune_cparams(context, &best);
+    pthread_mutex_unlock(&btune_params->lock);
+    return true;
+  }
+  tls_candidate = candidate;
+  candidate->cparams = *btune_params->best;
+  candidate->category = -1;
+  candidate->arm = btune_bandit_choose(btune_params->bandit, x);
+  memcpy(candidate->context, x, sizeof(x));
+  cparams_btune *cparams = &candidate->cparams;
+  btune_choice *arm = &btune_params->arms[candidate->arm];
+  cparams->compcode = arm->compcode;
+  cparams->filter = arm->filter;
+  cparams->clevel = arm->clevel;
+  cparams->splitmode = arm->splitmode;
+  set_btune_cparams(context, cparams);
+  if (context->blocksize > context->sourcesize) {
+    // blocksize cannot be greater than sourcesize
+    context->blocksize = context->sourcesize;
+  }
+  // As in btune_next_cparams, a chunk which pays for starting up is not rewarded
+  candidate->respawn = starts_threads(context);
+  candidate->warmup = candidate->respawn || (context->schunk->nchunks == 0);
+  pthread_mutex_unlock(&btune_params->lock);
+  return true;
+}
+
+// Feed the score of the chunk back to the bandit, with the tuner lock held
+static void bandit_update(btune_struct *btune_params, btune_candidate *candidate) {
+  cparams_btune *cparams = &candidate->cparams;
+  // Scores are normalized so that the exploration strength does not depend on the chunk size
+  if (btune_params->reward_scale == 0) {
+    btune_params->reward_scale = cparams->score;
+  } else {
+    btune_params->reward_scale += BANDIT_REWARD_ALPHA * (cparams->score - btune_params->reward_scale);
+  }
+  double reward = -cparams->score / btune_params->reward_scale;
+  btune_bandit_update(btune_params->bandit, candidate->arm, candidate->context, reward);
+
+  char winner = '-';
+  if (cparams->score < btune_params->best->score) {
+    *btune_params->best = *cparams;
+    winner = 'W';
+  }
+  if (getenv("BTUNE_TRACE") != NULL) {
+    int split = (cparams->splitmode == BLOSC_ALWAYS_SPLIT) ? 1 : 0;
+    const char *compname;
+    blosc2_compcode_to_compname(cparams->compcode, &compname);
+    printf("| %10s | %6d | %5d | %7d | %9d | %11d | %9d | %9d | %9.3g | %9.3gx | %15s | %7s | %c\n",
+           compname, cparams->filter, split, cparams->clevel,
+           (int) cparams->blocksize / BTUNE_KB, (int) cparams->shufflesize,
+           cparams->nthreads_comp, cparams->nthreads_decomp,
+           cparams->score, cparams->cratio, "LINUCB", "-", winner);
+  }
+}
+
+// Lower (or raise back) max_threads to the CPUs available (see btune_cpus_ceiling), every
+// CPUS_CHECK_INTERVAL seconds, but not in the middle of the THREADS state.  The threads
+// asked by the contexts are still the limit, and the best cparams are kept within it.
+static void check_max_threads(blosc2_context *context) {
+  btune_struct *btune_params = (btune_struct*) context->tuner_params;
+  cparams_btune *best = btune_params->best;
+  blosc_timestamp_t now;
+  blosc_set_timestamp(&now);
+  pthread_mutex_lock(&btune_params->lock);
+  bool due = (btune_params->state != THREADS) &&
+             (blosc_elapsed_secs(btune_params->threads_checked, now) >= CPUS_CHECK_INTERVAL);
+  float own_load = 0;
+  if (due) {
+    // The load of the process itself: the CPUs it used since the previous check (or since
+    // btune_init), in all its threads and not only in those of this tuner
+    double cpu_time = btune_cpus_process_time();
+    double cpu_elapsed = blosc_elapsed_secs(btune_params->cpu_checked, now);
+    if (cpu_time >= 0 && btune_params->cpu_time >= 0 && cpu_elapsed > 0) {
+      own_load = (float) ((cpu_time - btune_params->cpu_time) / cpu_elapsed);
+    }
+    btune_params->threads_checked = now;
+    btune_params->cpu_checked = now;
+    btune_params->cpu_time = cpu_time;
+  }
+  pthread_mutex_unlock(&btune_params->lock);
+  if (!due) {
+    return;
+  }
+
+  // Reading the quota and the load takes a while, do it outside the lock
+  btune_cpus cpus;
+  if (btune_cpus_get(&cpus) < 0) {
+    return;
+  }
+  int ceiling = btune_cpus_ceiling(&cpus, context->sourcesize, own_load);
+
+  pthread_mutex_lock(&btune_params->lock);
+  int max_threads = (ceiling < btune_params->requested_threads) ?
+                    ceiling : btune_params->requested_threads;
+  if (max_threads != btune_params->max_threads && btune_params->state != THREADS) {
+    BTUNE_TRACE("max_threads %d -> %d (affinity %d, quota %.2f, cores %d, L3 %d cores "
+                "and %d KB, load %.2f of which %.2f own)", btune_params->max_threads,
+                max_threads, cpus.affinity, cpus.quota, cpus.cores, cpus.l3_cores,
+                (int) (cpus.l3_size / BTUNE_KB), cpus.loadavg, own_load);
+    btune_params->max_threads = max_threads;
+    if (best->nthreads_comp > max_threads) {
+      best->nthreads_comp = max_threads;
+    }
+    if (best->nthreads_decomp > max_threads) {
+      best->nthreads_decomp = max_threads;
+    }
+  }
+  pthread_mutex_unlock(&btune_params->lock);
 }
 
 // Tune some compression parameters based on the context
 void btune_next_cparams(blosc2_context *context) {
   btune_struct *btune_params = (btune_struct*) context->tuner_params;
-  btune_config config = btune_params->config;
   int compcode;
   uint8_t filter;
   int clevel;
   int32_t splitmode;
   int error = -1;
+  bool run_inference = false;
+
+  // The handles are reclaimed by the thread which leaked them, even if it compressed
+  // with other tuners in between
+  pthread_mutex_lock(&btune_params->lock);
+  release_thread_candidates(btune_params);
+  pthread_mutex_unlock(&btune_params->lock);
+  tls_owner = btune_params;
+  tls_candidate = NULL;
+
+  if (btune_params->config.probe_filters &&
+      !__atomic_load_n(&btune_params->filters_probed, __ATOMIC_ACQUIRE)) {
+    probe_filters(context);
+  }
+  if (btune_params->config.probe_codecs &&
+      !__atomic_load_n(&btune_params->codecs_probed, __ATOMIC_ACQUIRE)) {
+    probe_codecs(context);
+  }
 
-  if (btune_params->inference_count != 0) {
-    if (btune_params->inference_count > 0) {
-      btune_params->inference_count--;
-    }
+  if (btune_params->config.limit_threads) {
+    check_max_threads(context);
+  }
 
-    error = btune_model_inference(context, &compcode, &filter, &clevel, &splitmode);
+  if (__atomic_load_n(&btune_params->config.policy, __ATOMIC_RELAXED) == BTUNE_POLICY_LINUCB &&
+      bandit_next_cparams(context)) {
+    return;
+  }
+
+  pthread_mutex_lock(&btune_params->lock);
+  if (btune_params->inference_count > 0) {
+    btune_params->inference_count--;
+    run_inference = true;
+  } else if (btune_params->inference_count < 0) {
+    run_inference = inference_scheduled(btune_params);
   } else {
     if (!btune_params->inference_ended){
-      error = most_predicted(btune_params, &compcode, &filter, &clevel, &splitmode);
+      btune_choice *choices = btune_params->choices;
+      int nchoices = btune_model_best_categories(btune_params, choices,
+                                                 btune_params->config.topk,
+                                                 btune_params->config.topk_mass);
+      if (nchoices > 0) {
+        compcode = choices[0].compcode;
+        filter = choices[0].filter;
+        clevel = choices[0].clevel;
+        splitmode = choices[0].splitmode;
+        btune_params->nchoices = nchoices;
+        error = 0;
+        BTUNE_TRACE("Trying %d categories predicted by the model", nchoices);
+      }
       btune_params->inference_ended = true;
     }
   }
+  pthread_mutex_unlock(&btune_params->lock);
+
+  // The probe and the model run outside the tuner lock, so that other chunks can proceed
+  int category = -1;
+  if (run_inference) {
+    error = btune_model_inference(context, &compcode, &filter, &clevel, &splitmode);
+    if (error >= 0) {
+      category = error;
+      error = 0;
+    }
+    if (error == BTUNE_MODEL_NOT_READY || error == BTUNE_MODEL_UNAVAILABLE) {
+      pthread_mutex_lock(&btune_params->lock);
+      if (error == BTUNE_MODEL_UNAVAILABLE) {
+        btune_params->inference_count = 0;
+      } else if (btune_params->inference_count >= 0) {
+        // Model still loading, this chunk does not count as an inference
+        btune_params->inference_count++;
+      } else {
+        btune_params->inference_due = true;
+      }
+      pthread_mutex_unlock(&btune_params->lock);
+    }
+  }
 
+  pthread_mutex_lock(&btune_params->lock);
+  btune_config config = btune_params->config;
+  if (category >= 0 && btune_params->inference_count < 0) {
+    schedule_next_inference(btune_params, category);
+  }
   if (error == 0) {
     btune_params->codecs[0] = compcode;
     btune_params->ncodecs = 1;
     btune_params->filters[0] = filter;
     btune_params->nfilters = 1;
-    if (config.perf_mode == BTUNE_PERF_DECOMP) {
-      btune_init_clevels(btune_params, clevel, clevel, clevel);
-    }
-    else {
-      int min = (clevel > 1) ? (clevel - 1) : clevel;
-      int max = (clevel < 9) ? (clevel + 1) : clevel;
-      btune_init_clevels(btune_params, min, max, clevel);
-    }
+    init_inferred_clevels(btune_params, clevel);
   }
 
   int nchunk = context->schunk->nchunks;
@@ -579,16 +1306,70 @@ void btune_next_cparams(blosc2_context *context) {
            "   Score   |  C.Ratio   |   Btune State   | Readapt | Winner\n");
   }
 
-  *btune_params->aux_cparams = *btune_params->best;
-  cparams_btune *cparams = btune_params->aux_cparams;
+  if (btune_params->state == STOP) {
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
+  // Once a state has ended, no more trials are issued until the ones in flight have reported
+  btune_candidate *candidate = btune_params->draining ? NULL : acquire_candidate(btune_params);
+  if (candidate == NULL) {
+    // Too many chunks in flight, or the state is ending: just use the best cparams
+    // without tuning
+    cparams_btune best = *btune_params->best;
+    set_btune_cparams(context, &best);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
+  tls_candidate = candidate;
+  candidate->cparams = *btune_params->best;
+  candidate->category = -1;
+  candidate->arm = -1;
+  cparams_btune *cparams = &candidate->cparams;
+
+  if (btune_params->retry) {
+    btune_params->retry = false;
+    if (btune_params->retry_epoch == btune_params->epoch) {
+      // Time again the cparams of a chunk which paid for starting up, now warm
+      *cparams = btune_params->retry_cparams;
+      candidate->respawn = false;
+      candidate->warmup = false;
+      set_btune_cparams(context, cparams);
+      if (context->blocksize > context->sourcesize) {
+        context->blocksize = context->sourcesize;
+      }
+      pthread_mutex_unlock(&btune_params->lock);
+      return;
+    }
+  }
 
   switch(btune_params->state){
     // Tune codec and filter
     case CODEC_FILTER: {
+      if (btune_params->nchoices > 1) {
+        // Cycle the categories predicted by the model, and splits
+        // (wrap around when more chunks are in flight than trials left)
+        int nsplits = (btune_params->splitmode == BLOSC_AUTO_SPLIT) ? 2 : 1;
+        int index = btune_params->aux_index % (btune_params->nchoices * nsplits);
+        btune_choice *choice = &btune_params->choices[index / nsplits];
+        cparams->compcode = choice->compcode;
+        cparams->filter = choice->filter;
+        cparams->clevel = choice->clevel;
+        if (btune_params->splitmode == BLOSC_AUTO_SPLIT) {
+          cparams->splitmode = (index % 2) + 1;
+        }
+        else {
+          cparams->splitmode = btune_params->splitmode;
+        }
+        btune_params->aux_index++;
+        break;
+      }
+
       // Cycle codecs, filters and splits
+      // (wrap around when more chunks are in flight than trials left)
       int n_filters_splits = btune_params->nfilters * 2;
-      cparams->compcode = btune_params->codecs[btune_params->aux_index / n_filters_splits];
-      cparams->filter = btune_params->filters[(btune_params->aux_index % n_filters_splits) / 2];
+      int index = btune_params->aux_index % (btune_params->ncodecs * n_filters_splits);
+      cparams->compcode = btune_params->codecs[index / n_filters_splits];
+      cparams->filter = btune_params->filters[(index % n_filters_splits) / 2];
 
       if (btune_params->splitmode == BLOSC_AUTO_SPLIT) {
         cparams->splitmode = (btune_params->aux_index % 2) + 1;
@@ -629,14 +1410,32 @@ void btune_next_cparams(blosc2_context *context) {
       break;
 
       // Tune the number of threads
-    case THREADS:
-      btune_params->aux_index++;
+    case THREADS: {
       int * nthreads;
       if (btune_params->threads_for_comp) {
         nthreads = &cparams->nthreads_comp;
       } else {
         nthreads = &cparams->nthreads_decomp;
       }
+      if (config.thread_search == BTUNE_THREADS_FIT) {
+        // The aux_index only tells the first search of BALANCED from the second one
+        if (btune_params->aux_index % MAX_STATE_THREADS == 0) {
+          btune_params->aux_index++;
+        }
+        if (btune_params->nthread_trials == 0) {
+          btune_threads_fit_init(&btune_params->threads_fit, btune_params->max_threads);
+        }
+        btune_threads_fit *fit = &btune_params->threads_fit;
+        if (fit->knee > 0) {
+          *nthreads = fit->knee;
+        } else {
+          // (wrap around when more chunks are in flight than counts left)
+          *nthreads = fit->counts[btune_params->nthread_trials % fit->ncounts];
+        }
+        btune_params->nthread_trials++;
+        break;
+      }
+      btune_params->aux_index++;
       if (cparams->increasing_nthreads) {
         if (*nthreads < btune_params->max_threads) {
           (*nthreads)++;
@@ -647,6 +1446,7 @@ void btune_next_cparams(blosc2_context *context) {
         }
       }
       break;
+    }
 
       // Tune compression level
     case CLEVEL:
@@ -678,15 +1478,49 @@ void btune_next_cparams(blosc2_context *context) {
       btune_params->nwaitings++;
       break;
 
-      // Stopped
+      // Stopped (handled above)
     case STOP:
-      return;
+      break;
+  }
+  if (category >= 0 && cparams->compcode == compcode && cparams->filter == filter) {
+    // The chunk is compressed as predicted, its score tells how good the category is
+    candidate->category = category;
   }
   set_btune_cparams(context, cparams);
   if (context->blocksize > context->sourcesize) {
     // blocksize cannot be greater than sourcesize
     context->blocksize = context->sourcesize;
   }
+  // Starting the threads, or the first chunk (allocations, page faults), would bias the timing
+  candidate->respawn = starts_threads(context);
+  candidate->warmup = candidate->respawn || (context->schunk->nchunks == 0);
+  pthread_mutex_unlock(&btune_params->lock);
+}
+
+// Look up the calibrated cost of cparams with nthreads threads.  The costs are not
+// measured here, but beforehand with btune_calibrate_costs.
+static bool find_cost(btune_struct *btune_params, blosc2_context *context,
+                      cparams_btune *cparams, int nthreads, btune_cost *cost) {
+  btune_cost_key key = {cparams->compcode, cparams->clevel, cparams->filter,
+                        context->typesize, nthreads};
+  return btune_calibration_cost(&key, btune_params->config.calibration_file, cost) == 0;
+}
+
+// Blend the measured time of a chunk with the one modeled from the cost of its cparams.
+// The microbenchmarks are not run here: if the chunk size has not been calibrated (by the
+// speed feature, or beforehand), the model leaves out the extra time of copying the chunk.
+static double blend_modeled_time(btune_struct *btune_params, blosc2_context *context,
+                                 const btune_cost *cost, size_t cbytes, double time, bool decomp) {
+  double weight = btune_params->config.cost_model;
+  btune_calibration calib;
+  btune_calibration *chunk_calib = NULL;
+  if (btune_calibration_lookup(context->sourcesize, btune_params->config.calibration_file,
+                               &calib) == 0) {
+    chunk_calib = &calib;
+  }
+  double modeled = btune_cost_time(cost, chunk_calib, context->sourcesize, (int64_t) cbytes,
+                                   decomp);
+  return weight * modeled + (1 - weight) * time;
 }
 
 // Computes the score depending on the perf_mode
@@ -864,21 +1698,64 @@ static void process_waiting_state(blosc2_context *ctx) {
   }
 }
 
+// Move the FIT thread search on, once all the counts are sampled or the knee is tried
+static void update_threads_fit(btune_struct *btune_params) {
+  cparams_btune *best = btune_params->best;
+  if (btune_params->threads_fit.knee == 0) {
+    if (!btune_threads_fit_sampled(&btune_params->threads_fit)) {
+      return;
+    }
+    int knee = fit_threads_knee(btune_params);
+    int nthreads = btune_params->threads_for_comp ? best->nthreads_comp : best->nthreads_decomp;
+    if (knee != nthreads) {
+      // Try the knee, once the samples still in flight have reported
+      btune_params->threads_fit.knee = knee;
+      btune_params->draining = true;
+      return;
+    }
+  }
+
+  btune_params->nthread_trials = 0;
+  // If perf_mode BALANCED search the threads for decompression too
+  if (btune_params->config.perf_mode == BTUNE_PERF_BALANCED &&
+      btune_params->aux_index < MAX_STATE_THREADS) {
+    btune_params->threads_for_comp = !btune_params->threads_for_comp;
+    btune_params->aux_index = MAX_STATE_THREADS;
+    btune_params->draining = true;
+  } else {
+    btune_params->aux_index = 0;
+    btune_params->state = CLEVEL;
+    if (has_ended_clevel(btune_params)) {
+      best->increasing_clevel = !best->increasing_clevel;
+    }
+  }
+}
+
 // State transition handling
 static void update_aux(blosc2_context * ctx, bool improved) {
   btune_struct *btune_params = (btune_struct *) ctx->tuner_params;
   cparams_btune *best = btune_params->best;
-  bool first_time = btune_params->aux_index == 1;
+  // The first trial of the state to report, whatever the number issued meanwhile
+  bool first_time = btune_params->trials_scored == 1;
   switch (btune_params->state) {
     case CODEC_FILTER: {
       // Reached last combination of codec filter
       int aux_index_max = btune_params->ncodecs *  btune_params->nfilters;
+      if (btune_params->nchoices > 1) {
+        aux_index_max = btune_params->nchoices;
+      }
       if (btune_params->splitmode == BLOSC_AUTO_SPLIT) {
         aux_index_max *= 2;
       }
 
       if (btune_params->aux_index >= aux_index_max) {
         btune_params->aux_index = 0;
+        if (btune_params->nchoices > 1) {
+          // Tune the clevel around the one of the winner category
+          btune_params->codecs[0] = best->compcode;
+          btune_params->filters[0] = best->filter;
+          init_inferred_clevels(btune_params, best->clevel);
+        }
 
         int32_t shufflesize = best->shufflesize;
         // Is shufflesize valid or not
@@ -934,7 +1811,10 @@ static void update_aux(blosc2_context * ctx, bool improved) {
       break;
 
     case THREADS:
-      first_time = (btune_params->aux_index % MAX_STATE_THREADS) == 1;
+      if (btune_params->config.thread_search == BTUNE_THREADS_FIT) {
+        update_threads_fit(btune_params);
+        break;
+      }
       if (!improved && first_time) {
         best->increasing_nthreads = !best->increasing_nthreads;
       }
@@ -945,6 +1825,8 @@ static void update_aux(blosc2_context * ctx, bool improved) {
           if (btune_params->aux_index < MAX_STATE_THREADS) {
             btune_params->threads_for_comp = !btune_params->threads_for_comp;
             btune_params->aux_index = MAX_STATE_THREADS;
+            // The search for decompression starts once the compression trials have reported
+            btune_params->draining = true;
             if (has_ended_threads(btune_params)) {
               best->increasing_nthreads = !best->increasing_nthreads;
             }
@@ -988,47 +1870,194 @@ static void update_aux(blosc2_context * ctx, bool improved) {
   }
 }
 
+/*
+ * The time of compressing the chunk of context again with cparams, in a context of its
+ * own whose threads are started and buffers touched by a first compression, out of the
+ * timing.  Returns 0 if it cannot be measured (e.g. the chunk comes from a prefilter).
+ */
+static double warm_ctime(blosc2_context *context, const cparams_btune *cparams) {
+  if (context->src == NULL || context->prefilter != NULL) {
+    return 0;
+  }
+  blosc2_cparams params = BLOSC2_CPARAMS_DEFAULTS;
+  params.compcode = context->compcode;
+  params.compcode_meta = context->compcode_meta;
+  params.clevel = context->clevel;
+  params.typesize = context->typesize;
+  params.nthreads = (int16_t) cparams->nthreads_comp;
+  params.blocksize = context->blocksize;
+  params.splitmode = context->splitmode;
+  for (int i = 0; i < BLOSC2_MAX_FILTERS; i++) {
+    params.filters[i] = context->filters[i];
+    params.filters_meta[i] = context->filters_meta[i];
+  }
+  int32_t destsize = context->sourcesize + BLOSC2_MAX_OVERHEAD;
+  void *dest = malloc(destsize);
+  blosc2_context *cctx = blosc2_create_cctx(params);
+  double time = 0;
+  if (dest != NULL && cctx != NULL &&
+      blosc2_compress_ctx(cctx, context->src, context->sourcesize, dest, destsize) > 0) {
+    blosc_timestamp_t last, current;
+    blosc_set_timestamp(&last);
+    int csize = blosc2_compress_ctx(cctx, context->src, context->sourcesize, dest, destsize);
+    blosc_set_timestamp(&current);
+    if (csize > 0) {
+      time = blosc_elapsed_secs(last, current);
+    }
+  }
+  if (cctx != NULL) {
+    blosc2_free_ctx(cctx);
+  }
+  free(dest);
+  return time;
+}
+
 // Update btune structs with the compression results
 void btune_update(blosc2_context * context, double ctime) {
   btune_struct *btune_params = (btune_struct*)(context->tuner_params);
-  if (btune_params->state == STOP) {
-    return;
-  }
-
-  btune_params->steps_count++;
-  cparams_btune * cparams = btune_params->aux_cparams;
 
   // We come from blosc_compress_context(), so we can populate metrics now
   size_t cbytes = context->destsize;
+  BTUNE_ATOMIC_ADD(&btune_params->stats.nchunks, 1);
+  BTUNE_ATOMIC_ADD(&btune_params->stats.nbytes, (uint64_t) context->sourcesize);
+  BTUNE_ATOMIC_ADD(&btune_params->stats.cbytes, (uint64_t) cbytes);
+  BTUNE_ATOMIC_ADD(&btune_params->stats.ctime_ns, (uint64_t) (ctime * 1e9));
+
+  // In pipelined mode, let the probe of the chunk finish, for its prediction to be ready
+  btune_model_pipeline_wait(context);
+
+  // Take ownership of the candidate issued by btune_next_cparams in this thread
+  btune_candidate *candidate = (tls_owner == btune_params) ? tls_candidate : NULL;
+  tls_candidate = NULL;
+  if (candidate == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&btune_params->lock);
+  bool stale = (candidate->epoch != btune_params->epoch) || (btune_params->state == STOP);
+  btune_state state = btune_params->state;
+  btune_behaviour behaviour = btune_params->config.behaviour;
+  bool measure_dtime = !((state == WAITING) &&
+                         ((behaviour.nwaits_before_readapt == 0) ||
+                          (btune_params->nwaitings % behaviour.nwaits_before_readapt != 0))) &&
+                       ((btune_params->config.perf_mode == BTUNE_PERF_DECOMP) ||
+                        (btune_params->config.perf_mode == BTUNE_PERF_BALANCED));
+  // The timing of a chunk which paid for starting up is discarded, and its cparams retried
+  bool discard = candidate->warmup && (state != STOP);
+  pthread_mutex_unlock(&btune_params->lock);
+  if (stale) {
+    // The state machine moved on while this chunk was being compressed
+    BTUNE_ATOMIC_ADD(&btune_params->stats.stale_updates, 1);
+    pthread_mutex_lock(&btune_params->lock);
+    release_candidate(btune_params, candidate);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
+  BTUNE_ATOMIC_ADD(&btune_params->steps_count, 1);
+  cparams_btune * cparams = &candidate->cparams;
   double dtime = 0;
+  // The configurations which were not calibrated keep their measured times
+  btune_cost ccost, dcost;
+  bool ccost_known = false;
+  bool dcost_known = false;
+  if (btune_params->config.cost_model > 0.) {
+    ccost_known = find_cost(btune_params, context, cparams, cparams->nthreads_comp, &ccost);
+    dcost_known = measure_dtime &&
+                  find_cost(btune_params, context, cparams, cparams->nthreads_decomp, &dcost);
+  }
+  if ((btune_params->config.cost_model >= 1. && dcost_known) || discard) {
+    // The times are fully modeled (or discarded), do not waste time decompressing
+    measure_dtime = false;
+  }
+  if (discard && getenv("BTUNE_TRACE") != NULL) {
+    // The overhead of starting up, on the same data as for decompression below: the time
+    // of the chunk minus the one of compressing it again once warm.  This compresses the
+    // chunk twice more, so it is only measured for the trace.
+    double warm_time = warm_ctime(context, cparams);
+    if (warm_time > 0) {
+      int64_t overhead_ns = (int64_t) ((ctime - warm_time) * 1e9);
+      if (candidate->respawn) {
+        BTUNE_ATOMIC_ADD(&btune_params->stats.respawns, 1);
+        BTUNE_ATOMIC_ADD(&btune_params->stats.respawn_ns, overhead_ns);
+      } else {
+        BTUNE_ATOMIC_ADD(&btune_params->stats.first_chunk_ns, overhead_ns);
+      }
+    }
+  }
 
   // Compute the decompression time if needed
-  btune_behaviour behaviour = btune_params->config.behaviour;
   blosc_timestamp_t last, current;
-  if (!((btune_params->state == WAITING) &&
-      ((behaviour.nwaits_before_readapt == 0) ||
-      (btune_params->nwaitings % behaviour.nwaits_before_readapt != 0))) &&
-      ((btune_params->config.perf_mode == BTUNE_PERF_DECOMP) ||
-      (btune_params->config.perf_mode == BTUNE_PERF_BALANCED)) &&
-       // When the source is NULL (eval with prefilters), decompression is not working.
-       context->dest != NULL) {
-    blosc2_context * dctx;
-    if (btune_params->dctx == NULL) {
-      blosc2_dparams params = { btune_params->nthreads_decomp, NULL, NULL, NULL};
+  // When the source is NULL (eval with prefilters), decompression is not working.
+  if (measure_dtime && context->dest != NULL) {
+    blosc2_context * dctx = get_dctx(btune_params, context);
+    bool own_dctx = (dctx == NULL) || (pthread_mutex_trylock(&btune_params->dctx_lock) != 0);
+    if (own_dctx) {
+      // Either there is no dctx, or it is being used by another thread
+      blosc2_dparams params = { cparams->nthreads_decomp, NULL, NULL, NULL};
       dctx = blosc2_create_dctx(params);
     } else {
-      dctx = btune_params->dctx;
+      dctx->new_nthreads = (int16_t) cparams->nthreads_decomp;
+    }
+    double warmup_dtime = 0;
+    if (starts_threads(dctx)) {
+      // Start the threads out of the timing
+      blosc_set_timestamp(&last);
+      blosc2_decompress_ctx(dctx, context->dest, context->destsize, (void*)(context->src),
+                            context->sourcesize);
+      blosc_set_timestamp(&current);
+      warmup_dtime = blosc_elapsed_secs(last, current);
     }
     blosc_set_timestamp(&last);
     blosc2_decompress_ctx(dctx, context->dest, context->destsize, (void*)(context->src),
                           context->sourcesize);
     blosc_set_timestamp(&current);
     dtime = blosc_elapsed_secs(last, current);
-    if (btune_params->dctx == NULL) {
+    if (warmup_dtime > 0) {
+      // The same chunk, so the difference is the overhead of starting the threads
+      BTUNE_ATOMIC_ADD(&btune_params->stats.respawns, 1);
+      BTUNE_ATOMIC_ADD(&btune_params->stats.respawn_ns, (int64_t) ((warmup_dtime - dtime) * 1e9));
+    }
+    if (own_dctx) {
       blosc2_free_ctx(dctx);
+    } else {
+      pthread_mutex_unlock(&btune_params->dctx_lock);
     }
   }
+  if (ccost_known) {
+    ctime = blend_modeled_time(btune_params, context, &ccost, cbytes, ctime, false);
+  }
+  if (dcost_known) {
+    dtime = blend_modeled_time(btune_params, context, &dcost, cbytes, dtime, true);
+  }
 
+  pthread_mutex_lock(&btune_params->lock);
+  if (candidate->epoch != btune_params->epoch) {
+    // Another chunk moved the state machine while we were measuring
+    BTUNE_ATOMIC_ADD(&btune_params->stats.stale_updates, 1);
+    release_candidate(btune_params, candidate);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
+  if (discard && candidate->arm >= 0) {
+    // The bandit chooses again for the next chunk, there is nothing to retry
+    BTUNE_ATOMIC_ADD(&btune_params->stats.warmups, 1);
+    BTUNE_TRACE("Discarding the timing of a chunk which %s, not rewarding its arm",
+                candidate->respawn ? "started the threads" : "is the first one");
+    release_candidate(btune_params, candidate);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
+  if (discard) {
+    BTUNE_ATOMIC_ADD(&btune_params->stats.warmups, 1);
+    BTUNE_TRACE("Discarding the timing of a chunk which %s, retrying its cparams",
+                candidate->respawn ? "started the threads" : "is the first one");
+    btune_params->retry = true;
+    btune_params->retry_cparams = *cparams;
+    btune_params->retry_epoch = candidate->epoch;
+    release_candidate(btune_params, candidate);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
   double score = score_function(btune_params, ctime, cbytes, dtime);
   assert(score > 0);
   double cratio = (double) context->sourcesize / (double) cbytes;
@@ -1037,6 +2066,16 @@ void btune_update(blosc2_context * context, double ctime) {
   cparams->cratio = cratio;
   cparams->ctime = ctime;
   cparams->dtime = dtime;
+  if (candidate->category >= 0) {
+    btune_model_score(btune_params, candidate->category, score);
+  }
+  check_inference_drift(btune_params, cratio);
+  if (candidate->arm >= 0) {
+    bandit_update(btune_params, candidate);
+    release_candidate(btune_params, candidate);
+    pthread_mutex_unlock(&btune_params->lock);
+    return;
+  }
   btune_params->current_scores[btune_params->rep_index] = score;
   btune_params->current_cratios[btune_params->rep_index] = cratio;
   btune_params->rep_index++;
@@ -1046,8 +2085,18 @@ void btune_update(blosc2_context * context, double ctime) {
     double cratio_coef = cratio / btune_params->best->cratio;
     double score_coef = btune_params->best->score / score;
     bool improved;
-    // In state THREADS the improvement comes from ctime or dtime
-    if (btune_params->state == THREADS) {
+    // In state THREADS the improvement comes from ctime or dtime.  The late trials of an
+    // ended state only compete on their score, as the thread search may have moved on.
+    bool threads = (btune_params->state == THREADS) && !btune_params->draining;
+    if (threads && btune_params->config.thread_search == BTUNE_THREADS_FIT) {
+      if (btune_params->threads_for_comp) {
+        improved = btune_threads_fit_record(&btune_params->threads_fit, cparams->nthreads_comp,
+                                            ctime, btune_params->best->ctime);
+      } else {
+        improved = btune_threads_fit_record(&btune_params->threads_fit, cparams->nthreads_decomp,
+                                            dtime, btune_params->best->dtime);
+      }
+    } else if (threads) {
       if (btune_params->threads_for_comp) {
         improved = ctime < btune_params->best->ctime;
       } else {
@@ -1086,8 +2135,20 @@ void btune_update(blosc2_context * context, double ctime) {
       *btune_params->best = *cparams;
     }
     btune_params->rep_index = 0;
-    update_aux(context, improved);
+    // The late trials of an ended state may still win, but the next state is already set
+    if (!btune_params->draining) {
+      btune_params->trials_scored++;
+      btune_state old_state = btune_params->state;
+      update_aux(context, improved);
+      if (btune_params->state != old_state ||
+          (btune_params->aux_index == 0 && btune_params->state != WAITING)) {
+        // The next state starts once the trials still in flight have reported
+        btune_params->draining = true;
+      }
+    }
   }
+  release_candidate(btune_params, candidate);
+  pthread_mutex_unlock(&btune_params->lock);
 }
 
 // Blosc2 needs this in order to dynamically load the functions
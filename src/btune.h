@@ -30,7 +30,7 @@
 #define BTUNE_VERSION_STRING "1.0.1.dev"
 // Maximum number of codecs
 #define BTUNE_MAX_CODECS 8
-#define BTUNE_MAX_FILTERS 3
+#define BTUNE_MAX_FILTERS 4
 #define BTUNE_MAX_CLEVELS 9
 
 #define BTUNE_TRACE(msg, ...) \
@@ -65,9 +65,9 @@ enum bandwidth_units{
  * Depending on this value Btune will prioritize the compression/decompression speed,
  * the compression ratio or both.
 */
-float const BTUNE_COMP_HSP = 0.1;       //!< Optimizes the speed, even accepting memcpy.
-float const BTUNE_COMP_BALANCED = 0.5;  //!< Optimizes both, the speed and compression ratio.
-float const BTUNE_COMP_HCR = 0.9;       //!< Optimizes the compression ratio.
+static float const BTUNE_COMP_HSP = 0.1;       //!< Optimizes the speed, even accepting memcpy.
+static float const BTUNE_COMP_BALANCED = 0.5;  //!< Optimizes both, the speed and compression ratio.
+static float const BTUNE_COMP_HCR = 0.9;       //!< Optimizes the compression ratio.
 
 /**
  * @brief Performance mode enumeration.
@@ -83,6 +83,64 @@ typedef enum {
   BTUNE_PERF_AUTO,     //!< Gets mode from environment variable, defaults to PERF_COMP
 } btune_performance_mode;
 
+/**
+ * @brief Model load mode enumeration.
+ *
+ * Determines when the model files are loaded.  Until the model is ready, Btune
+ * keeps tuning without inference, so the first chunks are never blocked on model I/O.
+*/
+typedef enum {
+  BTUNE_LOAD_BACKGROUND, //!< Load the model in a background thread started by btune_init.
+  BTUNE_LOAD_LAZY,       //!< Load the model the first time inference is needed.
+  BTUNE_LOAD_EAGER,      //!< Load the model synchronously in btune_init.
+} btune_load_mode;
+
+/**
+ * @brief Inference schedule enumeration.
+ *
+ * When inference is applied on every chunk (use_inference is -1), determines which
+ * chunks are actually probed and fed to the model.  The other chunks keep the
+ * category of the last inference.
+*/
+typedef enum {
+  BTUNE_INFER_ALWAYS,   //!< Run inference on every chunk.
+  BTUNE_INFER_PERIODIC, //!< Run inference every inference_period chunks.
+  BTUNE_INFER_BACKOFF,  //!< Double the interval while the prediction does not change, up to inference_period.
+  BTUNE_INFER_ADAPTIVE, //!< Like BACKOFF, but re-infer at once if the cratio moves or the model is unsure.
+} btune_inference_schedule;
+
+/**
+ * @brief Probe sampling enumeration.
+ *
+ * Where the windows examined by the entropy probe are placed in every block.
+ * @see #btune_config.probe_windows
+*/
+typedef enum {
+  BTUNE_PROBE_EVEN,   //!< At the start of every stratum of the block.
+  BTUNE_PROBE_RANDOM, //!< At a random (but reproducible) offset of every stratum.
+} btune_probe_sampling;
+
+/**
+ * @brief Thread search enumeration.
+ *
+ * How the THREADS state looks for the best number of threads.
+ * @see #btune_config.thread_search
+*/
+typedef enum {
+  BTUNE_THREADS_STEP, //!< Add (or remove) one thread per chunk while the times improve.
+  BTUNE_THREADS_FIT,  //!< Sample the powers of two, fit a scaling curve and jump to its knee.
+} btune_thread_search;
+
+/**
+ * @brief Tuning policy enumeration.
+ *
+ * Determines how the compression parameters of every chunk are chosen.
+*/
+typedef enum {
+  BTUNE_POLICY_STATES, //!< Go through the readapt states (and the model predictions, if any).
+  BTUNE_POLICY_LINUCB, //!< Choose per chunk with a contextual bandit fed with the entropy probe.
+} btune_policy;
+
 /**
  * @brief Repeat mode enumeration.
  *
@@ -154,6 +212,127 @@ typedef struct {
   //!< Number of times inference is applied. If -1, always apply inference.
   const char *models_dir;
   //!< The directory where the desired models and meta to use are stored.
+  const char *group;
+  /**< The name of the tuner group to attach to, or NULL for a private tuner.
+   *
+   * All the contexts initialized with the same group name share a single tuner,
+   * so that what is learned from one super-chunk benefits the others, and the
+   * readapt sweeps and model loading are done once per group.  The contexts in a
+   * group are expected to share the same data profile (typesize, chunkshape...).
+   * The configuration of the first context in the group is the one in effect.
+  */
+  btune_load_mode model_load;
+  //!< When to load the model files.  Equivalent to BTUNE_MODEL_LOAD.
+  bool pipeline_inference;
+  /**< Whether to run the entropy probe and the model in a helper thread.
+   *
+   * When true, the features of a chunk are extracted and the model run while the
+   * chunk is being compressed, out of the critical path, and the prediction is used
+   * for the next chunk.  Useful for streams of similar chunks with inference on
+   * every chunk.  Equivalent to BTUNE_PIPELINE.
+  */
+  int topk;
+  /**< Maximum number of categories predicted by the model to try after inference.
+   *
+   * Once inference has ended, the CODEC_FILTER state tries the most likely categories
+   * instead of just the most predicted one, so that a wrong prediction can be corrected
+   * with a few trials.  1 disables this.  Equivalent to BTUNE_TOPK.
+  */
+  float topk_mass;
+  /**< Stop adding categories to try once they add up to this probability mass.
+   *
+   * Between 0 and 1, so that only the top category is tried when the model is confident.
+   * Equivalent to BTUNE_TOPK_MASS.
+  */
+  int norm_prior;
+  /**< How to normalize the features of the chunks before feeding them to the model.
+   *
+   * If -1, use the statistics of the training set only.  Else, the statistics of the
+   * chunks seen are used, blended with the training ones as if these came from
+   * norm_prior chunks.  Equivalent to BTUNE_NORM_PRIOR.
+  */
+  const char *state_file;
+  /**< The file where the tuner state (e.g. the feature statistics) is kept between runs.
+   *
+   * The statistics of every model file are kept apart.  If NULL, nothing is persisted.
+   * Equivalent to BTUNE_STATE_FILE.
+  */
+  btune_policy policy;
+  /**< How the compression parameters are chosen.
+   *
+   * With BTUNE_POLICY_LINUCB, the categories of the model (or the codecs and filters
+   * when there is no model) are the arms of a LinUCB bandit whose context is made of
+   * the features of the chunk, and whose reward is the score of the chunk.  The
+   * choice is then made per chunk, instead of per readapt.  Equivalent to BTUNE_POLICY.
+  */
+  btune_inference_schedule inference_schedule;
+  //!< Which chunks run inference when use_inference is -1.  Equivalent to BTUNE_INFERENCE_SCHEDULE.
+  int inference_period;
+  //!< The interval of PERIODIC, and the maximum interval of BACKOFF and ADAPTIVE.  Equivalent to BTUNE_INFERENCE_PERIOD.
+  float inference_margin;
+  /**< With ADAPTIVE, keep inferring every chunk while the probability of the top category
+   * exceeds the one of the second by less than this.  Equivalent to BTUNE_INFERENCE_MARGIN.
+  */
+  int probe_windows;
+  /**< Number of windows the entropy probe examines in every block.
+   *
+   * The block is split in as many strata, and a window is probed in each of them, so
+   * that the estimates are representative of the whole block (e.g. a header followed
+   * by a payload).  The cost of the probe grows with probe_windows * probe_window_size.
+   * Equivalent to BTUNE_PROBE_WINDOWS.
+  */
+  int probe_window_size;
+  //!< The size of the windows, up to 8 KB.  Equivalent to BTUNE_PROBE_WINDOW_SIZE.
+  btune_probe_sampling probe_sampling;
+  //!< Where the windows are placed in their strata.  Equivalent to BTUNE_PROBE_SAMPLING.
+  bool probe_filters;
+  /**< Narrow the filters tried by the first hard readapt with the entropy probe.
+   *
+   * The first chunk is probed after shuffle, bitshuffle and bytedelta, and only the
+   * filters whose estimated cratio is close to the best one are tried.  Equivalent
+   * to BTUNE_PROBE_FILTERS.
+  */
+  bool probe_codecs;
+  /**< Narrow the codecs tried by the first hard readapt with the codec proxies.
+   *
+   * With a tradeoff favouring the cratio (HCR), the first chunk is costed in the
+   * formats of ZSTD and ZLIB, and only the codecs whose estimated cratio is close
+   * to the best one are tried.  Equivalent to BTUNE_PROBE_CODECS.
+  */
+  const char *calibration_file;
+  /**< The file where the calibration of the machine (the reference speeds) is kept between runs.
+   *
+   * The calibration is only reused on machines with the same CPU model and number of
+   * cores.  If NULL, the machine is calibrated once per process.  Equivalent to
+   * BTUNE_CALIBRATION_FILE.
+  */
+  float cost_model;
+  /**< The weight of the modeled times in the score of the chunks, between 0 and 1.
+   *
+   * The cost of every configuration (codec, clevel, filter, typesize and threads) is
+   * calibrated beforehand with btune_calibrate_costs() on reference data sets, and the
+   * times of a chunk are modeled from its size and cratio.  With 0, only the measured
+   * times are used; with 1, only the modeled ones, so that the choices do not depend on
+   * the load of the machine.  The configurations which are not in calibration_file keep
+   * their measured times.  Equivalent to BTUNE_COST_MODEL.
+  */
+  btune_thread_search thread_search;
+  /**< How the THREADS state searches the number of threads.
+   *
+   * FIT tries 1 thread and the powers of two up to the maximum, stopping early when doubling
+   * the threads stops helping (e.g. once the memory bandwidth is saturated), fits the
+   * Amdahl/USL scaling curve to the times and tries the fewest threads within 5% of its
+   * minimum.  It takes a handful of chunks regardless of the number of cores.
+   * Equivalent to BTUNE_THREAD_SEARCH (STEP or FIT).
+  */
+  bool limit_threads;
+  /**< Limit the threads tuned to the CPUs actually available, besides the ones of the contexts.
+   *
+   * These are the CPUs of the affinity mask, within the cgroup CPU quota, counting the SMT
+   * siblings once, and minus the load average of the other processes.  If a chunk fits in
+   * the L3 cache, only the cores sharing it are used.  They are checked again every 5
+   * seconds.  Equivalent to BTUNE_LIMIT_THREADS.
+  */
 
 } btune_config;
 
@@ -173,8 +352,95 @@ static const btune_config BTUNE_CONFIG_DEFAULTS = {
     false,
     -1,
     NULL,
+    NULL,
+    BTUNE_LOAD_BACKGROUND,
+    false,
+    3,
+    0.9f,
+    -1,
+    NULL,
+    BTUNE_POLICY_STATES,
+    BTUNE_INFER_ALWAYS,
+    16,
+    0.2f,
+    1,
+    8 * 1024,
+    BTUNE_PROBE_EVEN,
+    false,
+    false,
+    NULL,
+    0.f,
+    BTUNE_THREADS_STEP,
+    false,
 };
 
+struct blosc2_context_s;
+
+/**
+ * @brief Compression parameters predicted by the model for a chunk.
+ * @see btune_infer_chunks
+*/
+typedef struct {
+  int compcode;
+  //!< The codec, or -1 if the chunk could not be inferred (e.g. it is too small).
+  uint8_t filter;
+  //!< The filter.
+  int clevel;
+  //!< The compression level.
+  int32_t splitmode;
+  //!< The split mode.
+} btune_prediction;
+
+/**
+ * @brief Run the model on a batch of chunks with a single invocation.
+ *
+ * This is meant for appending many chunks at once, or for offline passes over a
+ * dataset, where the overhead of invoking the model for every chunk would dominate.
+ * The predictions are accounted for as if the chunks had been inferred while
+ * compressing them, so they also steer the tuning of the chunks compressed next.
+ *
+ * @param cctx A compression context where Btune has been initialized.
+ * @param srcs The chunks (uncompressed) to run the model on.
+ * @param sizes The sizes of the chunks, in bytes.
+ * @param nchunks The number of chunks.
+ * @param predictions On return, the compression parameters predicted for every chunk.
+ * @return The number of chunks inferred, or a negative value on error (e.g. there is
+ * no model, or it is still being loaded in background).
+*/
+int btune_infer_chunks(struct blosc2_context_s * cctx, const void * const * srcs,
+                       const int32_t * sizes, int nchunks, btune_prediction * predictions);
+
+/**
+ * @brief Calibrate the cost of the configurations that Btune may try.
+ *
+ * Every codec, filter and clevel, with 1 to max_threads threads, is used to compress
+ * and decompress a few reference data sets, and their costs are kept in
+ * calibration_file, so that #btune_config.cost_model can model the times of the
+ * chunks.  This takes a while, so run it once per machine before compressing (see
+ * examples/btune_calibrate.c), not while compressing.  The configurations already in
+ * calibration_file are not measured again.
+ *
+ * @param calibration_file The file where the costs are kept, as in #btune_config.calibration_file.
+ * @param typesize The typesize of the data to compress.
+ * @param max_threads The maximum number of threads of the compression and decompression contexts.
+ * @return The number of configurations measured, or a negative value on error.
+*/
+int btune_calibrate_costs(const char * calibration_file, int32_t typesize, int max_threads);
+
+/**
+ * @brief Run the jobs of blosc2 in a persistent pool of workers, shared by all the contexts.
+ *
+ * The pool is installed as the threading backend of blosc2 (see
+ * blosc2_set_threads_callback), so that changing the number of threads of a context does
+ * not stop and start threads anymore, and tuning the threads is cheap.  As the backend
+ * is process-wide and is not synchronized, call this right after blosc2_init(), before
+ * any other use of blosc2 (in particular, before creating any context or starting other
+ * threads which use blosc2).  Only the first call installs the pool.
+ *
+ * @return 0 if the pool is installed, or a negative value on error.
+*/
+int btune_install_worker_pool(void);
+
 /// @cond DEV
 // Internal Btune state enumeration.
 typedef enum {
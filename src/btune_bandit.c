@@ -0,0 +1,111 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "btune_bandit.h"
+
+#define DIM BTUNE_BANDIT_DIM
+
+
+btune_bandit * btune_bandit_new(int narms, double alpha) {
+  if (narms <= 0) {
+    return NULL;
+  }
+  btune_bandit *bandit = malloc(sizeof(btune_bandit));
+  if (bandit == NULL) {
+    return NULL;
+  }
+  bandit->narms = narms;
+  bandit->alpha = alpha;
+  bandit->ainv = calloc(narms * DIM * DIM, sizeof(double));
+  bandit->b = calloc(narms * DIM, sizeof(double));
+  bandit->npulls = calloc(narms, sizeof(int));
+  if (bandit->ainv == NULL || bandit->b == NULL || bandit->npulls == NULL) {
+    btune_bandit_free(bandit);
+    return NULL;
+  }
+  // A starts as the identity (ridge regularization)
+  for (int arm = 0; arm < narms; arm++) {
+    for (int i = 0; i < DIM; i++) {
+      bandit->ainv[arm * DIM * DIM + i * DIM + i] = 1;
+    }
+  }
+  return bandit;
+}
+
+void btune_bandit_free(btune_bandit *bandit) {
+  if (bandit == NULL) {
+    return;
+  }
+  free(bandit->ainv);
+  free(bandit->b);
+  free(bandit->npulls);
+  free(bandit);
+}
+
+// y = M x
+static void matvec(const double *m, const double *x, double *y) {
+  for (int i = 0; i < DIM; i++) {
+    y[i] = 0;
+    for (int j = 0; j < DIM; j++) {
+      y[i] += m[i * DIM + j] * x[j];
+    }
+  }
+}
+
+static double dot(const double *x, const double *y) {
+  double sum = 0;
+  for (int i = 0; i < DIM; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+int btune_bandit_choose(const btune_bandit *bandit, const double *x) {
+  int best = 0;
+  double best_ucb = -INFINITY;
+  for (int arm = 0; arm < bandit->narms; arm++) {
+    // Try every arm once first
+    if (bandit->npulls[arm] == 0) {
+      return arm;
+    }
+    const double *ainv = bandit->ainv + arm * DIM * DIM;
+    double theta[DIM], ainv_x[DIM];
+    matvec(ainv, bandit->b + arm * DIM, theta);
+    matvec(ainv, x, ainv_x);
+    double ucb = dot(theta, x) + bandit->alpha * sqrt(dot(x, ainv_x));
+    if (ucb > best_ucb) {
+      best_ucb = ucb;
+      best = arm;
+    }
+  }
+  return best;
+}
+
+void btune_bandit_update(btune_bandit *bandit, int arm, const double *x, double reward) {
+  double *ainv = bandit->ainv + arm * DIM * DIM;
+  double *b = bandit->b + arm * DIM;
+
+  // Sherman-Morrison: (A + x x')^-1 = A^-1 - (A^-1 x)(x' A^-1) / (1 + x' A^-1 x)
+  // (A^-1 is symmetric, so x' A^-1 = (A^-1 x)')
+  double ainv_x[DIM];
+  matvec(ainv, x, ainv_x);
+  double denom = 1 + dot(x, ainv_x);
+  for (int i = 0; i < DIM; i++) {
+    for (int j = 0; j < DIM; j++) {
+      ainv[i * DIM + j] -= ainv_x[i] * ainv_x[j] / denom;
+    }
+  }
+  for (int i = 0; i < DIM; i++) {
+    b[i] += reward * x[i];
+  }
+  bandit->npulls[arm]++;
+}
@@ -0,0 +1,57 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_bandit.h
+ * @brief Contextual bandit (LinUCB) for choosing the compression parameters.
+ *
+ * Every arm is a category (codec, filter, clevel, splitmode), and the context
+ * is made of the features of the chunk given by the entropy probe.  The
+ * expected reward of every arm is modeled as a linear function of the context,
+ * and the arm with the highest upper confidence bound is chosen.
+ */
+
+#ifndef BTUNE_BANDIT_H
+#define BTUNE_BANDIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Dimension of the context: bias, log(cratio) and log(speed) of the probe
+#define BTUNE_BANDIT_DIM 3
+
+typedef struct {
+  int narms;
+  // Number of arms
+  double alpha;
+  // Exploration strength
+  double *ainv;
+  // The inverse of the design matrix of every arm (narms x DIM x DIM)
+  double *b;
+  // The reward-weighted sum of the contexts of every arm (narms x DIM)
+  int *npulls;
+  // Number of times every arm has been pulled
+} btune_bandit;
+
+// Create a bandit with narms arms.  Returns NULL if narms is not positive or on allocation errors.
+btune_bandit * btune_bandit_new(int narms, double alpha);
+
+void btune_bandit_free(btune_bandit *bandit);
+
+// Choose the arm with the highest upper confidence bound for the context x
+int btune_bandit_choose(const btune_bandit *bandit, const double *x);
+
+// Account for the reward obtained by an arm in the context x
+void btune_bandit_update(btune_bandit *bandit, int arm, const double *x, double reward);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_BANDIT_H */
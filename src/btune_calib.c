@@ -0,0 +1,624 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include <blosc2.h>
+#include <blosc2/filters-registry.h>
+#include "btune_calib.h"
+#include "entropy_probe.h"
+#include "json.h"
+
+
+#define BTUNE_CALIB_VERSION 1
+// Timed runs of every microbenchmark, after an untimed one
+#define NREPEATS 5
+// Chunk sizes calibrated per process
+#define NCACHED 16
+// The probe throughput hardly depends on the size past this
+#define PROBE_MAX_SIZE (1024 * 1024)
+// Size of the reference data sets of the costs, per thread
+#define COST_SAMPLE (512 * 1024)
+#define COST_MAX_SAMPLE (8 * 1024 * 1024)
+// Timed runs of every cost, as the slow codecs would make the sweep long
+#define COST_REPEATS 3
+
+typedef struct {
+  int32_t chunksize;
+  btune_calibration calib;
+} calib_entry;
+
+typedef struct {
+  btune_cost_key key;
+  btune_cost cost;
+} cost_entry;
+
+static calib_entry cache[NCACHED];
+static int ncached = 0;
+static cost_entry *costs = NULL;
+static int ncosts = 0;
+static bool loaded = false;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int compare_floats(const void *a, const void *b) {
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+static float median(float *values, int n) {
+  qsort(values, n, sizeof(float), compare_floats);
+  return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Data the probe finds some, but not too many, matches in
+static void fill_reference(uint8_t *dest, int32_t size) {
+  uint32_t x = 12345;
+  for (int32_t i = 0; i < size; i++) {
+    x = x * 1103515245 + 12345;
+    dest[i] = (uint8_t)((x >> 24) & 0x0f);
+  }
+}
+
+// The reference data sets of the costs
+static void fill_cost_set(uint8_t *dest, int32_t size, int set) {
+  uint32_t x = 12345;
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    x = x * 1103515245 + 12345;
+    uint32_t item;
+    if (set == 0) {
+      item = x;
+    } else if (set == 1) {
+      // Floats with a few noisy bits in the mantissa
+      float value = 1000.f + (float)((i / 4) % 4096) * 0.25f + (float)(x >> 16) * 1e-5f;
+      memcpy(&item, &value, 4);
+    } else {
+      item = (uint32_t)i + (x >> 29);
+    }
+    memcpy(dest + i, &item, 4);
+  }
+  memset(dest + i, 0, size - i);
+}
+
+static int measure(int32_t chunksize, btune_calibration *calib) {
+  blosc_timestamp_t t0, t1;
+  float times[NREPEATS];
+  uint8_t *src = malloc(chunksize);
+  uint8_t *dest = malloc(chunksize + BLOSC2_MAX_OVERHEAD);
+  int32_t probe_size = (chunksize < PROBE_MAX_SIZE) ? chunksize : PROBE_MAX_SIZE;
+  int32_t nblocks = (probe_size + ENTROPY_PROBE_MAX_WINDOW - 1) / ENTROPY_PROBE_MAX_WINDOW;
+  entropy_probe_block *blocks = malloc(nblocks * sizeof(entropy_probe_block));
+  if (src == NULL || dest == NULL || blocks == NULL) {
+    free(blocks);
+    free(dest);
+    free(src);
+    return BLOSC2_ERROR_MEMORY_ALLOC;
+  }
+  int rc = 0;
+
+  // Copy (the first run also faults the pages in)
+  fill_reference(src, chunksize);
+  for (int i = -1; i < NREPEATS; i++) {
+    blosc_set_timestamp(&t0);
+    memcpy(dest, src, chunksize);
+    blosc_set_timestamp(&t1);
+    if (i >= 0) {
+      times[i] = (float)blosc_elapsed_secs(t0, t1);
+    }
+  }
+  calib->memcpy_speed = (float)chunksize / median(times, NREPEATS);
+
+  // Entropy probe
+  for (int i = -1; i < NREPEATS && rc >= 0; i++) {
+    blosc_set_timestamp(&t0);
+    rc = entropy_probe_blocks(src, probe_size, ENTROPY_PROBE_MAX_WINDOW, NULL, blocks);
+    blosc_set_timestamp(&t1);
+    if (i >= 0) {
+      times[i] = (float)blosc_elapsed_secs(t0, t1);
+    }
+  }
+  if (rc < 0) {
+    fprintf(stderr, "Error %d probing the calibration chunk\n", rc);
+    goto out;
+  }
+  calib->probe_speed = (float)probe_size / median(times, NREPEATS);
+
+  // Zeros, with a fresh context every run: the models were trained with a speed
+  // feature relative to a single compression which also starts the threads
+  memset(src, 0, chunksize);
+  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+  cparams.nthreads = 4;
+  for (int i = -1; i < NREPEATS && rc >= 0; i++) {
+    blosc2_context *cctx = blosc2_create_cctx(cparams);
+    if (cctx == NULL) {
+      rc = BLOSC2_ERROR_MEMORY_ALLOC;
+      break;
+    }
+    blosc_set_timestamp(&t0);
+    rc = blosc2_compress_ctx(cctx, src, chunksize, dest, chunksize + BLOSC2_MAX_OVERHEAD);
+    blosc_set_timestamp(&t1);
+    blosc2_free_ctx(cctx);
+    if (i >= 0) {
+      times[i] = (float)blosc_elapsed_secs(t0, t1);
+    }
+  }
+  if (rc < 0) {
+    fprintf(stderr, "Error %d compressing zeros chunk\n", rc);
+    goto out;
+  }
+  calib->zeros_speed = (float)chunksize / median(times, NREPEATS);
+  rc = 0;
+
+  out:
+  free(blocks);
+  free(dest);
+  free(src);
+  return rc;
+}
+
+static int measure_cost(const btune_cost_key *key, btune_cost *cost) {
+  blosc_timestamp_t t0, t1;
+  float ctimes[COST_REPEATS], dtimes[COST_REPEATS];
+  int64_t size = (int64_t)COST_SAMPLE * key->nthreads;
+  int32_t srcsize = (int32_t)((size < COST_MAX_SAMPLE) ? size : COST_MAX_SAMPLE);
+  uint8_t *src = malloc(srcsize);
+  uint8_t *dest = malloc(srcsize + BLOSC2_MAX_OVERHEAD);
+  uint8_t *back = malloc(srcsize);
+  if (src == NULL || dest == NULL || back == NULL) {
+    free(back);
+    free(dest);
+    free(src);
+    return BLOSC2_ERROR_MEMORY_ALLOC;
+  }
+  memset(dest, 0, srcsize);
+
+  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+  cparams.compcode = (uint8_t)key->compcode;
+  cparams.clevel = (uint8_t)key->clevel;
+  cparams.typesize = key->typesize;
+  cparams.nthreads = (int16_t)key->nthreads;
+  for (int i = 0; i < BLOSC2_MAX_FILTERS; i++) {
+    cparams.filters[i] = 0;
+  }
+  cparams.filters[BLOSC2_MAX_FILTERS - 1] = (uint8_t)key->filter;
+  if (key->filter == BLOSC_FILTER_BYTEDELTA) {
+    cparams.filters[BLOSC2_MAX_FILTERS - 2] = BLOSC_SHUFFLE;
+    cparams.filters_meta[BLOSC2_MAX_FILTERS - 1] = (uint8_t)key->typesize;
+  }
+  blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+  dparams.nthreads = (int16_t)key->nthreads;
+  blosc2_context *cctx = blosc2_create_cctx(cparams);
+  blosc2_context *dctx = blosc2_create_dctx(dparams);
+
+  for (int i = -1; i < COST_REPEATS; i++) {
+    blosc_set_timestamp(&t0);
+    memcpy(back, dest, srcsize);
+    blosc_set_timestamp(&t1);
+    if (i >= 0) {
+      ctimes[i] = (float)blosc_elapsed_secs(t0, t1);
+    }
+  }
+  cost->memcpy_time = median(ctimes, COST_REPEATS) / (float)srcsize;
+
+  int rc = 0;
+  for (int set = 0; set < BTUNE_COST_NSETS && rc >= 0; set++) {
+    fill_cost_set(src, srcsize, set);
+    int csize = 0;
+    for (int i = -1; i < COST_REPEATS && rc >= 0; i++) {
+      blosc_set_timestamp(&t0);
+      csize = blosc2_compress_ctx(cctx, src, srcsize, dest, srcsize + BLOSC2_MAX_OVERHEAD);
+      blosc_set_timestamp(&t1);
+      if (i >= 0) {
+        ctimes[i] = (float)blosc_elapsed_secs(t0, t1);
+      }
+      if (csize <= 0) {
+        rc = (csize < 0) ? csize : -1;
+        break;
+      }
+      blosc_set_timestamp(&t0);
+      rc = blosc2_decompress_ctx(dctx, dest, csize, back, srcsize);
+      blosc_set_timestamp(&t1);
+      if (i >= 0) {
+        dtimes[i] = (float)blosc_elapsed_secs(t0, t1);
+      }
+    }
+    if (rc >= 0) {
+      cost->cratio[set] = (float)srcsize / (float)csize;
+      cost->ctime[set] = median(ctimes, COST_REPEATS) / (float)srcsize;
+      cost->dtime[set] = median(dtimes, COST_REPEATS) / (float)srcsize;
+    }
+  }
+  if (rc < 0) {
+    fprintf(stderr, "Error %d measuring the cost of codec %d, clevel %d, filter %d\n",
+            rc, key->compcode, key->clevel, key->filter);
+  }
+
+  blosc2_free_ctx(dctx);
+  blosc2_free_ctx(cctx);
+  free(back);
+  free(dest);
+  free(src);
+  return (rc < 0) ? rc : 0;
+}
+
+// The name of the CPU model, or "unknown"
+static void get_cpu_model(char *model, size_t len) {
+  snprintf(model, len, "unknown");
+  FILE *file = fopen("/proc/cpuinfo", "rt");
+  if (file == NULL) {
+    return;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      char *start = colon + 1;
+      while (*start == ' ' || *start == '\t') {
+        start++;
+      }
+      start[strcspn(start, "\n")] = 0;
+      snprintf(model, len, "%s", start);
+      break;
+    }
+  }
+  fclose(file);
+}
+
+static int get_cores(void) {
+  long ncores = 1;
+#if defined(_SC_NPROCESSORS_ONLN)
+  ncores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return (int)ncores;
+}
+
+static json_value * json_get(json_value *json, const char *name) {
+  if (json == NULL || json->type != json_object) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < json->u.object.length; i++) {
+    if (strcmp(json->u.object.values[i].name, name) == 0) {
+      return json->u.object.values[i].value;
+    }
+  }
+  return NULL;
+}
+
+static double json_get_number(json_value *json, const char *name) {
+  json_value *value = json_get(json, name);
+  if (value == NULL) {
+    return 0;
+  }
+  if (value->type == json_integer) {
+    return (double)value->u.integer;
+  }
+  return (value->type == json_double) ? value->u.dbl : 0;
+}
+
+// Add the calibrations in fname to the cache, if they were made on this machine
+static void load_profile(const char *fname) {
+  FILE *file = fopen(fname, "rt");
+  if (file == NULL) {
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *buffer = malloc(size + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return;
+  }
+  size_t nread = fread(buffer, 1, size, file);
+  fclose(file);
+  buffer[nread] = 0;
+  json_value *json = json_parse(buffer, nread);
+  free(buffer);
+  if (json == NULL) {
+    printf("WARNING: Cannot parse the calibration file %s, ignoring it\n", fname);
+    return;
+  }
+
+  char model[256];
+  get_cpu_model(model, sizeof(model));
+  json_value *cpu = json_get(json, "cpu");
+  if (json_get_number(json, "version") != BTUNE_CALIB_VERSION ||
+      cpu == NULL || cpu->type != json_string || strcmp(cpu->u.string.ptr, model) != 0 ||
+      json_get_number(json, "cores") != get_cores()) {
+    // Made with another version or machine, it will be overwritten
+    json_value_free(json);
+    return;
+  }
+  json_value *sizes = json_get(json, "sizes");
+  if (sizes != NULL && sizes->type == json_object) {
+    for (unsigned int i = 0; i < sizes->u.object.length && ncached < NCACHED; i++) {
+      json_value *entry = sizes->u.object.values[i].value;
+      int32_t chunksize = atoi(sizes->u.object.values[i].name);
+      bool known = false;
+      for (int j = 0; j < ncached; j++) {
+        known |= (cache[j].chunksize == chunksize);
+      }
+      if (known) {
+        // Already measured by this process
+        continue;
+      }
+      calib_entry *cached = &cache[ncached];
+      cached->chunksize = chunksize;
+      cached->calib.memcpy_speed = (float)json_get_number(entry, "memcpy");
+      // "zeros" was timed with a warm context, it is measured again
+      cached->calib.zeros_speed = (float)json_get_number(entry, "zeros_cold");
+      cached->calib.probe_speed = (float)json_get_number(entry, "probe");
+      if (cached->chunksize > 0 && cached->calib.memcpy_speed > 0 &&
+          cached->calib.zeros_speed > 0 && cached->calib.probe_speed > 0) {
+        ncached++;
+      }
+    }
+  }
+  json_value *entries = json_get(json, "costs");
+  if (entries != NULL && entries->type == json_object) {
+    cost_entry *grown = realloc(costs, (ncosts + entries->u.object.length) * sizeof(cost_entry));
+    if (grown == NULL) {
+      printf("WARNING: Cannot allocate the costs of the calibration file %s, ignoring them\n", fname);
+      json_value_free(json);
+      return;
+    }
+    costs = grown;
+    for (unsigned int i = 0; i < entries->u.object.length; i++) {
+      cost_entry *cached = &costs[ncosts];
+      btune_cost_key *key = &cached->key;
+      if (sscanf(entries->u.object.values[i].name, "%d-%d-%d-%d-%d", &key->compcode,
+                 &key->clevel, &key->filter, &key->typesize, &key->nthreads) != 5) {
+        continue;
+      }
+      bool known = false;
+      for (int j = 0; j < ncosts; j++) {
+        known |= (memcmp(&costs[j].key, key, sizeof(btune_cost_key)) == 0);
+      }
+      if (known) {
+        // Already measured by this process
+        continue;
+      }
+      json_value *entry = entries->u.object.values[i].value;
+      const char *names[3] = {"cratio", "ctime", "dtime"};
+      float *values[3] = {cached->cost.cratio, cached->cost.ctime, cached->cost.dtime};
+      bool valid = true;
+      for (int j = 0; j < 3; j++) {
+        json_value *pair = json_get(entry, names[j]);
+        valid &= (pair != NULL && pair->type == json_array &&
+                  pair->u.array.length == BTUNE_COST_NSETS);
+        for (int k = 0; valid && k < BTUNE_COST_NSETS; k++) {
+          json_value *value = pair->u.array.values[k];
+          values[j][k] = (float)((value->type == json_integer) ? (double)value->u.integer :
+                                 (value->type == json_double) ? value->u.dbl : 0);
+          valid &= (values[j][k] > 0);
+        }
+      }
+      cached->cost.memcpy_time = (float)json_get_number(entry, "memcpy");
+      if (valid && cached->cost.memcpy_time > 0) {
+        ncosts++;
+      }
+    }
+  }
+  json_value_free(json);
+}
+
+static void save_profile(const char *fname) {
+  // Write to a temporary file first, so that a crash does not leave a truncated profile
+  size_t len = strlen(fname) + 5;
+  char *tmpname = malloc(len);
+  snprintf(tmpname, len, "%s.tmp", fname);
+  FILE *file = fopen(tmpname, "wt");
+  if (file == NULL) {
+    printf("WARNING: Cannot write the calibration file %s\n", fname);
+    free(tmpname);
+    return;
+  }
+
+  char model[256];
+  get_cpu_model(model, sizeof(model));
+  fprintf(file, "{\"version\": %d, \"cpu\": \"", BTUNE_CALIB_VERSION);
+  for (const char *c = model; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+    }
+    fputc(((unsigned char)*c < 0x20) ? ' ' : *c, file);
+  }
+  fprintf(file, "\", \"cores\": %d, \"sizes\": {", get_cores());
+  for (int i = 0; i < ncached; i++) {
+    btune_calibration *calib = &cache[i].calib;
+    fprintf(file, "%s\"%d\": {\"memcpy\": %.9g, \"zeros_cold\": %.9g, \"probe\": %.9g}",
+            (i > 0) ? ", " : "", cache[i].chunksize,
+            calib->memcpy_speed, calib->zeros_speed, calib->probe_speed);
+  }
+  fprintf(file, "}, \"costs\": {");
+  for (int i = 0; i < ncosts; i++) {
+    btune_cost_key *key = &costs[i].key;
+    btune_cost *cost = &costs[i].cost;
+    fprintf(file, "%s\"%d-%d-%d-%d-%d\": {", (i > 0) ? ", " : "", key->compcode,
+            key->clevel, key->filter, key->typesize, key->nthreads);
+    const char *names[3] = {"cratio", "ctime", "dtime"};
+    const float *values[3] = {cost->cratio, cost->ctime, cost->dtime};
+    for (int j = 0; j < 3; j++) {
+      fprintf(file, "%s\"%s\": [", (j > 0) ? ", " : "", names[j]);
+      for (int k = 0; k < BTUNE_COST_NSETS; k++) {
+        fprintf(file, "%s%.9g", (k > 0) ? ", " : "", values[j][k]);
+      }
+      fputc(']', file);
+    }
+    fprintf(file, ", \"memcpy\": %.9g}", cost->memcpy_time);
+  }
+  fprintf(file, "}}\n");
+
+  int rc = (fclose(file) == 0) ? rename(tmpname, fname) : -1;
+  if (rc != 0) {
+    printf("WARNING: Cannot write the calibration file %s\n", fname);
+    remove(tmpname);
+  }
+  free(tmpname);
+}
+
+// Read fname the first time a calibration is needed
+static void ensure_loaded(const char *fname) {
+  if (fname != NULL && !loaded) {
+    load_profile(fname);
+    loaded = true;
+  }
+}
+
+int btune_calibration_get(int32_t chunksize, const char *fname, btune_calibration *calib) {
+  pthread_mutex_lock(&cache_lock);
+  ensure_loaded(fname);
+  for (int i = 0; i < ncached; i++) {
+    if (cache[i].chunksize == chunksize) {
+      *calib = cache[i].calib;
+      pthread_mutex_unlock(&cache_lock);
+      return 0;
+    }
+  }
+
+  // Measured with the lock held, so that concurrent tuners do not disturb each other
+  int rc = measure(chunksize, calib);
+  if (rc == 0 && ncached < NCACHED) {
+    cache[ncached].chunksize = chunksize;
+    cache[ncached].calib = *calib;
+    ncached++;
+    if (fname != NULL) {
+      save_profile(fname);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return rc;
+}
+
+int btune_calibration_lookup(int32_t chunksize, const char *fname, btune_calibration *calib) {
+  int rc = -1;
+  pthread_mutex_lock(&cache_lock);
+  ensure_loaded(fname);
+  for (int i = 0; i < ncached; i++) {
+    if (cache[i].chunksize == chunksize) {
+      *calib = cache[i].calib;
+      rc = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return rc;
+}
+
+// The cached cost of key, or NULL.  Must be called with cache_lock held.
+static btune_cost * find_cost(const btune_cost_key *key) {
+  for (int i = 0; i < ncosts; i++) {
+    if (memcmp(&costs[i].key, key, sizeof(btune_cost_key)) == 0) {
+      return &costs[i].cost;
+    }
+  }
+  return NULL;
+}
+
+int btune_calibration_cost(const btune_cost_key *key, const char *fname, btune_cost *cost) {
+  pthread_mutex_lock(&cache_lock);
+  ensure_loaded(fname);
+  btune_cost *cached = find_cost(key);
+  if (cached != NULL) {
+    *cost = *cached;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return (cached != NULL) ? 0 : -1;
+}
+
+int btune_calibration_sweep(const btune_cost_key *keys, int nkeys, const char *fname) {
+  int nmeasured = 0;
+  int rc = 0;
+  for (int i = 0; i < nkeys; i++) {
+    pthread_mutex_lock(&cache_lock);
+    ensure_loaded(fname);
+    bool known = (find_cost(&keys[i]) != NULL);
+    pthread_mutex_unlock(&cache_lock);
+    if (known) {
+      continue;
+    }
+
+    // Measured out of the lock, so that the tuners can still look up the costs
+    btune_cost cost;
+    rc = measure_cost(&keys[i], &cost);
+    if (rc < 0) {
+      break;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if (find_cost(&keys[i]) == NULL) {
+      cost_entry *grown = realloc(costs, (ncosts + 1) * sizeof(cost_entry));
+      if (grown == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        rc = BLOSC2_ERROR_MEMORY_ALLOC;
+        break;
+      }
+      costs = grown;
+      costs[ncosts].key = keys[i];
+      costs[ncosts].cost = cost;
+      ncosts++;
+      nmeasured++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+
+  if (nmeasured > 0 && fname != NULL) {
+    pthread_mutex_lock(&cache_lock);
+    save_profile(fname);
+    pthread_mutex_unlock(&cache_lock);
+  }
+  return (rc < 0) ? rc : nmeasured;
+}
+
+double btune_cost_time(const btune_cost *cost, const btune_calibration *calib,
+                       int64_t nbytes, int64_t cbytes, bool decomp) {
+  const float *times = decomp ? cost->dtime : cost->ctime;
+  // The data sets, by increasing cbytes / nbytes
+  int order[BTUNE_COST_NSETS];
+  for (int i = 0; i < BTUNE_COST_NSETS; i++) {
+    int j = i;
+    for (; j > 0 && cost->cratio[order[j - 1]] < cost->cratio[i]; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+
+  double x = (double)cbytes / (double)nbytes;
+  int first = order[0];
+  int last = order[BTUNE_COST_NSETS - 1];
+  double time;
+  if (x <= 1. / cost->cratio[first]) {
+    time = times[first];
+  } else if (x >= 1. / cost->cratio[last]) {
+    time = times[last];
+  } else {
+    int k = 1;
+    while (x > 1. / cost->cratio[order[k]]) {
+      k++;
+    }
+    int lo = order[k - 1];
+    int hi = order[k];
+    double x0 = 1. / cost->cratio[lo];
+    double x1 = 1. / cost->cratio[hi];
+    time = times[lo] + (times[hi] - times[lo]) * (x - x0) / (x1 - x0);
+  }
+  if (calib != NULL && calib->memcpy_speed > 0) {
+    double extra = 1. / calib->memcpy_speed - cost->memcpy_time;
+    time += (extra > 0) ? extra : 0;
+  }
+  return time * (double)nbytes;
+}
@@ -0,0 +1,121 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_calib.h
+ * @brief Calibration of the machine the tuner runs on.
+ *
+ * A few microbenchmarks are run once per process and chunk size, and their
+ * results are the reference speeds the speed features are relative to.  Each
+ * of them is warmed up and repeated, and the median is kept, so that a single
+ * noisy measurement does not skew all the chunks of a run.  The results can
+ * also be kept in a JSON file, so that the runs on the same machine (same CPU
+ * model and number of cores) share them.
+ *
+ * The cost of every compression configuration (codec, clevel, filter,
+ * typesize and threads) can also be calibrated up front, with a sweep which
+ * compresses reference data sets, so that the times of the chunks can be
+ * modeled instead of measured.  The tuners only look these costs up.
+ */
+
+#ifndef BTUNE_CALIB_H
+#define BTUNE_CALIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  float memcpy_speed;
+  // The speed of copying a chunk, in bytes/s
+  float zeros_speed;
+  // The speed of compressing a chunk of zeros with the default parameters and 4 threads, in bytes/s,
+  // including the startup of the threads as the models were trained with
+  float probe_speed;
+  // The speed of the entropy probe scanning every byte of a chunk, in bytes/s
+} btune_calibration;
+
+/*
+ * Get the calibration of the machine for chunks of chunksize bytes, running
+ * the microbenchmarks the first time.  If fname is not NULL, the calibration
+ * is read from (and saved to) this file.  Returns 0, or a negative value if
+ * the microbenchmarks failed.
+ */
+int btune_calibration_get(int32_t chunksize, const char *fname, btune_calibration *calib);
+
+/*
+ * Look up the calibration for chunks of chunksize bytes, without running the
+ * microbenchmarks.  fname is as in btune_calibration_get().  Returns 0, or a
+ * negative value if this chunk size has not been calibrated yet.
+ */
+int btune_calibration_lookup(int32_t chunksize, const char *fname, btune_calibration *calib);
+
+// A compression configuration whose speed can be calibrated
+typedef struct {
+  int compcode;
+  // The codec
+  int clevel;
+  // The compression level
+  int filter;
+  // The filter, as in cparams_btune (bytedelta comes after a shuffle)
+  int32_t typesize;
+  // The typesize of the data
+  int nthreads;
+  // The number of threads, for both compression and decompression
+} btune_cost_key;
+
+// Number of reference data sets: random bytes, a noisy series of floats and a ramp
+#define BTUNE_COST_NSETS 3
+
+// The cost of a configuration, measured on the reference data sets
+typedef struct {
+  float cratio[BTUNE_COST_NSETS];
+  // The compression ratio of every data set
+  float ctime[BTUNE_COST_NSETS];
+  // The compression time of every data set, in seconds per byte
+  float dtime[BTUNE_COST_NSETS];
+  // The decompression time of every data set, in seconds per byte
+  float memcpy_time;
+  // The time of copying the data sets, in seconds per byte
+} btune_cost;
+
+/*
+ * Look up the cost of a configuration, without measuring it.  fname is as in
+ * btune_calibration_get().  Returns 0, or a negative value if the
+ * configuration has not been calibrated (see btune_calibration_sweep).
+ */
+int btune_calibration_cost(const btune_cost_key *key, const char *fname, btune_cost *cost);
+
+/*
+ * Calibrate the cost of the configurations in keys which are not known yet,
+ * compressing and decompressing the reference data sets with each of them,
+ * and save them to fname (if not NULL).  This takes a while for the slow
+ * codecs, so it is meant to run before compressing, not from a tuner.
+ * Returns the number of configurations measured, or a negative value on error.
+ */
+int btune_calibration_sweep(const btune_cost_key *keys, int nkeys, const char *fname);
+
+/*
+ * The modeled time of compressing (or decompressing, if decomp) nbytes into
+ * cbytes.  The time per byte is interpolated linearly in cbytes / nbytes
+ * between the data sets, and taken from the nearest one outside of them.
+ * As the data sets may fit in a cache that the chunk does not, the extra
+ * time of copying the chunk (calib, for the chunk size) over copying the data
+ * sets is added.  calib may be NULL, and then this term is left out.
+ */
+double btune_cost_time(const btune_cost *cost, const btune_calibration *calib,
+                       int64_t nbytes, int64_t cbytes, bool decomp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_CALIB_H */
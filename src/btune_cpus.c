@@ -0,0 +1,423 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "btune_cpus.h"
+
+
+#if defined(__linux__)
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// Read the first line of a file, without the newline.  Returns false if it cannot be read.
+static bool read_line(const char *fname, char *line, int len) {
+  FILE *file = fopen(fname, "rt");
+  if (file == NULL) {
+    return false;
+  }
+  bool ok = fgets(line, len, file) != NULL;
+  fclose(file);
+  if (ok) {
+    line[strcspn(line, "\n")] = 0;
+  }
+  return ok;
+}
+
+// Parse a list of CPUs like "0-3,8,10-11" into set.  Returns false if it is malformed.
+static bool parse_cpulist(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *s = list;
+  while (*s != 0) {
+    char *end;
+    long first = strtol(s, &end, 10);
+    if (end == s) {
+      return false;
+    }
+    long last = first;
+    s = end;
+    if (*s == '-') {
+      s++;
+      last = strtol(s, &end, 10);
+      if (end == s) {
+        return false;
+      }
+      s = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read a list of CPUs of cpu from the sysfs under root (relative to the directory of cpu)
+static bool read_cpu_list(const char *root, int cpu, const char *name, cpu_set_t *set) {
+  char fname[1024 + 256];
+  char line[1024];
+  snprintf(fname, sizeof(fname), "%s" SYSFS_CPU "/cpu%d/%s", root, cpu, name);
+  return read_line(fname, line, sizeof(line)) && parse_cpulist(line, set);
+}
+
+// The cores of the CPUs in mask: a CPU counts if no lower one in mask is its SMT sibling
+static int count_cores(const char *root, const cpu_set_t *mask, const cpu_set_t *within) {
+  int ncores = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, mask) || (within != NULL && !CPU_ISSET(cpu, within))) {
+      continue;
+    }
+    cpu_set_t siblings;
+    if (!read_cpu_list(root, cpu, "topology/core_cpus_list", &siblings) &&
+        !read_cpu_list(root, cpu, "topology/thread_siblings_list", &siblings)) {
+      return 0;
+    }
+    bool first = true;
+    for (int sibling = 0; sibling < cpu; sibling++) {
+      if (CPU_ISSET(sibling, &siblings) && CPU_ISSET(sibling, mask) &&
+          (within == NULL || CPU_ISSET(sibling, within))) {
+        first = false;
+        break;
+      }
+    }
+    if (first) {
+      ncores++;
+    }
+  }
+  return ncores;
+}
+
+// Find the L3 cache of cpu in the sysfs under root, returning its size and the CPUs sharing it
+static bool read_l3(const char *root, int cpu, int64_t *size, cpu_set_t *shared) {
+  char fname[1024 + 256];
+  char line[1024];
+  for (int index = 0; index < 8; index++) {
+    snprintf(fname, sizeof(fname), "%s" SYSFS_CPU "/cpu%d/cache/index%d/level", root, cpu, index);
+    if (!read_line(fname, line, sizeof(line))) {
+      return false;
+    }
+    if (atoi(line) != 3) {
+      continue;
+    }
+    snprintf(fname, sizeof(fname), "%s" SYSFS_CPU "/cpu%d/cache/index%d/size", root, cpu, index);
+    if (!read_line(fname, line, sizeof(line))) {
+      return false;
+    }
+    char *unit;
+    *size = strtoll(line, &unit, 10);
+    if (*unit == 'K') {
+      *size <<= 10;
+    } else if (*unit == 'M') {
+      *size <<= 20;
+    }
+    snprintf(fname, sizeof(fname), "cache/index%d/shared_cpu_list", index);
+    return read_cpu_list(root, cpu, fname, shared);
+  }
+  return false;
+}
+
+// The quota in the cpu.max file of a cgroup v2 directory, in CPUs, or 0 if none
+static float read_cpu_max(const char *dir) {
+  char fname[1024 + 32];
+  char line[256];
+  snprintf(fname, sizeof(fname), "%s/cpu.max", dir);
+  if (!read_line(fname, line, sizeof(line)) || strncmp(line, "max", 3) == 0) {
+    return 0;
+  }
+  double quota, period;
+  if (sscanf(line, "%lf %lf", &quota, &period) != 2 || quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return (float) (quota / period);
+}
+
+// The quota in the cpu.cfs_*_us files of a cgroup v1 directory, in CPUs, or 0 if none
+static float read_cfs_quota(const char *dir) {
+  char fname[1024 + 32];
+  char line[256];
+  snprintf(fname, sizeof(fname), "%s/cpu.cfs_quota_us", dir);
+  if (!read_line(fname, line, sizeof(line))) {
+    return 0;
+  }
+  double quota = atof(line);
+  snprintf(fname, sizeof(fname), "%s/cpu.cfs_period_us", dir);
+  if (quota <= 0 || !read_line(fname, line, sizeof(line)) || atof(line) <= 0) {
+    return 0;
+  }
+  return (float) (quota / atof(line));
+}
+
+/*
+ * The smallest quota of the cgroup directory root/path and its ancestors, as
+ * the quota of a parent also limits its children.  In a container with its
+ * own cgroup namespace the path is "/", and the quota is the one of root.
+ */
+static float cgroup_quota(const char *root, const char *path, float (*read_quota)(const char *)) {
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s%s", root, path);
+  size_t root_len = strlen(root);
+  float min_quota = 0;
+  while (true) {
+    float quota = read_quota(dir);
+    if (quota > 0 && (min_quota == 0 || quota < min_quota)) {
+      min_quota = quota;
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL || (size_t) (slash - dir) < root_len) {
+      break;
+    }
+    *slash = 0;
+  }
+  return min_quota;
+}
+
+// A cgroup directory whose quota limits the process
+typedef struct {
+  char root[1024];
+  // The mount point of the hierarchy
+  char path[1024];
+  // The path of the cgroup in the hierarchy
+  float (*read_quota)(const char *);
+  // The reader of its quota files
+} cgroup_dir;
+
+// The v2 cgroup and the two usual mount points of the v1 cpu controller
+#define MAX_CGROUPS 3
+
+static int add_cgroup(cgroup_dir *cgroups, int ncgroups, const char *root, const char *mount,
+                      const char *path, float (*read_quota)(const char *)) {
+  if (ncgroups < MAX_CGROUPS) {
+    snprintf(cgroups[ncgroups].root, sizeof(cgroups[ncgroups].root), "%s%s", root, mount);
+    snprintf(cgroups[ncgroups].path, sizeof(cgroups[ncgroups].path), "%s", path);
+    cgroups[ncgroups].read_quota = read_quota;
+    ncgroups++;
+  }
+  return ncgroups;
+}
+
+// Find the cgroups (v2 or v1) of the process in the proc/self/cgroup under root, and
+// return how many
+static int find_cgroups(const char *root, cgroup_dir *cgroups) {
+  char fname[1024 + 32];
+  snprintf(fname, sizeof(fname), "%s/proc/self/cgroup", root);
+  FILE *file = fopen(fname, "rt");
+  if (file == NULL) {
+    return 0;
+  }
+  int ncgroups = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = 0;
+    // Lines are "hierarchy-ID:controllers:path", v2 is "0::path"
+    char *controllers = strchr(line, ':');
+    char *path = (controllers != NULL) ? strchr(controllers + 1, ':') : NULL;
+    if (path == NULL) {
+      continue;
+    }
+    *path++ = 0;
+    *controllers++ = 0;
+    if (strcmp(line, "0") == 0 && *controllers == 0) {
+      ncgroups = add_cgroup(cgroups, ncgroups, root, CGROUP_ROOT, path, read_cpu_max);
+    } else {
+      char *list = controllers;
+      char *name;
+      bool has_cpu = false;
+      while ((name = strsep(&list, ",")) != NULL) {
+        has_cpu |= strcmp(name, "cpu") == 0;
+      }
+      if (has_cpu) {
+        ncgroups = add_cgroup(cgroups, ncgroups, root, CGROUP_ROOT "/cpu,cpuacct", path,
+                              read_cfs_quota);
+        ncgroups = add_cgroup(cgroups, ncgroups, root, CGROUP_ROOT "/cpu", path, read_cfs_quota);
+      }
+    }
+  }
+  fclose(file);
+  return ncgroups;
+}
+
+// The CPU quota of the cgroups of the process, in CPUs, or 0 if none
+static float get_quota(const cgroup_dir *cgroups, int ncgroups) {
+  for (int i = 0; i < ncgroups; i++) {
+    float quota = cgroup_quota(cgroups[i].root, cgroups[i].path, cgroups[i].read_quota);
+    if (quota > 0) {
+      return quota;
+    }
+  }
+  return 0;
+}
+
+// The load average of the last minute in the proc/loadavg under root, or -1 if unknown
+static float read_loadavg(const char *root) {
+  char fname[1024 + 32];
+  char line[256];
+  snprintf(fname, sizeof(fname), "%s/proc/loadavg", root);
+  if (!read_line(fname, line, sizeof(line))) {
+    return -1;
+  }
+  return (float) atof(line);
+}
+
+// Read the topology (CPUs, cores and L3 cache) of the CPUs in mask from the sysfs under root
+static void read_topology_at(const char *root, const cpu_set_t *mask, btune_cpus *cpus) {
+  char fname[1024 + 64];
+  char line[1024];
+  cpu_set_t online;
+  snprintf(fname, sizeof(fname), "%s" SYSFS_CPU "/online", root);
+  if (read_line(fname, line, sizeof(line)) && parse_cpulist(line, &online)) {
+    cpus->online = CPU_COUNT(&online);
+  }
+  cpus->affinity = CPU_COUNT(mask);
+  cpus->cores = count_cores(root, mask, NULL);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, mask)) {
+      cpu_set_t shared;
+      if (read_l3(root, cpu, &cpus->l3_size, &shared)) {
+        cpus->l3_cores = count_cores(root, mask, &shared);
+      } else {
+        cpus->l3_size = 0;
+      }
+      break;
+    }
+  }
+}
+
+static cgroup_dir cgroups[MAX_CGROUPS];
+static int ncgroups = 0;
+
+#endif  /* __linux__ */
+
+// The CPUs online, and nothing else known
+static void init_cpus(btune_cpus *cpus) {
+  cpus->online = 1;
+#if defined(_SC_NPROCESSORS_ONLN)
+  cpus->online = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (cpus->online < 1) {
+    cpus->online = 1;
+  }
+  cpus->affinity = cpus->online;
+  cpus->quota = 0;
+  cpus->cores = 0;
+  cpus->l3_cores = 0;
+  cpus->l3_size = 0;
+  cpus->loadavg = -1;
+}
+
+// The topology does not change while the process runs, it is only read once
+static btune_cpus topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static void read_topology(void) {
+  init_cpus(&topology);
+#if defined(__linux__)
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+    CPU_ZERO(&mask);
+    for (int cpu = 0; cpu < topology.online && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &mask);
+    }
+  }
+  read_topology_at("", &mask, &topology);
+  ncgroups = find_cgroups("", cgroups);
+#endif
+}
+
+int btune_cpus_get(btune_cpus *cpus) {
+  pthread_once(&topology_once, read_topology);
+  *cpus = topology;
+
+  // The quota and the load may change at any time
+#if defined(__linux__)
+  cpus->quota = get_quota(cgroups, ncgroups);
+#endif
+#if !defined(_WIN32)
+  double loadavg;
+  if (getloadavg(&loadavg, 1) == 1) {
+    cpus->loadavg = (float) loadavg;
+  }
+#endif
+  return 0;
+}
+
+int btune_cpus_read(const char *root, const char *affinity, btune_cpus *cpus) {
+#if defined(__linux__)
+  cpu_set_t mask;
+  if (!parse_cpulist(affinity, &mask) || CPU_COUNT(&mask) == 0) {
+    return -1;
+  }
+  init_cpus(cpus);
+  read_topology_at(root, &mask, cpus);
+  cgroup_dir dirs[MAX_CGROUPS];
+  cpus->quota = get_quota(dirs, find_cgroups(root, dirs));
+  cpus->loadavg = read_loadavg(root);
+  return 0;
+#else
+  (void) root;
+  (void) affinity;
+  (void) cpus;
+  return -1;
+#endif
+}
+
+double btune_cpus_process_time(void) {
+#if !defined(_WIN32)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    return (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6 +
+           (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6;
+  }
+#endif
+  return -1;
+}
+
+int btune_cpus_ceiling(const btune_cpus *cpus, int32_t chunksize, float own_load) {
+  // The hardware threads the process can run on
+  float capacity = (float) cpus->affinity;
+  if (cpus->quota > 0 && cpus->quota < capacity) {
+    capacity = cpus->quota;
+  }
+  int ceiling = (int) capacity;
+  if (cpus->cores > 0 && cpus->cores < ceiling) {
+    ceiling = cpus->cores;
+  }
+  if (chunksize > 0 && cpus->l3_cores > 0 && cpus->l3_size >= 2 * (int64_t) chunksize &&
+      cpus->l3_cores < ceiling) {
+    ceiling = cpus->l3_cores;
+  }
+  if (cpus->loadavg >= 0) {
+    // The load of the other processes, on the share of the CPUs the process can run on
+    float others = (cpus->loadavg - own_load) * (float) cpus->affinity / (float) cpus->online;
+    if (others > 0 && (int) (capacity - others) < ceiling) {
+      ceiling = (int) (capacity - others);
+    }
+  }
+  return (ceiling < 1) ? 1 : ceiling;
+}
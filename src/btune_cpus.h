@@ -0,0 +1,78 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_cpus.h
+ * @brief The CPUs actually available to the process.
+ *
+ * The number of threads asked by a context says nothing about the CPUs the
+ * process can use: the affinity mask and the cgroup quota of a container may
+ * grant just a few of them, SMT siblings share the execution units of a core,
+ * and other processes may keep the cores busy.  These are read from Linux
+ * (sched_getaffinity, /sys/fs/cgroup, /sys/devices/system/cpu and the load
+ * average); elsewhere only the online CPUs and the load average are known.
+ */
+
+#ifndef BTUNE_CPUS_H
+#define BTUNE_CPUS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int online;
+  // The CPUs online
+  int affinity;
+  // The CPUs in the affinity mask of the process
+  float quota;
+  // The cgroup CPU quota (cpu.max, or cpu.cfs_quota_us in v1), in CPUs, 0 if none
+  int cores;
+  // The physical cores of the CPUs in the affinity mask (SMT siblings count once), 0 if unknown
+  int l3_cores;
+  // The cores of the affinity mask sharing the L3 cache of its first CPU, 0 if unknown
+  int64_t l3_size;
+  // The size of this L3 cache in bytes, 0 if unknown
+  float loadavg;
+  // The load average of the last minute, -1 if unknown
+} btune_cpus;
+
+// Read the CPUs available to the process.  The topology (CPUs, cores and L3 cache) is
+// read once per process, the quota and the load average every time.  Returns 0, or a
+// negative value on error.
+int btune_cpus_get(btune_cpus *cpus);
+
+/*
+ * Read the CPUs from the files of Linux under the directory root (sysfs, cgroups,
+ * proc/self/cgroup and proc/loadavg) instead of /, for the CPUs of the list affinity
+ * (like "0-3,8") instead of the affinity mask of the process.  This is meant for
+ * checking the readers on copies of these files.  Returns 0, or a negative value if
+ * affinity is malformed or empty, or elsewhere than on Linux.
+ */
+int btune_cpus_read(const char *root, const char *affinity, btune_cpus *cpus);
+
+// The CPU time (user and system) used by the process so far, in seconds, or -1 if unknown
+double btune_cpus_process_time(void);
+
+/*
+ * The most threads worth running for chunks of chunksize bytes (0 if not
+ * known), at least 1.  These are the CPUs of the affinity mask, within the
+ * quota, without the SMT siblings, and minus the load of the other processes
+ * (the load average minus own_load, the CPUs used by the process itself).  When
+ * a chunk fits (twice, with its output) in the L3 cache, the threads are kept
+ * within the cores sharing it.
+ */
+int btune_cpus_ceiling(const btune_cpus *cpus, int32_t chunksize, float own_load);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_CPUS_H */
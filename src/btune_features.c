@@ -0,0 +1,318 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "btune_features.h"
+
+// Size of the windows the sample is made of
+#define WINDOW_SIZE 4096
+// Largest typesize with its own byte planes (larger ones are seen as bytes)
+#define MAX_PLANES 16
+// Least number of histograms filled in turn, so that nearby bytes do not
+// wait on each other's increments
+#define NTABLES 8
+
+
+// Entropy of a histogram of n samples, in bits per byte divided by 8
+static float hist_entropy(const uint32_t *hist, uint64_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  double sum = 0;
+  for (int i = 0; i < 256; i++) {
+    if (hist[i] > 0) {
+      sum += hist[i] * log2((double)hist[i]);
+    }
+  }
+  return (float)((log2((double)n) - sum / n) / 8);
+}
+
+// Add the tables of a set of histograms into the first one
+static void hist_merge(uint32_t (*tables)[256], int ntables) {
+  for (int t = 1; t < ntables; t++) {
+    for (int i = 0; i < 256; i++) {
+      tables[0][i] += tables[t][i];
+    }
+  }
+}
+
+// Accumulate the IEEE exponents of the n items of typesize bytes in ip, leaving
+// zeros, subnormals, infinities and NaNs out
+#define EXPONENT_LOOP(type, shift, mask)                  \
+  for (int32_t i = 0; i < n; i++) {                       \
+    type v;                                               \
+    memcpy(&v, ip + i * sizeof(type), sizeof(type));      \
+    uint32_t e = (uint32_t)(v >> (shift)) & (mask);       \
+    bool valid = (e != 0) & (e != (mask));                \
+    count += valid;                                       \
+    sum += valid ? e : 0;                                 \
+    sum2 += valid ? (uint64_t)e * e : 0;                  \
+  }
+
+static void add_exponents(const uint8_t *ip, int32_t n, int32_t typesize,
+                          uint64_t *count_out, uint64_t *sum_out, uint64_t *sum2_out) {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t sum2 = 0;
+  switch (typesize) {
+    case 2:
+      EXPONENT_LOOP(uint16_t, 10, 0x1f)
+      break;
+    case 4:
+      EXPONENT_LOOP(uint32_t, 23, 0xff)
+      break;
+    default:
+      EXPONENT_LOOP(uint64_t, 52, 0x7ff)
+      break;
+  }
+  *count_out += count;
+  *sum_out += sum;
+  *sum2_out += sum2;
+}
+
+int btune_byte_stats_compute(const uint8_t *src, int32_t size, int32_t typesize,
+                             int32_t sample_size, btune_byte_stats *stats) {
+  memset(stats, 0, sizeof(btune_byte_stats));
+  if (size <= 0) {
+    return -1;
+  }
+
+  int32_t nplanes = (typesize >= 1 && typesize <= MAX_PLANES) ? typesize : 1;
+  // Every plane gets the same number of tables (at least one), and table t counts plane t % nplanes
+  int ntables = (nplanes < NTABLES) ? ((NTABLES + nplanes - 1) / nplanes) * nplanes : nplanes;
+  int32_t window = WINDOW_SIZE - WINDOW_SIZE % nplanes;
+  if (window > size) {
+    window = size - size % nplanes;
+    if (window == 0) {
+      window = size;
+      nplanes = 1;
+      ntables = NTABLES;
+    }
+  }
+  if (sample_size < window) {
+    sample_size = window;
+  }
+  int32_t nwindows = sample_size / window;
+  int32_t max_windows = size / window;
+  if (nwindows > max_windows) {
+    nwindows = max_windows;
+  }
+  bool floats = (typesize == 2 || typesize == 4 || typesize == 8);
+
+  uint32_t planes[MAX_PLANES][256];
+  uint32_t deltas[NTABLES][256];
+  memset(planes, 0, sizeof(planes));
+  memset(deltas, 0, sizeof(deltas));
+  uint64_t nbytes = 0;
+  uint64_t ndeltas = 0;
+  uint64_t nzeros = 0;
+  uint64_t nruns = 0;
+  uint64_t nexps = 0;
+  uint64_t exp_sum = 0;
+  uint64_t exp_sum2 = 0;
+
+  for (int32_t w = 0; w < nwindows; w++) {
+    // Windows at the start of nwindows equal strata, aligned to the typesize
+    int64_t offset = (int64_t)w * (size / nwindows);
+    offset -= offset % nplanes;
+    const uint8_t *ip = src + offset;
+
+    // Byte planes
+    int32_t i = 0;
+    for (; i + ntables <= window; i += ntables) {
+      for (int t = 0; t < ntables; t++) {
+        planes[t][ip[i + t]]++;
+      }
+    }
+    for (int t = 0; i < window; i++, t++) {
+      planes[t][ip[i]]++;
+    }
+
+    // Deltas with the same byte of the previous item
+    uint8_t delta[WINDOW_SIZE];
+    int32_t n = window - nplanes;
+    for (i = 0; i < n; i++) {
+      delta[i] = (uint8_t)(ip[i + nplanes] - ip[i]);
+    }
+    for (i = 0; i + NTABLES <= n; i += NTABLES) {
+      for (int t = 0; t < NTABLES; t++) {
+        deltas[t][delta[i + t]]++;
+      }
+    }
+    for (; i < n; i++) {
+      deltas[0][delta[i]]++;
+    }
+    ndeltas += (n > 0) ? n : 0;
+
+    // Zeros and runs (plain reductions, vectorized by the compiler)
+    uint32_t zeros = 0;
+    uint32_t runs = 0;
+    for (i = 0; i < window; i++) {
+      zeros += (ip[i] == 0);
+    }
+    for (i = 1; i < window; i++) {
+      runs += (ip[i] == ip[i - 1]);
+    }
+    nzeros += zeros;
+    nruns += runs;
+    nbytes += window;
+
+    if (floats) {
+      add_exponents(ip, window / typesize, typesize, &nexps, &exp_sum, &exp_sum2);
+    }
+  }
+
+  // Entropy of every plane, and of all of them together
+  hist_merge(deltas, NTABLES);
+  if (nplanes == 1) {
+    hist_merge(planes, ntables);
+    stats->plane_entropy = hist_entropy(planes[0], nbytes);
+    stats->entropy = stats->plane_entropy;
+  }
+  else {
+    for (int t = nplanes; t < ntables; t++) {
+      for (int j = 0; j < 256; j++) {
+        planes[t % nplanes][j] += planes[t][j];
+      }
+    }
+    uint32_t all[256];
+    memset(all, 0, sizeof(all));
+    float plane_entropy = 0;
+    for (int p = 0; p < nplanes; p++) {
+      plane_entropy += hist_entropy(planes[p], nbytes / nplanes);
+      for (int j = 0; j < 256; j++) {
+        all[j] += planes[p][j];
+      }
+    }
+    stats->plane_entropy = plane_entropy / nplanes;
+    stats->entropy = hist_entropy(all, nbytes);
+  }
+  stats->delta_entropy = hist_entropy(deltas[0], ndeltas);
+  stats->zeros = (float)nzeros / nbytes;
+  stats->runs = (float)nruns / nbytes;
+  if (nexps > 1) {
+    double mean = (double)exp_sum / nexps;
+    double var = (double)exp_sum2 / nexps - mean * mean;
+    stats->exponent_spread = (var > 0) ? (float)sqrt(var) : 0;
+  }
+
+  return 0;
+}
+
+
+static const char *input_names[BTUNE_NINPUT_KINDS] = {
+  "cratio", "speed", "tradeoff", "entropy", "plane_entropy", "zeros", "runs",
+  "delta_entropy", "exponent_spread", "shuffle_cratio", "bitshuffle_cratio", "bytedelta_cratio",
+  "lz4_cratio", "zlib_cratio", "zstd_cratio",
+};
+
+static double json_number(const json_value *value) {
+  return (value->type == json_integer) ? (double)value->u.integer : value->u.dbl;
+}
+
+static int input_kind(const char *name) {
+  for (int kind = 0; kind < BTUNE_NINPUT_KINDS; kind++) {
+    if (strcmp(name, input_names[kind]) == 0) {
+      return kind;
+    }
+  }
+  return -1;
+}
+
+static void read_norm(const json_value *json, btune_input_norm *norm) {
+  for (unsigned int i = 0; i < json->u.object.length; i++) {
+    const char *name = json->u.object.values[i].name;
+    json_value *value = json->u.object.values[i].value;
+    if (strcmp(name, "mean") == 0) {
+      norm->mean = (float)json_number(value);
+    }
+    else if (strcmp(name, "std") == 0) {
+      norm->std = (float)json_number(value);
+    }
+  }
+}
+
+void btune_input_schema_default(btune_input_schema *schema) {
+  memset(schema, 0, sizeof(btune_input_schema));
+  schema->ninputs = 3;
+  schema->inputs[0] = BTUNE_INPUT_CRATIO;
+  schema->inputs[1] = BTUNE_INPUT_SPEED;
+  schema->inputs[2] = BTUNE_INPUT_TRADEOFF;
+  for (int i = 0; i < schema->ninputs; i++) {
+    schema->norms[i].std = 1;
+  }
+}
+
+int btune_input_schema_read(const json_value *json, btune_input_schema *schema) {
+  json_value *features = NULL;
+  json_value *norms = NULL;
+  int version = 0;
+  for (unsigned int i = 0; i < json->u.object.length; i++) {
+    const char *name = json->u.object.values[i].name;
+    json_value *value = json->u.object.values[i].value;
+    if (strcmp(name, "version") == 0) {
+      version = (int)json_number(value);
+    }
+    else if (strcmp(name, "features") == 0) {
+      features = value;
+    }
+    else if (strcmp(name, "norms") == 0) {
+      norms = value;
+    }
+  }
+  if (version > BTUNE_INPUT_SCHEMA_VERSION) {
+    printf("WARNING: Input schema version %d of the model is not supported (up to %d)\n",
+           version, BTUNE_INPUT_SCHEMA_VERSION);
+    return -1;
+  }
+  if (features == NULL) {
+    return 0;
+  }
+  if (features->type != json_array || features->u.array.length > BTUNE_MAX_INPUTS) {
+    printf("WARNING: The model has too many inputs (up to %d)\n", BTUNE_MAX_INPUTS);
+    return -1;
+  }
+
+  schema->ninputs = (int)features->u.array.length;
+  schema->byte_stats = false;
+  schema->filter_probe = false;
+  schema->codec_probe = false;
+  for (int i = 0; i < schema->ninputs; i++) {
+    json_value *feature = features->u.array.values[i];
+    int kind = (feature->type == json_string) ? input_kind(feature->u.string.ptr) : -1;
+    if (kind < 0) {
+      printf("WARNING: Unknown model input '%s'\n",
+             (feature->type == json_string) ? feature->u.string.ptr : "?");
+      return -1;
+    }
+    schema->inputs[i] = (btune_input_kind)kind;
+    schema->norms[i].mean = 0;
+    schema->norms[i].std = 1;
+    if (kind >= BTUNE_INPUT_ENTROPY && kind <= BTUNE_INPUT_EXPONENT_SPREAD) {
+      schema->byte_stats = true;
+    }
+    if (kind >= BTUNE_INPUT_SHUFFLE_CRATIO && kind <= BTUNE_INPUT_BYTEDELTA_CRATIO) {
+      schema->filter_probe = true;
+    }
+    if (kind >= BTUNE_INPUT_LZ4_CRATIO) {
+      schema->codec_probe = true;
+    }
+    for (unsigned int j = 0; norms != NULL && norms->type == json_object && j < norms->u.object.length; j++) {
+      if (strcmp(norms->u.object.values[j].name, input_names[kind]) == 0) {
+        read_norm(norms->u.object.values[j].value, &schema->norms[i]);
+      }
+    }
+  }
+
+  return 0;
+}
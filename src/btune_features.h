@@ -0,0 +1,118 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_features.h
+ * @brief Byte-level statistics of a chunk, used as extra inputs of the models.
+ *
+ * The statistics are computed on a sample of the chunk, in a single pass that
+ * fills a few byte histograms.  The bytes are also seen as shuffled with the
+ * typesize of the data (byte planes), without actually moving them.
+ *
+ * The inputs a model consumes, and how they are normalized, are declared by
+ * the input schema of its metadata.
+ */
+
+#ifndef BTUNE_FEATURES_H
+#define BTUNE_FEATURES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  float entropy;
+  // Order-0 Shannon entropy of the bytes, in bits per byte divided by 8 (0 to 1)
+  float plane_entropy;
+  // Mean entropy of the byte planes of a virtual shuffle, in the same units
+  float zeros;
+  // Fraction of zero bytes
+  float runs;
+  // Fraction of bytes equal to the previous one
+  float delta_entropy;
+  // Entropy of the difference of every byte with the one in the previous item
+  float exponent_spread;
+  // Standard deviation of the IEEE exponents for typesizes 2, 4 and 8 (0 otherwise)
+} btune_byte_stats;
+
+/*
+ * Compute the byte statistics of size bytes of src, made of items of
+ * typesize bytes.  At most sample_size bytes are read, in windows spread
+ * evenly over src.  Returns 0, or a negative value if src is empty.
+ */
+int btune_byte_stats_compute(const uint8_t *src, int32_t size, int32_t typesize,
+                             int32_t sample_size, btune_byte_stats *stats);
+
+// The inputs a model may consume, by their names in the metadata
+typedef enum {
+  BTUNE_INPUT_CRATIO,
+  BTUNE_INPUT_SPEED,
+  BTUNE_INPUT_TRADEOFF,
+  BTUNE_INPUT_ENTROPY,
+  BTUNE_INPUT_PLANE_ENTROPY,
+  BTUNE_INPUT_ZEROS,
+  BTUNE_INPUT_RUNS,
+  BTUNE_INPUT_DELTA_ENTROPY,
+  BTUNE_INPUT_EXPONENT_SPREAD,
+  BTUNE_INPUT_SHUFFLE_CRATIO,
+  BTUNE_INPUT_BITSHUFFLE_CRATIO,
+  BTUNE_INPUT_BYTEDELTA_CRATIO,
+  BTUNE_INPUT_LZ4_CRATIO,
+  BTUNE_INPUT_ZLIB_CRATIO,
+  BTUNE_INPUT_ZSTD_CRATIO,
+  BTUNE_NINPUT_KINDS,
+} btune_input_kind;
+
+// Version of the input schema understood by this build.  Models without an
+// input schema (version 0) consume cratio, speed and tradeoff.
+#define BTUNE_INPUT_SCHEMA_VERSION 1
+// Most inputs a model may declare
+#define BTUNE_MAX_INPUTS 16
+
+typedef struct {
+  float mean;
+  float std;
+} btune_input_norm;
+
+typedef struct {
+  int ninputs;
+  // Number of inputs of the model
+  btune_input_kind inputs[BTUNE_MAX_INPUTS];
+  // The kind of every input, in order
+  btune_input_norm norms[BTUNE_MAX_INPUTS];
+  // The normalization of the inputs beyond cratio, speed and tradeoff (mean 0 and std 1 if not given)
+  bool byte_stats;
+  // Whether any input needs the byte statistics of the chunk
+  bool filter_probe;
+  // Whether any input needs the estimates of the probe after every filter
+  bool codec_probe;
+  // Whether any input needs the estimates of the codec proxies
+} btune_input_schema;
+
+// Set the inputs of the models without an input schema: cratio, speed and tradeoff
+void btune_input_schema_default(btune_input_schema *schema);
+
+/*
+ * Read the input schema of a model, the "inputs" entry of its metadata:
+ *   {"version": 1, "features": ["cratio", "speed", "tradeoff", "entropy", ...],
+ *    "norms": {"entropy": {"mean": ..., "std": ...}, ...}}
+ * Without "features", schema is left as is.  Returns 0, or a negative value if
+ * the schema has a newer version, too many inputs or unknown ones.
+ */
+int btune_input_schema_read(const json_value *json, btune_input_schema *schema);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_FEATURES_H */
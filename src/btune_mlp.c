@@ -0,0 +1,690 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+  #include <immintrin.h>
+  #define MLP_HAVE_AVX2
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+  #define MLP_HAVE_NEON
+#endif
+
+#include "btune_mlp.h"
+
+
+// The subset of the TF Lite schema (tensorflow/lite/schema/schema.fbs) used by the models
+enum {
+  // Model fields
+  MODEL_OPERATOR_CODES = 1,
+  MODEL_SUBGRAPHS = 2,
+  MODEL_BUFFERS = 4,
+  // SubGraph fields
+  SUBGRAPH_TENSORS = 0,
+  SUBGRAPH_OPERATORS = 3,
+  // Tensor fields
+  TENSOR_SHAPE = 0,
+  TENSOR_TYPE = 1,
+  TENSOR_BUFFER = 2,
+  TENSOR_QUANTIZATION = 4,
+  // QuantizationParameters fields
+  QUANT_SCALE = 2,
+  // Operator fields
+  OPERATOR_OPCODE_INDEX = 0,
+  OPERATOR_INPUTS = 1,
+  OPERATOR_BUILTIN_OPTIONS = 4,
+  // OperatorCode fields
+  OPCODE_DEPRECATED_BUILTIN_CODE = 0,
+  OPCODE_BUILTIN_CODE = 3,
+  // Buffer fields
+  BUFFER_DATA = 0,
+  // FullyConnectedOptions fields
+  FC_FUSED_ACTIVATION = 0,
+  // SoftmaxOptions fields
+  SOFTMAX_BETA = 0,
+};
+
+// Builtin operators
+enum {
+  OP_DEQUANTIZE = 6,
+  OP_FULLY_CONNECTED = 9,
+  OP_RELU = 19,
+  OP_RELU6 = 21,
+  OP_RESHAPE = 22,
+  OP_SOFTMAX = 25,
+  OP_TANH = 28,
+  OP_QUANTIZE = 114,
+};
+
+// Tensor types
+enum {
+  TENSOR_FLOAT32 = 0,
+  TENSOR_INT32 = 2,
+  TENSOR_INT8 = 9,
+};
+
+// Fused activations
+enum {
+  ACT_NONE = 0,
+  ACT_RELU = 1,
+  ACT_RELU6 = 3,
+  ACT_TANH = 4,
+};
+
+// A flatbuffer in memory
+typedef struct {
+  const uint8_t *base;
+  size_t size;
+} flatbuffer;
+
+static uint16_t read_u16(const uint8_t *p) {
+  uint16_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static bool fb_contains(const flatbuffer *fb, const uint8_t *p, size_t len) {
+  return p != NULL && p >= fb->base && (size_t)(p - fb->base) + len <= fb->size;
+}
+
+// Get the position of a field of a table, or NULL if the field is absent
+static const uint8_t * fb_field(const flatbuffer *fb, const uint8_t *table, int id) {
+  if (!fb_contains(fb, table, 4)) {
+    return NULL;
+  }
+  const uint8_t *vtable = table - (int32_t)read_u32(table);
+  if (!fb_contains(fb, vtable, 4)) {
+    return NULL;
+  }
+  uint16_t vtable_size = read_u16(vtable);
+  if (4 + 2 * id + 2 > vtable_size) {
+    return NULL;
+  }
+  uint16_t offset = read_u16(vtable + 4 + 2 * id);
+  return offset ? table + offset : NULL;
+}
+
+static uint32_t fb_u32(const flatbuffer *fb, const uint8_t *table, int id, uint32_t defvalue) {
+  const uint8_t *p = fb_field(fb, table, id);
+  return fb_contains(fb, p, 4) ? read_u32(p) : defvalue;
+}
+
+static uint8_t fb_u8(const flatbuffer *fb, const uint8_t *table, int id, uint8_t defvalue) {
+  const uint8_t *p = fb_field(fb, table, id);
+  return fb_contains(fb, p, 1) ? *p : defvalue;
+}
+
+static float fb_float(const flatbuffer *fb, const uint8_t *table, int id, float defvalue) {
+  const uint8_t *p = fb_field(fb, table, id);
+  float value = defvalue;
+  if (fb_contains(fb, p, 4)) {
+    memcpy(&value, p, sizeof(value));
+  }
+  return value;
+}
+
+// Follow an offset to a table or vector
+static const uint8_t * fb_deref(const flatbuffer *fb, const uint8_t *p) {
+  if (!fb_contains(fb, p, 4)) {
+    return NULL;
+  }
+  p += read_u32(p);
+  return fb_contains(fb, p, 0) ? p : NULL;
+}
+
+static const uint8_t * fb_table(const flatbuffer *fb, const uint8_t *table, int id) {
+  return fb_deref(fb, fb_field(fb, table, id));
+}
+
+// Get a vector field, with elements of elsize bytes.  Returns NULL if absent or invalid.
+static const uint8_t * fb_vector(const flatbuffer *fb, const uint8_t *table, int id,
+                                 size_t elsize, uint32_t *len) {
+  *len = 0;
+  const uint8_t *vector = fb_deref(fb, fb_field(fb, table, id));
+  if (!fb_contains(fb, vector, 4)) {
+    return NULL;
+  }
+  uint32_t n = read_u32(vector);
+  if (!fb_contains(fb, vector + 4, (size_t)n * elsize)) {
+    return NULL;
+  }
+  *len = n;
+  return vector + 4;
+}
+
+// Get the element i of a vector of tables
+static const uint8_t * fb_vector_table(const flatbuffer *fb, const uint8_t *vector, uint32_t i) {
+  return fb_deref(fb, vector + 4 * i);
+}
+
+// A constant tensor of the model
+typedef struct {
+  const uint8_t *data;
+  int type;
+  int32_t shape[2];
+  int ndims;
+  const uint8_t *scales;
+  // The quantization scales (per tensor or per channel), or NULL
+  uint32_t nscales;
+} model_tensor;
+
+static float tensor_scale(const model_tensor *tensor, int i) {
+  if (tensor->nscales == 0) {
+    return 1.f;
+  }
+  float scale;
+  memcpy(&scale, tensor->scales + 4 * ((tensor->nscales > 1) ? i : 0), sizeof(scale));
+  return scale;
+}
+
+static size_t type_size(int type) {
+  switch (type) {
+    case TENSOR_FLOAT32:
+    case TENSOR_INT32:
+      return 4;
+    case TENSOR_INT8:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static const uint8_t * get_tensor(const flatbuffer *fb, const uint8_t *subgraph, int32_t index) {
+  uint32_t ntensors;
+  const uint8_t *tensors = fb_vector(fb, subgraph, SUBGRAPH_TENSORS, 4, &ntensors);
+  if (tensors == NULL || index < 0 || (uint32_t)index >= ntensors) {
+    return NULL;
+  }
+  return fb_vector_table(fb, tensors, index);
+}
+
+// Read the shape and quantization of a tensor, and its data if it is a constant
+static int read_tensor(const flatbuffer *fb, const uint8_t *model, const uint8_t *subgraph,
+                       int32_t index, model_tensor *tensor) {
+  uint32_t nbuffers, ndims, nbytes;
+  const uint8_t *buffers = fb_vector(fb, model, MODEL_BUFFERS, 4, &nbuffers);
+  const uint8_t *t = get_tensor(fb, subgraph, index);
+  if (t == NULL) {
+    return -1;
+  }
+  tensor->type = fb_u8(fb, t, TENSOR_TYPE, TENSOR_FLOAT32);
+  if (type_size(tensor->type) == 0) {
+    fprintf(stderr, "Error: tensor type %d not supported by the built-in engine\n", tensor->type);
+    return -1;
+  }
+  const uint8_t *shape = fb_vector(fb, t, TENSOR_SHAPE, 4, &ndims);
+  if (shape == NULL || ndims < 1 || ndims > 2) {
+    return -1;
+  }
+  tensor->ndims = (int)ndims;
+  tensor->shape[0] = (int32_t)read_u32(shape);
+  tensor->shape[1] = (ndims == 2) ? (int32_t)read_u32(shape + 4) : 1;
+
+  const uint8_t *quantization = fb_table(fb, t, TENSOR_QUANTIZATION);
+  tensor->scales = quantization ? fb_vector(fb, quantization, QUANT_SCALE, 4, &tensor->nscales) : NULL;
+  if (tensor->scales == NULL) {
+    tensor->nscales = 0;
+  }
+
+  tensor->data = NULL;
+  uint32_t buffer_index = fb_u32(fb, t, TENSOR_BUFFER, 0);
+  if (buffer_index < nbuffers) {
+    const uint8_t *buffer = fb_vector_table(fb, buffers, buffer_index);
+    const uint8_t *data = fb_vector(fb, buffer, BUFFER_DATA, 1, &nbytes);
+    if (data != NULL && nbytes > 0) {
+      if (nbytes != (size_t)tensor->shape[0] * tensor->shape[1] * type_size(tensor->type)) {
+        return -1;
+      }
+      tensor->data = data;
+    }
+  }
+  return 0;
+}
+
+static mlp_activation to_activation(uint8_t fused) {
+  switch (fused) {
+    case ACT_RELU:
+      return MLP_RELU;
+    case ACT_RELU6:
+      return MLP_RELU6;
+    case ACT_TANH:
+      return MLP_TANH;
+    default:
+      return MLP_LINEAR;
+  }
+}
+
+// Add a dense layer.  The input tensor is only used for the scale of int32 biases.
+static int add_dense_layer(btune_mlp *mlp, const model_tensor *input, const model_tensor *weights,
+                           const model_tensor *bias, mlp_activation activation) {
+  int noutputs = weights->shape[0];
+  int ninputs = weights->shape[1];
+  if (mlp->nlayers > 0 && mlp->layers[mlp->nlayers - 1].noutputs != ninputs) {
+    fprintf(stderr, "Error: layer %d has %d inputs, but the previous layer has %d outputs\n",
+            mlp->nlayers, ninputs, mlp->layers[mlp->nlayers - 1].noutputs);
+    return -1;
+  }
+  mlp->layers = realloc(mlp->layers, (mlp->nlayers + 1) * sizeof(mlp_layer));
+  mlp_layer *layer = &mlp->layers[mlp->nlayers];
+  memset(layer, 0, sizeof(mlp_layer));
+  layer->ninputs = ninputs;
+  layer->noutputs = noutputs;
+  layer->activation = activation;
+  mlp->nlayers++;
+  // Copy, so that the file buffer can be released (and the data is aligned)
+  size_t nweights = (size_t)noutputs * ninputs;
+  if (weights->type == TENSOR_INT8) {
+    layer->qweights = malloc(nweights);
+    memcpy(layer->qweights, weights->data, nweights);
+    layer->scales = malloc(noutputs * sizeof(float));
+    for (int j = 0; j < noutputs; j++) {
+      layer->scales[j] = tensor_scale(weights, j);
+    }
+    mlp->quantized = true;
+  }
+  else if (weights->type == TENSOR_FLOAT32) {
+    layer->weights = malloc(nweights * sizeof(float));
+    memcpy(layer->weights, weights->data, nweights * sizeof(float));
+  }
+  else {
+    return -1;
+  }
+  layer->bias = calloc(noutputs, sizeof(float));
+  if (bias != NULL) {
+    if (bias->type == TENSOR_INT32) {
+      // Quantized bias: scale = input scale * weight scale
+      for (int j = 0; j < noutputs; j++) {
+        int32_t value;
+        memcpy(&value, bias->data + 4 * j, sizeof(value));
+        layer->bias[j] = (float)value * tensor_scale(input, 0) * tensor_scale(weights, j);
+      }
+    }
+    else if (bias->type == TENSOR_FLOAT32) {
+      memcpy(layer->bias, bias->data, noutputs * sizeof(float));
+    }
+    else {
+      return -1;
+    }
+  }
+  if (mlp->nlayers == 1) {
+    mlp->ninputs = ninputs;
+  }
+  mlp->noutputs = noutputs;
+  if (ninputs > mlp->max_width) {
+    mlp->max_width = ninputs;
+  }
+  if (noutputs > mlp->max_width) {
+    mlp->max_width = noutputs;
+  }
+  return 0;
+}
+
+static int parse_model(const flatbuffer *fb, btune_mlp *mlp) {
+  const uint8_t *model = fb_deref(fb, fb->base);
+  uint32_t nopcodes, nsubgraphs, noperators;
+  const uint8_t *opcodes = fb_vector(fb, model, MODEL_OPERATOR_CODES, 4, &nopcodes);
+  const uint8_t *subgraphs = fb_vector(fb, model, MODEL_SUBGRAPHS, 4, &nsubgraphs);
+  if (opcodes == NULL || subgraphs == NULL || nsubgraphs < 1) {
+    return -1;
+  }
+  const uint8_t *subgraph = fb_vector_table(fb, subgraphs, 0);
+  const uint8_t *operators = fb_vector(fb, subgraph, SUBGRAPH_OPERATORS, 4, &noperators);
+  if (operators == NULL) {
+    return -1;
+  }
+
+  // The models are a chain of operators
+  for (uint32_t i = 0; i < noperators; i++) {
+    const uint8_t *op = fb_vector_table(fb, operators, i);
+    uint32_t opcode_index = fb_u32(fb, op, OPERATOR_OPCODE_INDEX, 0);
+    if (opcode_index >= nopcodes) {
+      return -1;
+    }
+    const uint8_t *opcode = fb_vector_table(fb, opcodes, opcode_index);
+    int32_t code = (int32_t)fb_u32(fb, opcode, OPCODE_BUILTIN_CODE, 0);
+    int32_t deprecated_code = fb_u8(fb, opcode, OPCODE_DEPRECATED_BUILTIN_CODE, 0);
+    if (deprecated_code > code) {
+      code = deprecated_code;
+    }
+    const uint8_t *options = fb_table(fb, op, OPERATOR_BUILTIN_OPTIONS);
+    mlp_layer *last = (mlp->nlayers > 0) ? &mlp->layers[mlp->nlayers - 1] : NULL;
+
+    switch (code) {
+      case OP_FULLY_CONNECTED: {
+        uint32_t ninputs;
+        const uint8_t *inputs = fb_vector(fb, op, OPERATOR_INPUTS, 4, &ninputs);
+        model_tensor input, weights, bias;
+        if (inputs == NULL || ninputs < 2 ||
+            read_tensor(fb, model, subgraph, (int32_t)read_u32(inputs), &input) < 0 ||
+            read_tensor(fb, model, subgraph, (int32_t)read_u32(inputs + 4), &weights) < 0 ||
+            weights.ndims != 2 || weights.data == NULL) {
+          return -1;
+        }
+        bool has_bias = (ninputs > 2) && ((int32_t)read_u32(inputs + 8) >= 0);
+        if (has_bias && (read_tensor(fb, model, subgraph, (int32_t)read_u32(inputs + 8), &bias) < 0 ||
+                         bias.data == NULL)) {
+          return -1;
+        }
+        uint8_t fused = options ? fb_u8(fb, options, FC_FUSED_ACTIVATION, ACT_NONE) : ACT_NONE;
+        if (add_dense_layer(mlp, &input, &weights, has_bias ? &bias : NULL,
+                            to_activation(fused)) < 0) {
+          return -1;
+        }
+        break;
+      }
+      case OP_RELU:
+      case OP_RELU6:
+      case OP_TANH:
+        if (last == NULL || last->activation != MLP_LINEAR) {
+          return -1;
+        }
+        last->activation = (code == OP_RELU) ? MLP_RELU : (code == OP_RELU6) ? MLP_RELU6 : MLP_TANH;
+        break;
+      case OP_SOFTMAX:
+        mlp->softmax = true;
+        mlp->softmax_beta = options ? fb_float(fb, options, SOFTMAX_BETA, 1.f) : 1.f;
+        break;
+      case OP_RESHAPE:
+      case OP_QUANTIZE:
+      case OP_DEQUANTIZE:
+        // The activations are kept in float, even for int8 models
+        break;
+      default:
+        fprintf(stderr, "Error: operator %d not supported by the built-in engine\n", code);
+        return -1;
+    }
+  }
+
+  return (mlp->nlayers > 0) ? 0 : -1;
+}
+
+btune_mlp * btune_mlp_load(const char *fname) {
+  FILE *file = fopen(fname, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size <= 8) {
+    fclose(file);
+    return NULL;
+  }
+  uint8_t *buffer = malloc(size);
+  size_t nread = fread(buffer, 1, size, file);
+  fclose(file);
+  if (nread != (size_t)size) {
+    free(buffer);
+    return NULL;
+  }
+
+  flatbuffer fb = {buffer, (size_t)size};
+  btune_mlp *mlp = calloc(1, sizeof(btune_mlp));
+  int rc = parse_model(&fb, mlp);
+  free(buffer);
+  if (rc < 0) {
+    fprintf(stderr, "Error: cannot read the model in %s\n", fname);
+    btune_mlp_free(mlp);
+    return NULL;
+  }
+  return mlp;
+}
+
+void btune_mlp_free(btune_mlp *mlp) {
+  if (mlp == NULL) {
+    return;
+  }
+  for (int i = 0; i < mlp->nlayers; i++) {
+    free(mlp->layers[i].weights);
+    free(mlp->layers[i].qweights);
+    free(mlp->layers[i].scales);
+    free(mlp->layers[i].bias);
+  }
+  free(mlp->layers);
+  free(mlp);
+}
+
+btune_mlp_workspace * btune_mlp_workspace_new(const btune_mlp *mlp) {
+  btune_mlp_workspace *workspace = malloc(sizeof(btune_mlp_workspace));
+  workspace->mlp = mlp;
+  workspace->buffers[0] = malloc(mlp->max_width * sizeof(float));
+  workspace->buffers[1] = malloc(mlp->max_width * sizeof(float));
+  workspace->qinput = malloc(mlp->max_width);
+  return workspace;
+}
+
+void btune_mlp_workspace_free(btune_mlp_workspace *workspace) {
+  if (workspace == NULL) {
+    return;
+  }
+  free(workspace->buffers[0]);
+  free(workspace->buffers[1]);
+  free(workspace->qinput);
+  free(workspace);
+}
+
+
+// Dot product kernels
+typedef float (*dot_fn)(const float *a, const float *b, int n);
+typedef int32_t (*dot_i8_fn)(const int8_t *a, const int8_t *b, int n);
+
+static float dot_scalar(const float *a, const float *b, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static int32_t dot_i8_scalar(const int8_t *a, const int8_t *b, int n) {
+  int32_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+#if defined(MLP_HAVE_AVX2)
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+  }
+  // Horizontal sum
+  __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+  sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+  float sum = _mm_cvtss_f32(sum4);
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_i8_avx2(const int8_t *a, const int8_t *b, int n) {
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+    __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+  // Horizontal sum
+  __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(2, 3, 0, 1)));
+  int32_t sum = _mm_cvtsi128_si32(sum4);
+  for (; i < n; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+#endif
+
+#if defined(MLP_HAVE_NEON)
+static float dot_neon(const float *a, const float *b, int n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = vfmaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+  }
+  float sum = vaddvq_f32(acc);
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static int32_t dot_i8_neon(const int8_t *a, const int8_t *b, int n) {
+  int32x4_t acc = vdupq_n_s32(0);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    int8x16_t va = vld1q_s8(a + i);
+    int8x16_t vb = vld1q_s8(b + i);
+    acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+    acc = vpadalq_s16(acc, vmull_high_s8(va, vb));
+  }
+  int32_t sum = vaddvq_s32(acc);
+  for (; i < n; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+#endif
+
+// The kernels for this CPU, selected once per process
+static dot_fn dot = dot_scalar;
+static dot_i8_fn dot_i8 = dot_i8_scalar;
+static const char *dot_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#if defined(MLP_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    dot = dot_avx2;
+    dot_i8 = dot_i8_avx2;
+    dot_name = "avx2";
+  }
+#endif
+#if defined(MLP_HAVE_NEON)
+  dot = dot_neon;
+  dot_i8 = dot_i8_neon;
+  dot_name = "neon";
+#endif
+}
+
+const char * btune_mlp_kernel_name(void) {
+  pthread_once(&kernel_once, select_kernels);
+  return dot_name;
+}
+
+// Quantize the input of an int8 layer, with a symmetric per-row scale.  Returns the scale.
+static float quantize_row(const float *input, int n, int8_t *qinput) {
+  float max = 0;
+  for (int i = 0; i < n; i++) {
+    float value = fabsf(input[i]);
+    if (value > max) {
+      max = value;
+    }
+  }
+  float scale = (max > 0) ? max / 127 : 1;
+  for (int i = 0; i < n; i++) {
+    qinput[i] = (int8_t)lrintf(input[i] / scale);
+  }
+  return scale;
+}
+
+static void dense(const mlp_layer *layer, const float *input, int8_t *qinput, float *output) {
+  const float *weights = layer->weights;
+  const int8_t *qweights = layer->qweights;
+  float input_scale = 0;
+  if (qweights != NULL) {
+    input_scale = quantize_row(input, layer->ninputs, qinput);
+  }
+  for (int j = 0; j < layer->noutputs; j++) {
+    float value;
+    if (qweights != NULL) {
+      value = (float)dot_i8(qweights, qinput, layer->ninputs) * input_scale * layer->scales[j];
+      qweights += layer->ninputs;
+    }
+    else {
+      value = dot(weights, input, layer->ninputs);
+      weights += layer->ninputs;
+    }
+    value += layer->bias[j];
+    switch (layer->activation) {
+      case MLP_RELU:
+        value = (value > 0) ? value : 0;
+        break;
+      case MLP_RELU6:
+        value = (value > 0) ? ((value < 6) ? value : 6) : 0;
+        break;
+      case MLP_TANH:
+        value = tanhf(value);
+        break;
+      default:
+        break;
+    }
+    output[j] = value;
+  }
+}
+
+static void softmax(float *values, int n, float beta) {
+  float max = values[0];
+  for (int i = 1; i < n; i++) {
+    if (values[i] > max) {
+      max = values[i];
+    }
+  }
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    values[i] = expf(beta * (values[i] - max));
+    sum += values[i];
+  }
+  for (int i = 0; i < n; i++) {
+    values[i] /= sum;
+  }
+}
+
+int btune_mlp_predict(btune_mlp_workspace *workspace, const float *inputs, int nrows,
+                      float *outputs) {
+  const btune_mlp *mlp = workspace->mlp;
+  pthread_once(&kernel_once, select_kernels);
+
+  for (int row = 0; row < nrows; row++) {
+    const float *input = inputs + row * mlp->ninputs;
+    float *output = outputs + row * mlp->noutputs;
+    for (int i = 0; i < mlp->nlayers; i++) {
+      float *dest = (i == mlp->nlayers - 1) ? output : workspace->buffers[i % 2];
+      dense(&mlp->layers[i], input, workspace->qinput, dest);
+      input = dest;
+    }
+    if (mlp->softmax) {
+      softmax(output, mlp->noutputs, mlp->softmax_beta);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_mlp.h
+ * @brief Built-in inference engine for the Btune models.
+ *
+ * The Btune models are small classifiers made of dense layers with ReLU
+ * activations and a final softmax.  This engine reads them directly from the
+ * .tflite flatbuffer, so that Btune can be built without TensorFlow Lite.
+ *
+ * Int8 models are supported too: the weights stay in int8, and the input of
+ * every layer is quantized on the fly with its own scale.
+ */
+
+#ifndef BTUNE_MLP_H
+#define BTUNE_MLP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Activation functions
+typedef enum {
+  MLP_LINEAR,
+  MLP_RELU,
+  MLP_RELU6,
+  MLP_TANH,
+} mlp_activation;
+
+// A dense layer: output = activation(weights * input + bias)
+typedef struct {
+  int ninputs;
+  // Number of inputs
+  int noutputs;
+  // Number of outputs
+  float *weights;
+  // The weights, noutputs rows of ninputs floats (NULL for int8 layers)
+  int8_t *qweights;
+  // The int8 weights, noutputs rows of ninputs values (NULL for float layers)
+  float *scales;
+  // The scales of the int8 weights, one per row
+  float *bias;
+  // The bias, noutputs floats
+  mlp_activation activation;
+  // The activation applied to the outputs
+} mlp_layer;
+
+// A multilayer perceptron (read-only after loading, can be shared by threads)
+typedef struct {
+  int nlayers;
+  // Number of layers
+  mlp_layer *layers;
+  // The layers
+  int ninputs;
+  // Number of inputs of the model
+  int noutputs;
+  // Number of outputs of the model
+  int max_width;
+  // The width of the widest layer
+  bool softmax;
+  // Whether a softmax is applied to the outputs
+  float softmax_beta;
+  // The softmax beta (inverse temperature)
+  bool quantized;
+  // Whether the model has int8 layers
+} btune_mlp;
+
+// Scratch space for running a model, one per thread
+typedef struct {
+  const btune_mlp *mlp;
+  // The model
+  float *buffers[2];
+  // Ping-pong buffers for the layer activations
+  int8_t *qinput;
+  // The quantized input of int8 layers
+} btune_mlp_workspace;
+
+// Load a model from a .tflite flatbuffer.  Returns NULL on error.
+btune_mlp * btune_mlp_load(const char *fname);
+
+void btune_mlp_free(btune_mlp *mlp);
+
+btune_mlp_workspace * btune_mlp_workspace_new(const btune_mlp *mlp);
+
+void btune_mlp_workspace_free(btune_mlp_workspace *workspace);
+
+// Run the model on nrows rows of inputs, and store nrows rows of outputs
+int btune_mlp_predict(btune_mlp_workspace *workspace, const float *inputs, int nrows,
+                      float *outputs);
+
+// The name of the kernels selected for this CPU
+const char * btune_mlp_kernel_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_MLP_H */
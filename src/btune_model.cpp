@@ -1,14 +1,33 @@
+#if defined(BTUNE_USE_TFLITE)
 #include <tensorflow/lite/core/interpreter.h>
 #include <tensorflow/lite/kernels/register.h>
 #include <tensorflow/lite/model.h>
 #include <tensorflow/lite/optional_debug_tools.h>
+#endif
+
+#include <assert.h>
+#include <math.h>
 
 #include <blosc2.h>
 #include "context.h"
 #include "entropy_probe.h"
 #include "btune.h"
+#include "btune_calib.h"
+#include "btune_features.h"
 #include "btune_model.h"
 #include "json.h"
+#include "btune_mlp.h"
+#include "btune_state.h"
+
+
+// The inference backend: TensorFlow Lite, or the built-in engine
+#if defined(BTUNE_USE_TFLITE)
+typedef tflite::FlatBufferModel model_t;
+typedef tflite::Interpreter interpreter_t;
+#else
+typedef btune_mlp model_t;
+typedef btune_mlp_workspace interpreter_t;
+#endif
 
 
 typedef struct {
@@ -21,14 +40,28 @@ typedef struct {
   uint8_t filter;
   int clevel;
   int32_t splitmode;
-  unsigned long count; // Count the number of times the category is inferred
 } category_t;
 
+// Quantization parameters of int8 models: real = (quantized - zero_point) * scale
+typedef struct {
+  float scale;
+  int32_t zero_point;
+} quant_t;
+
+// Bytes of every chunk sampled for the byte statistics
+#define BYTE_STATS_SAMPLE (64 * 1024)
+// Bytes of every chunk sampled for the codec proxies
+#define CODEC_PROBE_SAMPLE (128 * 1024)
+
 typedef struct {
   norm_t cratio;
   norm_t cspeed;
+  btune_input_schema schema;
+  // The inputs of the model, and their normalization
   category_t *categories;
   int ncategories;
+  quant_t input_quant;
+  quant_t output_quant;
 } metadata_t;
 
 
@@ -39,45 +72,120 @@ static int fsize(FILE *file) {
   return size;
 }
 
-static int get_best_codec(
-  tflite::Interpreter *interpreter,
-  float cratio,
-  float cspeed,
-  float tradeoff,
-  int ncategories
+#if defined(BTUNE_USE_TFLITE)
+// Get the quantization parameters of a tensor, defaulting to the ones in the metadata
+static quant_t tensor_quant(const TfLiteTensor *tensor, const quant_t *defaults) {
+  quant_t quant = {tensor->params.scale, tensor->params.zero_point};
+  if (quant.scale == 0) {
+    quant = *defaults;
+  }
+  return quant;
+}
+#endif
+
+// Run the model on nrows rows of inputs and store the best category of every row in best.
+// If probs is not NULL, the probabilities of every category are stored there too.
+static int get_best_codecs(
+  interpreter_t *interpreter,
+  const float *inputs,
+  int nrows,
+  const metadata_t *metadata,
+  int *best,
+  float *probs
 ) {
-  // Fill input tensor
-  float* input = interpreter->typed_input_tensor<float>(0);
-  *input = cratio;
-  *(input + 1) = cspeed;
-  *(input + 2) = tradeoff;
+  int ncategories = metadata->ncategories;
+  float *outputs = (float *)malloc(nrows * ncategories * sizeof(float));
+
+#if defined(BTUNE_USE_TFLITE)
+  // Resize the input tensor to the batch size if needed
+  TfLiteTensor *input_tensor = interpreter->input_tensor(0);
+  if (input_tensor->dims->size != 2 || input_tensor->dims->data[1] != metadata->schema.ninputs) {
+    fprintf(stderr, "Error: the model does not match its metadata\n");
+    free(outputs);
+    return -1;
+  }
+  if (input_tensor->dims->data[0] != nrows) {
+    int input_index = interpreter->inputs()[0];
+    if (interpreter->ResizeInputTensor(input_index, {nrows, metadata->schema.ninputs}) != kTfLiteOk ||
+        interpreter->AllocateTensors() != kTfLiteOk) {
+      fprintf(stderr, "Error: Failed to resize input tensor to %d rows\n", nrows);
+      free(outputs);
+      return -1;
+    }
+    input_tensor = interpreter->input_tensor(0);
+  }
+
+  // Fill input tensor, quantizing the inputs for int8 models
+  if (input_tensor->type == kTfLiteInt8) {
+    quant_t quant = tensor_quant(input_tensor, &metadata->input_quant);
+    if (quant.scale == 0) {
+      fprintf(stderr, "Error: no quantization parameters for the model input\n");
+      free(outputs);
+      return -1;
+    }
+    int8_t *input = input_tensor->data.int8;
+    for (int i = 0; i < nrows * metadata->schema.ninputs; i++) {
+      float value = roundf(inputs[i] / quant.scale) + (float)quant.zero_point;
+      input[i] = (int8_t)((value < -128) ? -128 : (value > 127) ? 127 : value);
+    }
+  }
+  else {
+    float* input = interpreter->typed_input_tensor<float>(0);
+    memcpy(input, inputs, nrows * metadata->schema.ninputs * sizeof(float));
+  }
 
   // Run inference
   if (interpreter->Invoke() != kTfLiteOk) {
     fprintf(stderr, "Error: interpreter invocation failed\n");
+    free(outputs);
     return -1;
   }
 
   //printf("\n\n=== Post-invoke Interpreter State ===\n");
   //tflite::PrintInterpreterState(interpreter);
 
-  // Read output buffers
+  // Read output buffers, dequantizing the outputs of int8 models
   // Note: The buffer of the output tensor with index `i` of type T can
   // be accessed with `T* output = interpreter->typed_output_tensor<T>(i);`
-  float* output = interpreter->typed_output_tensor<float>(0);
+  TfLiteTensor *output_tensor = interpreter->output_tensor(0);
+  if (output_tensor->type == kTfLiteInt8) {
+    quant_t quant = tensor_quant(output_tensor, &metadata->output_quant);
+    const int8_t *output = output_tensor->data.int8;
+    for (int i = 0; i < nrows * ncategories; i++) {
+      outputs[i] = (float)(output[i] - quant.zero_point) * quant.scale;
+    }
+  }
+  else {
+    memcpy(outputs, interpreter->typed_output_tensor<float>(0), nrows * ncategories * sizeof(float));
+  }
+#else
+  if (interpreter->mlp->ninputs != metadata->schema.ninputs || interpreter->mlp->noutputs != ncategories) {
+    fprintf(stderr, "Error: the model does not match its metadata\n");
+    free(outputs);
+    return -1;
+  }
+  btune_mlp_predict(interpreter, inputs, nrows, outputs);
+#endif
 
-  int best = 0;
-  float max = -1;
-  for (int i = 0; i < ncategories; i++) {
-    float value = *output;
-    output++;
-    if (value > max) {
-      max = value;
-      best = i;
+  const float *output = outputs;
+  for (int row = 0; row < nrows; row++) {
+    best[row] = 0;
+    float max = -1;
+    for (int i = 0; i < ncategories; i++) {
+      float value = *output;
+      output++;
+      if (value > max) {
+        max = value;
+        best[row] = i;
+      }
     }
   }
+  if (probs != NULL) {
+    memcpy(probs, outputs, nrows * ncategories * sizeof(float));
+  }
+  free(outputs);
 
-  return best;
+  return 0;
 }
 
 static float normalize(float value, float mean, float std) {
@@ -86,109 +194,225 @@ static float normalize(float value, float mean, float std) {
   return value;
 }
 
+// Account for the features of a chunk, and adapt the normalization of the training set
+// (in norms) to the chunks seen.  Both are blended as a mixture of distributions, with
+// the training set weighing as norm_prior chunks.
+static void recalibrate(btune_struct *btune, const float *values, norm_t *norms) {
+  int prior = btune->config.norm_prior;
+  if (prior < 0) {
+    return;
+  }
+  pthread_mutex_lock(&btune->model_lock);
+  for (int i = 0; i < BTUNE_NFEATURES; i++) {
+    btune_running_stats *stats = &btune->feature_stats[i];
+    btune_running_stats_add(stats, values[i]);
+    if (stats->n < 2) {
+      continue;
+    }
+    double w = stats->n / (stats->n + prior);
+    double train_var = (double)norms[i].std * norms[i].std;
+    double var = stats->m2 / (stats->n - 1);
+    double delta = stats->mean - norms[i].mean;
+    double mean = w * stats->mean + (1 - w) * norms[i].mean;
+    var = w * var + (1 - w) * train_var + w * (1 - w) * delta * delta;
+    if (var > 0) {
+      norms[i].mean = (float)mean;
+      norms[i].std = (float)sqrt(var);
+    }
+  }
+  pthread_mutex_unlock(&btune->model_lock);
+}
+
+// Blocksize used to probe chunks of super-chunks with an automatic blocksize
+// (the one blosc2 picks for the probe codec with the default clevel, 4 * L1)
+#define PROBE_BLOCKSIZE (128 * 1024)
+// Number of probed blocks that fit on the stack
+#define PROBE_STACK_BLOCKS 256
 
-static int get_best_codec_for_chunk(
+// Run the entropy probe on a chunk, and get its cratio and speed relative to zeros.
+// If filter_cratios is not NULL, the cratio after every filter is estimated too.
+static int probe_chunk(
   blosc2_schunk *schunk,
   const void *src,
   size_t size,
-  tflite::Interpreter *interpreter,
-  metadata_t *metadata
+  float *cratio_out,
+  float *rel_speed_out,
+  float *filter_cratios
 ) {
-  char * trace = getenv("BTUNE_TRACE");
-  blosc_timestamp_t t0, t1, t2;
-  if (trace) {
-    blosc_set_timestamp(&t0);
-  }
   if (size < BLOSC_MIN_BUFFERSIZE) {
     printf("WARNING: Chunk size too small for performing inference, it must be at least %d\n", BLOSC_MIN_BUFFERSIZE);
     return -1;
   }
 
   btune_struct *btune = (btune_struct *)schunk->storage->cparams->tuner_params;
-  // <<< ENTROPY PROBER START
-  // cparams
-  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
-  cparams.compcode = ENTROPY_PROBE_ID;
-  cparams.instr_codec = true;  // instrumented (cratio/cspeed)
-  cparams.typesize = schunk->typesize;
-  cparams.blocksize = schunk->blocksize;
-  cparams.splitmode = BLOSC_NEVER_SPLIT;
-  cparams.nthreads = 4;
-  cparams.filters[BLOSC2_MAX_FILTERS - 1] = BLOSC_NOFILTER;
-  blosc2_context *cctx = blosc2_create_cctx(cparams);
-
-  // dparams
-  blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
-  blosc2_context *dctx = blosc2_create_dctx(dparams);
-  if (btune->zeros_speed < 0.) {
-    // Compress zeros chunk to get a machine relative speed measure
-    btune->zeros_speed = get_zeros_speed(size);
-    if (btune->zeros_speed < 0.) {
-        fprintf(stderr, "Error %d computing zeros speed\n", (int)btune->zeros_speed);
-        return btune->zeros_speed;
-    }
-  }
-
-  // Compress chunk, this will output the instrumentation data
-  // `compressed_size` should be
-  // BLOSC2_MAX_OVERHEAD + sizeof(blosc2_instr) * nblocks + sizeof(int32_t) * nblocks + sizeof(int32_t)
-  // but we won't always know nblocks before compression
-  int compressed_size = BLOSC2_MAX_OVERHEAD + size;
-  uint8_t *cdata = (uint8_t *) malloc(compressed_size);
-  int csize = blosc2_compress_ctx(cctx, src, size, cdata, compressed_size);
-  if (csize < 0) {
-    free(cdata);
-    fprintf(stderr, "Error %d compressing chunk\n", csize);
-    return csize;
-  }
-  if (csize == 0) {
-    csize = compressed_size;
-  }
-  // Decompress so we can read the instrumentation data
-  int decomp_size = cctx->nblocks * sizeof(blosc2_instr);
-  uint8_t *ddata = (uint8_t *) malloc(decomp_size);
-  int dsize = blosc2_decompress_ctx(dctx, cdata, csize, ddata, decomp_size);
-  blosc2_free_ctx(cctx);
-  blosc2_free_ctx(dctx);
-  free(cdata);
-  BLOSC_ERROR(dsize);
-  // >>> ENTROPY PROBER END
-  if (trace) {
-    blosc_set_timestamp(&t1);
+  int32_t blocksize = (schunk->blocksize > 0) ? schunk->blocksize : PROBE_BLOCKSIZE;
+  int nblocks = (int)((size + blocksize - 1) / blocksize);
+  entropy_probe_block stack_blocks[PROBE_STACK_BLOCKS];
+  entropy_probe_block *blocks = stack_blocks;
+  if (nblocks > PROBE_STACK_BLOCKS) {
+    blocks = (entropy_probe_block *) malloc(nblocks * sizeof(entropy_probe_block));
+  }
+  entropy_probe_sampling sampling;
+  sampling.nwindows = btune->config.probe_windows;
+  sampling.window_size = btune->config.probe_window_size;
+  sampling.random = btune->config.probe_sampling == BTUNE_PROBE_RANDOM;
+  sampling.typesize = (filter_cratios != NULL) ? schunk->typesize : 0;
+  int rc = entropy_probe_blocks((const uint8_t *)src, (int32_t)size, blocksize, &sampling, blocks);
+  if (rc < 0) {
+    if (blocks != stack_blocks) {
+      free(blocks);
+    }
+    fprintf(stderr, "Error %d probing chunk\n", rc);
+    return rc;
   }
 
-  // <<< INFERENCE START
-  float cratio_mean = metadata->cratio.mean;
-  float cratio_std = metadata->cratio.std;
-  float cspeed_mean = metadata->cspeed.mean;
-  float cspeed_std = metadata->cspeed.std;
-
-
-  // Read the cratio/cspeed for every block and compute mean
-  int nblocks = dsize / (int)sizeof(blosc2_instr);
-  blosc2_instr *instr_data = (blosc2_instr *)ddata;
-
+  // Compute the mean cratio/cspeed of the blocks
+  float zeros_speed;
+  __atomic_load(&btune->zeros_speed, &zeros_speed, __ATOMIC_ACQUIRE);
   float cratio = 0;
   float rel_speed = 0;
-  bool special_val = instr_data->flags[0];
+  float filter_sums[ENTROPY_PROBE_NFILTERS] = {0};
   for (int i = 0; i < nblocks; i++) {
-    if (!special_val) {
-      cratio += instr_data->cratio;
-      float ctime = 1.f / instr_data->cspeed;
-      float ftime = 1.f / instr_data->filter_speed;
-      rel_speed += 1.f / (ctime + ftime) / btune->zeros_speed;
+    if (!blocks[i].special) {
+      cratio += blocks[i].cratio;
+      rel_speed += blocks[i].cspeed / zeros_speed;
+      for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+        filter_sums[f] += blocks[i].filter_cratio[f];
+      }
     }
-    instr_data++;
-    special_val = instr_data->flags[0];
   }
   cratio /= nblocks;
   rel_speed /= nblocks;
+  if (filter_cratios != NULL) {
+    for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+      filter_cratios[f] = filter_sums[f] / nblocks;
+    }
+  }
+  if (blocks != stack_blocks) {
+    free(blocks);
+  }
+
+  *cratio_out = cratio;
+  *rel_speed_out = rel_speed;
+  return 0;
+}
+
+// Run the entropy probe on a chunk and fill the (normalized) model inputs
+static int get_chunk_features(
+  blosc2_schunk *schunk,
+  const void *src,
+  size_t size,
+  metadata_t *metadata,
+  float *features
+) {
+  btune_struct *btune = (btune_struct *)schunk->storage->cparams->tuner_params;
+  float cratio, rel_speed;
+  float filter_cratios[ENTROPY_PROBE_NFILTERS];
+  int rc = probe_chunk(schunk, src, size, &cratio, &rel_speed,
+                       metadata->schema.filter_probe ? filter_cratios : NULL);
+  if (rc < 0) {
+    return rc;
+  }
+
   // Normalize
-  float cratio_norm = normalize(cratio, cratio_mean, cratio_std);
-  float cspeed_norm = normalize(rel_speed, cspeed_mean, cspeed_std);
-  // Run inference
-  int best = get_best_codec(interpreter, cratio_norm, cspeed_norm, btune->config.tradeoff, metadata->ncategories);
-  free(ddata);
+  norm_t norms[BTUNE_NFEATURES] = {metadata->cratio, metadata->cspeed};
+  float values[BTUNE_NFEATURES] = {cratio, rel_speed};
+  recalibrate(btune, values, norms);
+
+  btune_byte_stats stats = {};
+  if (metadata->schema.byte_stats) {
+    btune_byte_stats_compute((const uint8_t *)src, (int32_t)size, schunk->typesize,
+                             BYTE_STATS_SAMPLE, &stats);
+  }
+  float codec_cratios[ENTROPY_PROBE_NCODECS] = {};
+  if (metadata->schema.codec_probe) {
+    entropy_probe_codecs((const uint8_t *)src, (int32_t)size, CODEC_PROBE_SAMPLE, codec_cratios);
+  }
+
+  // Fill the inputs in the order declared by the model
+  for (int i = 0; i < metadata->schema.ninputs; i++) {
+    float value;
+    switch (metadata->schema.inputs[i]) {
+      case BTUNE_INPUT_CRATIO:
+        features[i] = normalize(cratio, norms[BTUNE_FEATURE_CRATIO].mean, norms[BTUNE_FEATURE_CRATIO].std);
+        continue;
+      case BTUNE_INPUT_SPEED:
+        features[i] = normalize(rel_speed, norms[BTUNE_FEATURE_SPEED].mean, norms[BTUNE_FEATURE_SPEED].std);
+        continue;
+      case BTUNE_INPUT_TRADEOFF:
+        features[i] = btune->config.tradeoff;
+        continue;
+      case BTUNE_INPUT_ENTROPY:
+        value = stats.entropy;
+        break;
+      case BTUNE_INPUT_PLANE_ENTROPY:
+        value = stats.plane_entropy;
+        break;
+      case BTUNE_INPUT_ZEROS:
+        value = stats.zeros;
+        break;
+      case BTUNE_INPUT_RUNS:
+        value = stats.runs;
+        break;
+      case BTUNE_INPUT_DELTA_ENTROPY:
+        value = stats.delta_entropy;
+        break;
+      case BTUNE_INPUT_EXPONENT_SPREAD:
+        value = stats.exponent_spread;
+        break;
+      case BTUNE_INPUT_SHUFFLE_CRATIO:
+        value = filter_cratios[ENTROPY_PROBE_SHUFFLE];
+        break;
+      case BTUNE_INPUT_BITSHUFFLE_CRATIO:
+        value = filter_cratios[ENTROPY_PROBE_BITSHUFFLE];
+        break;
+      case BTUNE_INPUT_BYTEDELTA_CRATIO:
+        value = filter_cratios[ENTROPY_PROBE_BYTEDELTA];
+        break;
+      case BTUNE_INPUT_LZ4_CRATIO:
+        value = codec_cratios[ENTROPY_PROBE_LZ4];
+        break;
+      case BTUNE_INPUT_ZLIB_CRATIO:
+        value = codec_cratios[ENTROPY_PROBE_ZLIB];
+        break;
+      default:
+        value = codec_cratios[ENTROPY_PROBE_ZSTD];
+        break;
+    }
+    features[i] = normalize(value, metadata->schema.norms[i].mean, metadata->schema.norms[i].std);
+  }
+
+  return 0;
+}
+
+static int get_best_codec_for_chunk(
+  blosc2_schunk *schunk,
+  const void *src,
+  size_t size,
+  interpreter_t *interpreter,
+  metadata_t *metadata,
+  float *probs
+) {
+  char * trace = getenv("BTUNE_TRACE");
+  blosc_timestamp_t t0, t1, t2;
+  if (trace) {
+    blosc_set_timestamp(&t0);
+  }
+  float features[BTUNE_MAX_INPUTS];
+  int rc = get_chunk_features(schunk, src, size, metadata, features);
+  if (rc < 0) {
+    return rc;
+  }
+  if (trace) {
+    blosc_set_timestamp(&t1);
+  }
+
+  // <<< INFERENCE START
+  int best;
+  rc = get_best_codecs(interpreter, features, 1, metadata, &best, probs);
+  if (rc < 0) {
+    return rc;
+  }
   // >>> INFERENCE END
   if (trace) {
     blosc_set_timestamp(&t2);
@@ -219,6 +443,25 @@ static int read_dict(json_value *json, norm_t *norm) {
   return 0;
 }
 
+static double json_number(json_value *value) {
+  return (value->type == json_integer) ? (double)value->u.integer : value->u.dbl;
+}
+
+static int read_quant(json_value *json, quant_t *quant) {
+  for (int i = 0; i < json->u.object.length; i++) {
+    const char *name = json->u.object.values[i].name;
+    json_value *value = json->u.object.values[i].value;
+    if (strcmp(name, "scale") == 0) {
+      quant->scale = json_number(value);
+    }
+    else if (strcmp(name, "zero_point") == 0) {
+      quant->zero_point = (int32_t)json_number(value);
+    }
+  }
+
+  return 0;
+}
+
 static int read_metadata(const char *fname, metadata_t *metadata) {
   FILE* file = fopen(fname, "rt");
   if (file == NULL) {
@@ -233,6 +476,9 @@ static int read_metadata(const char *fname, metadata_t *metadata) {
   buffer[size] = 0;
   json_value *json = json_parse(buffer, size);
 
+  btune_input_schema_default(&metadata->schema);
+  int rc = 0;
+
   for (int i = 0; i < json->u.object.length; i++) {
     const char *name = json->u.object.values[i].name;
     json_value *value = json->u.object.values[i].value;
@@ -242,6 +488,22 @@ static int read_metadata(const char *fname, metadata_t *metadata) {
     else if (strcmp(name, "speed") == 0) {
       read_dict(value, &metadata->cspeed);
     }
+    else if (strcmp(name, "inputs") == 0) {
+      rc = btune_input_schema_read(value, &metadata->schema);
+    }
+    else if (strcmp(name, "quantization") == 0) {
+      // Quantization parameters of int8 models, in case the model does not carry them
+      for (int j = 0; j < value->u.object.length; j++) {
+        const char *qname = value->u.object.values[j].name;
+        json_value *qvalue = value->u.object.values[j].value;
+        if (strcmp(qname, "input") == 0) {
+          read_quant(qvalue, &metadata->input_quant);
+        }
+        else if (strcmp(qname, "output") == 0) {
+          read_quant(qvalue, &metadata->output_quant);
+        }
+      }
+    }
     else if (strcmp(name, "categories") == 0) {
       metadata->ncategories = value->u.array.length;
       metadata->categories = (category_t*)calloc(value->u.array.length, sizeof(category_t));
@@ -261,6 +523,10 @@ static int read_metadata(const char *fname, metadata_t *metadata) {
 
   free(buffer);
   fclose(file);
+  if (rc < 0) {
+    free(metadata->categories);
+    return -2;
+  }
   return 0;
 }
 
@@ -275,33 +541,43 @@ static char * concat_path(const char * dirname, const char * fname) {
   return dest;
 }
 
-static void * load_metadata(btune_config * config, const char * dirname) {
+static metadata_t * load_metadata(const char * dirname, bool decomp) {
   char * metadata_fname = concat_path(
     dirname,
-    config->perf_mode == BTUNE_PERF_DECOMP ? "model_decomp.json" : "model_comp.json"
+    decomp ? "model_decomp.json" : "model_comp.json"
   );
 
   // Read metadata
-  metadata_t * metadata = (metadata_t*)malloc(sizeof(metadata_t));
+  metadata_t * metadata = (metadata_t*)calloc(1, sizeof(metadata_t));
   int error = read_metadata(metadata_fname, metadata);
   if (error) {
-    printf("WARNING: Metadata file not found in %s\n", metadata_fname);
+    if (error == -1) {
+      printf("WARNING: Metadata file not found in %s\n", metadata_fname);
+    }
+    else {
+      printf("WARNING: Unusable model metadata in %s\n", metadata_fname);
+    }
     free(metadata_fname);
+    free(metadata);
     return NULL;
   }
   free(metadata_fname);
-  return (void *)metadata;
+  return metadata;
 }
 
-static void * load_model(btune_config * config, const char * dirname) {
+static model_t * load_model(const char * dirname, bool decomp) {
   char * model_fname = concat_path(
     dirname,
-    config->perf_mode == BTUNE_PERF_DECOMP ? "model_decomp.tflite" : "model_comp.tflite"
+    decomp ? "model_decomp.tflite" : "model_comp.tflite"
   );
 
   // Load model
-  std::unique_ptr<tflite::FlatBufferModel> model = tflite::FlatBufferModel::BuildFromFile(model_fname);
-  if (model == nullptr) {
+#if defined(BTUNE_USE_TFLITE)
+  model_t *model = tflite::FlatBufferModel::BuildFromFile(model_fname).release();
+#else
+  model_t *model = btune_mlp_load(model_fname);
+#endif
+  if (model == NULL) {
     printf("WARNING: Model files not found in %s\n", model_fname);
     free(model_fname);
     return NULL;
@@ -309,13 +585,26 @@ static void * load_model(btune_config * config, const char * dirname) {
   free(model_fname);
   printf("INFO: Model files found in the '%s' directory\n", dirname);
 
+  return model;
+}
+
+static void free_model(model_t * model) {
+#if defined(BTUNE_USE_TFLITE)
+  delete model;
+#else
+  btune_mlp_free(model);
+#endif
+}
+
+static interpreter_t * build_interpreter(model_t * model) {
+#if defined(BTUNE_USE_TFLITE)
   // Build the interpreter with the InterpreterBuilder.
   // Note: all Interpreters should be built with the InterpreterBuilder,
   // which allocates memory for the Interpreter and does various set up
   // tasks so that the Interpreter can read the provided model.
   tflite::ops::builtin::BuiltinOpResolver resolver;
   tflite::InterpreterBuilder builder(*model, resolver);
-  std::unique_ptr<tflite::Interpreter> interpreter;
+  std::unique_ptr<interpreter_t> interpreter;
   builder(&interpreter);
   if (interpreter == nullptr) {
     fprintf(stderr, "Error: Failed to build interpreter\n");
@@ -330,17 +619,196 @@ static void * load_model(btune_config * config, const char * dirname) {
   //printf("=== Pre-invoke Interpreter State ===\n");
   //tflite::PrintInterpreterState(interpreter.get());
 
-  return (void*)interpreter.release();
+  return interpreter.release();
+#else
+  return btune_mlp_workspace_new(model);
+#endif
 }
 
-void btune_model_init(blosc2_context * ctx) {
-  // Trace time
-  bool trace = getenv("BTUNE_TRACE");
+static void free_interpreter(interpreter_t * interpreter) {
+#if defined(BTUNE_USE_TFLITE)
+  delete interpreter;
+#else
+  btune_mlp_workspace_free(interpreter);
+#endif
+}
+
+// Process-wide model runtime.  Models are loaded once per directory and perf mode,
+// and kept for the life of the process.  The metadata is shared read-only, and
+// every thread running inference borrows an interpreter from the pool.
+typedef struct model_runtime_s {
+  char *dirname;
+  // The models directory
+  bool decomp;
+  // Whether this is the decompression model
+  model_t *model;
+  // The model, shared by all the interpreters
+  metadata_t *metadata;
+  // The model metadata (read-only)
+  interpreter_t **idle;
+  // The pool of idle interpreters
+  int nidle;
+  // Number of idle interpreters
+  int idle_capacity;
+  // Number of interpreters that fit in the pool
+  int ninterpreters;
+  // Number of interpreters built (idle or in use)
+  int refcount;
+  // Number of tuners using the runtime
+  pthread_mutex_t lock;
+  // Protects the pool and the refcount
+  struct model_runtime_s *next;
+} model_runtime_t;
+
+static model_runtime_t *model_runtimes = NULL;
+static pthread_mutex_t model_runtimes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Get the runtime for the model in dirname, loading it if needed
+static model_runtime_t * model_runtime_acquire(const char * dirname, bool decomp) {
+  pthread_mutex_lock(&model_runtimes_lock);
+  model_runtime_t *runtime;
+  for (runtime = model_runtimes; runtime != NULL; runtime = runtime->next) {
+    if (runtime->decomp == decomp && strcmp(runtime->dirname, dirname) == 0) {
+      break;
+    }
+  }
+  if (runtime == NULL) {
+    model_t *model = load_model(dirname, decomp);
+    metadata_t *metadata = load_metadata(dirname, decomp);
+    if (model == NULL || metadata == NULL) {
+      free_model(model);
+      if (metadata != NULL) {
+        free(metadata->categories);
+        free(metadata);
+      }
+      pthread_mutex_unlock(&model_runtimes_lock);
+      return NULL;
+    }
+    runtime = (model_runtime_t *)calloc(1, sizeof(model_runtime_t));
+    runtime->dirname = strdup(dirname);
+    runtime->decomp = decomp;
+    runtime->model = model;
+    runtime->metadata = metadata;
+    pthread_mutex_init(&runtime->lock, NULL);
+    runtime->next = model_runtimes;
+    model_runtimes = runtime;
+  }
+  pthread_mutex_lock(&runtime->lock);
+  runtime->refcount++;
+  pthread_mutex_unlock(&runtime->lock);
+  pthread_mutex_unlock(&model_runtimes_lock);
+  return runtime;
+}
+
+static void model_runtime_release(model_runtime_t * runtime) {
+  pthread_mutex_lock(&runtime->lock);
+  runtime->refcount--;
+  if (runtime->refcount == 0) {
+    // Keep the model loaded for next tuners, but give back the extra interpreters
+    while (runtime->nidle > 1) {
+      runtime->nidle--;
+      free_interpreter(runtime->idle[runtime->nidle]);
+      runtime->ninterpreters--;
+    }
+  }
+  pthread_mutex_unlock(&runtime->lock);
+}
+
+// Borrow an interpreter for the exclusive use of the calling thread
+static interpreter_t * interpreter_acquire(model_runtime_t * runtime) {
+  pthread_mutex_lock(&runtime->lock);
+  if (runtime->nidle > 0) {
+    runtime->nidle--;
+    interpreter_t *interpreter = runtime->idle[runtime->nidle];
+    pthread_mutex_unlock(&runtime->lock);
+    return interpreter;
+  }
+  // Make room in the pool for the new interpreter, so that releasing it never allocates
+  if (runtime->ninterpreters == runtime->idle_capacity) {
+    int capacity = (runtime->idle_capacity > 0) ? runtime->idle_capacity * 2 : 4;
+    interpreter_t **idle = (interpreter_t **)realloc(runtime->idle, capacity * sizeof(interpreter_t *));
+    if (idle == NULL) {
+      pthread_mutex_unlock(&runtime->lock);
+      fprintf(stderr, "Error allocating the interpreter pool\n");
+      return NULL;
+    }
+    runtime->idle = idle;
+    runtime->idle_capacity = capacity;
+  }
+  runtime->ninterpreters++;
+  pthread_mutex_unlock(&runtime->lock);
+
+  interpreter_t *interpreter = build_interpreter(runtime->model);
+  if (interpreter == NULL) {
+    pthread_mutex_lock(&runtime->lock);
+    runtime->ninterpreters--;
+    pthread_mutex_unlock(&runtime->lock);
+  }
+  return interpreter;
+}
+
+static void interpreter_release(model_runtime_t * runtime, interpreter_t * interpreter) {
+  pthread_mutex_lock(&runtime->lock);
+  // The pool can hold every interpreter built (see interpreter_acquire)
+  runtime->idle[runtime->nidle] = interpreter;
+  runtime->nidle++;
+  pthread_mutex_unlock(&runtime->lock);
+}
+
+// Load the model of the tuner and publish it
+static void model_load(btune_struct * btune_params) {
   blosc_timestamp_t t0, t1;
-  if (trace) {
-    blosc_set_timestamp(&t0);
+  blosc_set_timestamp(&t0);
+
+  btune_config *config = &btune_params->config;
+  model_runtime_t *runtime = model_runtime_acquire(btune_params->model_dir,
+                                                   config->perf_mode == BTUNE_PERF_DECOMP);
+  int status = BTUNE_MODEL_FAILED;
+  if (runtime != NULL) {
+    btune_params->runtime = runtime;
+    btune_params->metadata = runtime->metadata;
+    int ncategories = runtime->metadata->ncategories;
+    btune_params->category_weight = (float *)calloc(ncategories, sizeof(float));
+    btune_params->category_mass = (float *)calloc(ncategories, sizeof(float));
+    btune_params->category_score = (double *)calloc(ncategories, sizeof(double));
+    status = BTUNE_MODEL_READY;
+  }
+
+  blosc_set_timestamp(&t1);
+  btune_params->model_load_time = blosc_elapsed_secs(t0, t1);
+  BTUNE_TRACE("time load model: %f", (float) btune_params->model_load_time);
+  BTUNE_TRACE("Entropy probe, %s kernels", entropy_probe_kernel_name());
+#if !defined(BTUNE_USE_TFLITE)
+  BTUNE_TRACE("Built-in inference engine, %s kernels", btune_mlp_kernel_name());
+#endif
+  // Publish the runtime to the threads doing inference
+  __atomic_store_n(&btune_params->model_status, status, __ATOMIC_RELEASE);
+}
+
+static void * model_load_thread(void * arg) {
+  model_load((btune_struct *) arg);
+  return NULL;
+}
+
+static btune_load_mode get_load_mode(btune_config * config) {
+  const char *envvar = getenv("BTUNE_MODEL_LOAD");
+  if (envvar == NULL) {
+    return config->model_load;
   }
+  if (strcmp(envvar, "BACKGROUND") == 0) {
+    return BTUNE_LOAD_BACKGROUND;
+  }
+  if (strcmp(envvar, "LAZY") == 0) {
+    return BTUNE_LOAD_LAZY;
+  }
+  if (strcmp(envvar, "EAGER") == 0) {
+    return BTUNE_LOAD_EAGER;
+  }
+  BTUNE_TRACE("Unsupported %s model load mode, default to BACKGROUND", envvar);
+  return BTUNE_LOAD_BACKGROUND;
+}
 
+void btune_model_init(blosc2_context * ctx) {
   // Read BTUNE_USE_INFERENCE
   btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
   const char *inference = getenv("BTUNE_USE_INFERENCE");
@@ -353,6 +821,48 @@ void btune_model_init(blosc2_context * ctx) {
     btune_params->inference_count = config->use_inference;
   }
 
+  // The probe is also used without a model (e.g. by the LinUCB policy)
+  const char *windows = getenv("BTUNE_PROBE_WINDOWS");
+  if (windows != NULL) {
+    config->probe_windows = atoi(windows);
+  }
+  const char *window_size = getenv("BTUNE_PROBE_WINDOW_SIZE");
+  if (window_size != NULL) {
+    config->probe_window_size = atoi(window_size);
+  }
+  const char *sampling = getenv("BTUNE_PROBE_SAMPLING");
+  if (sampling != NULL) {
+    if (strcmp(sampling, "EVEN") == 0) {
+      config->probe_sampling = BTUNE_PROBE_EVEN;
+    } else if (strcmp(sampling, "RANDOM") == 0) {
+      config->probe_sampling = BTUNE_PROBE_RANDOM;
+    } else {
+      BTUNE_TRACE("Unsupported %s probe sampling, default to EVEN", sampling);
+      config->probe_sampling = BTUNE_PROBE_EVEN;
+    }
+  }
+  if (config->probe_windows < 1) {
+    BTUNE_TRACE("probe_windows must be at least 1, using 1");
+    config->probe_windows = 1;
+  }
+  if (config->probe_window_size < 16 || config->probe_window_size > ENTROPY_PROBE_MAX_WINDOW) {
+    BTUNE_TRACE("probe_window_size must be between 16 and %d, using %d",
+                ENTROPY_PROBE_MAX_WINDOW, ENTROPY_PROBE_MAX_WINDOW);
+    config->probe_window_size = ENTROPY_PROBE_MAX_WINDOW;
+  }
+  const char *probe_filters = getenv("BTUNE_PROBE_FILTERS");
+  if (probe_filters != NULL) {
+    config->probe_filters = atoi(probe_filters) != 0;
+  }
+  const char *probe_codecs = getenv("BTUNE_PROBE_CODECS");
+  if (probe_codecs != NULL) {
+    config->probe_codecs = atoi(probe_codecs) != 0;
+  }
+  const char *calibration_file = getenv("BTUNE_CALIBRATION_FILE");
+  if (calibration_file != NULL) {
+    config->calibration_file = calibration_file;
+  }
+
   // Load model and metadata
   const char * dirname = getenv("BTUNE_MODELS_DIR");
   if (dirname == NULL) {
@@ -365,19 +875,321 @@ void btune_model_init(blosc2_context * ctx) {
     }
   }
   config->models_dir = dirname;
-  btune_params->interpreter = load_model(config, dirname);
-  btune_params->metadata = load_metadata(config, dirname);
-
-  if (btune_params->interpreter == NULL || btune_params->metadata == NULL) {
-    btune_params->inference_count = 0;
+  const char *pipeline = getenv("BTUNE_PIPELINE");
+  if (pipeline != NULL) {
+    config->pipeline_inference = atoi(pipeline) != 0;
+  }
+  const char *topk = getenv("BTUNE_TOPK");
+  if (topk != NULL) {
+    config->topk = atoi(topk);
+  }
+  const char *topk_mass = getenv("BTUNE_TOPK_MASS");
+  if (topk_mass != NULL) {
+    config->topk_mass = (float) atof(topk_mass);
+  }
+  if (config->topk < 1 || config->topk > BTUNE_MAX_CHOICES) {
+    BTUNE_TRACE("topk must be between 1 and %d, using 1", BTUNE_MAX_CHOICES);
+    config->topk = 1;
+  }
+  const char *schedule = getenv("BTUNE_INFERENCE_SCHEDULE");
+  if (schedule != NULL) {
+    if (strcmp(schedule, "ALWAYS") == 0) {
+      config->inference_schedule = BTUNE_INFER_ALWAYS;
+    } else if (strcmp(schedule, "PERIODIC") == 0) {
+      config->inference_schedule = BTUNE_INFER_PERIODIC;
+    } else if (strcmp(schedule, "BACKOFF") == 0) {
+      config->inference_schedule = BTUNE_INFER_BACKOFF;
+    } else if (strcmp(schedule, "ADAPTIVE") == 0) {
+      config->inference_schedule = BTUNE_INFER_ADAPTIVE;
+    } else {
+      BTUNE_TRACE("Unsupported %s inference schedule, default to ALWAYS", schedule);
+      config->inference_schedule = BTUNE_INFER_ALWAYS;
+    }
+  }
+  const char *period = getenv("BTUNE_INFERENCE_PERIOD");
+  if (period != NULL) {
+    config->inference_period = atoi(period);
+  }
+  if (config->inference_period < 1) {
+    BTUNE_TRACE("inference_period must be at least 1, using 1");
+    config->inference_period = 1;
+  }
+  const char *margin = getenv("BTUNE_INFERENCE_MARGIN");
+  if (margin != NULL) {
+    config->inference_margin = (float) atof(margin);
+  }
+  btune_params->inferred_category = -1;
+  const char *norm_prior = getenv("BTUNE_NORM_PRIOR");
+  if (norm_prior != NULL) {
+    config->norm_prior = atoi(norm_prior);
+  }
+  const char *state_file = getenv("BTUNE_STATE_FILE");
+  if (state_file != NULL) {
+    config->state_file = state_file;
+  }
+  if (config->state_file != NULL && config->norm_prior >= 0) {
+    if (btune_state_load(btune_params, config->state_file) == 0) {
+      BTUNE_TRACE("Feature statistics loaded from %s (%g chunks)", config->state_file,
+                  btune_params->feature_stats[BTUNE_FEATURE_CRATIO].n);
+    }
+  }
+  if (btune_params->inference_count == 0) {
+    // Inference is disabled, do not even load the model
     return;
   }
+  btune_params->model_dir = strdup(dirname);
 
-  // Trace time
-  if (trace) {
-    blosc_set_timestamp(&t1);
-    printf("TRACE: time load model: %f\n", (float) blosc_elapsed_secs(t0, t1));
+  switch (get_load_mode(config)) {
+    case BTUNE_LOAD_EAGER:
+      model_load(btune_params);
+      break;
+    case BTUNE_LOAD_LAZY:
+      btune_params->model_status = BTUNE_MODEL_DEFERRED;
+      break;
+    case BTUNE_LOAD_BACKGROUND:
+      btune_params->model_status = BTUNE_MODEL_LOADING;
+      if (pthread_create(&btune_params->model_thread, NULL, model_load_thread, btune_params) == 0) {
+        btune_params->model_thread_started = true;
+      } else {
+        model_load(btune_params);
+      }
+      break;
+  }
+}
+
+// Make sure the model is loaded or being loaded, and return its status
+static int model_status(btune_struct * btune_params) {
+  int status = __atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE);
+  if (status == BTUNE_MODEL_DEFERRED) {
+    pthread_mutex_lock(&btune_params->model_lock);
+    // Another thread may have loaded it meanwhile
+    if (__atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE) == BTUNE_MODEL_DEFERRED) {
+      model_load(btune_params);
+    }
+    pthread_mutex_unlock(&btune_params->model_lock);
+    status = __atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE);
+  }
+  return status;
+}
+
+// Make sure the zeros speed, needed for the speed feature, is known
+// Several chunks may race to set it, it is accessed atomically.
+static int ensure_zeros_speed(btune_struct * btune_params, int32_t size) {
+  float zeros_speed;
+  __atomic_load(&btune_params->zeros_speed, &zeros_speed, __ATOMIC_ACQUIRE);
+  if (zeros_speed < 0. && size >= BLOSC_MIN_BUFFERSIZE) {
+    // The speed of compressing zeros is the machine relative speed measure
+    btune_calibration calib;
+    int rc = btune_calibration_get(size, btune_params->config.calibration_file, &calib);
+    if (rc < 0) {
+      fprintf(stderr, "Error %d computing zeros speed\n", rc);
+      return rc;
+    }
+    BTUNE_TRACE("Calibration for %d bytes: memcpy %.2f GB/s, zeros %.2f GB/s, probe %.2f GB/s",
+                size, calib.memcpy_speed / 1e9, calib.zeros_speed / 1e9, calib.probe_speed / 1e9);
+    __atomic_store(&btune_params->zeros_speed, &calib.zeros_speed, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+// Weight of the previous chunks when a new one is inferred
+#define CATEGORY_DECAY 0.9f
+// Weight of a new score in the moving average of the scores of a category
+#define CATEGORY_SCORE_ALPHA 0.3
+
+// Account for an inferred chunk.  Must be called with model_lock held.
+static void record_inference(btune_struct * btune_params, int best, const float * probs) {
+  metadata_t * metadata = (metadata_t*)btune_params->metadata;
+  for (int i = 0; i < metadata->ncategories; i++) {
+    btune_params->category_weight[i] *= CATEGORY_DECAY;
+    btune_params->category_mass[i] = btune_params->category_mass[i] * CATEGORY_DECAY + probs[i];
+  }
+  btune_params->category_weight[best] += 1;
+  float runner_up = 0;
+  for (int i = 0; i < metadata->ncategories; i++) {
+    if (i != best && probs[i] > runner_up) {
+      runner_up = probs[i];
+    }
+  }
+  btune_params->margin = probs[best] - runner_up;
+}
+
+float btune_model_margin(btune_struct * btune_params) {
+  pthread_mutex_lock(&btune_params->model_lock);
+  float margin = btune_params->margin;
+  pthread_mutex_unlock(&btune_params->model_lock);
+  return margin;
+}
+
+// Run the probe and the model on a chunk, and return the best category
+static int infer_chunk(btune_struct * btune_params, blosc2_schunk * schunk,
+                       const void * src, int32_t size) {
+  model_runtime_t * runtime = (model_runtime_t *)btune_params->runtime;
+  metadata_t * metadata = (metadata_t*)btune_params->metadata;
+
+  int rc = ensure_zeros_speed(btune_params, size);
+  if (rc < 0) {
+    return rc;
+  }
+
+  // Get best category
+  interpreter_t * interpreter = interpreter_acquire(runtime);
+  if (interpreter == NULL) {
+    return -1;
+  }
+  float *probs = (float *)malloc(metadata->ncategories * sizeof(float));
+  int best = get_best_codec_for_chunk(schunk, src, size, interpreter, metadata, probs);
+  interpreter_release(runtime, interpreter);
+  if (best < 0) {
+    free(probs);
+    return best;
+  }
+
+  pthread_mutex_lock(&btune_params->model_lock);
+  record_inference(btune_params, best, probs);
+  pthread_mutex_unlock(&btune_params->model_lock);
+  free(probs);
+  return best;
+}
+
+// Pipelined mode: a helper thread probes a copy of a chunk while it is being compressed,
+// and its prediction is used for the next chunk.  The copy is needed because btune_update
+// is not called when the compression fails, and the caller may then release the chunk.
+typedef struct {
+  pthread_t thread;
+  // The helper thread
+  pthread_mutex_t lock;
+  // Protects the fields below
+  pthread_cond_t cond;
+  // Signals new jobs and finished jobs
+  btune_struct *btune_params;
+  // The tuner
+  blosc2_schunk *schunk;
+  // The super-chunk of the job
+  const void *src;
+  // The chunk of the job (the copy in buffer), NULL if there is no job
+  int32_t size;
+  // The size of the chunk of the job
+  void *buffer;
+  // The copy of the chunk of the job, owned by the pipeline
+  int32_t capacity;
+  // The size of buffer
+  pthread_t owner;
+  // The thread which submitted the job, and must wait for it
+  int result;
+  // The category predicted for the last chunk, or negative if none
+  bool quit;
+  // Whether the helper thread must exit
+} pipeline_t;
+
+static void * pipeline_thread(void * arg) {
+  pipeline_t *pipeline = (pipeline_t *) arg;
+  pthread_mutex_lock(&pipeline->lock);
+  while (true) {
+    while (pipeline->src == NULL && !pipeline->quit) {
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    if (pipeline->quit) {
+      break;
+    }
+    blosc2_schunk *schunk = pipeline->schunk;
+    const void *src = pipeline->src;
+    int32_t size = pipeline->size;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    int best = infer_chunk(pipeline->btune_params, schunk, src, size);
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->result = best;
+    // The prediction is ready for the next chunk of its owner
+    pipeline->src = NULL;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+  return NULL;
+}
+
+static pipeline_t * pipeline_new(btune_struct * btune_params) {
+  pipeline_t *pipeline = (pipeline_t *) calloc(1, sizeof(pipeline_t));
+  pipeline->btune_params = btune_params;
+  pipeline->result = -1;
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+  if (pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline) != 0) {
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+    free(pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+static void pipeline_free(pipeline_t * pipeline) {
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->quit = true;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+  pthread_join(pipeline->thread, NULL);
+  pthread_mutex_destroy(&pipeline->lock);
+  pthread_cond_destroy(&pipeline->cond);
+  free(pipeline->buffer);
+  free(pipeline);
+}
+
+// Take the prediction for the previous chunk and submit the current one.
+// Returns the category, or BTUNE_MODEL_NOT_READY if there is no prediction yet.
+static int pipeline_infer(btune_struct * btune_params, blosc2_context * ctx) {
+  pthread_mutex_lock(&btune_params->model_lock);
+  if (btune_params->pipeline == NULL) {
+    btune_params->pipeline = pipeline_new(btune_params);
+  }
+  pthread_mutex_unlock(&btune_params->model_lock);
+  pipeline_t *pipeline = (pipeline_t *) btune_params->pipeline;
+  if (pipeline == NULL) {
+    // No helper thread, go synchronous
+    return infer_chunk(btune_params, ctx->schunk, ctx->src, ctx->srcsize);
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  if (pipeline->src != NULL) {
+    // The helper is busy with a chunk of another thread, go synchronous
+    pthread_mutex_unlock(&pipeline->lock);
+    return infer_chunk(btune_params, ctx->schunk, ctx->src, ctx->srcsize);
+  }
+  if (pipeline->capacity < ctx->srcsize) {
+    void *buffer = realloc(pipeline->buffer, ctx->srcsize);
+    if (buffer == NULL) {
+      pthread_mutex_unlock(&pipeline->lock);
+      return infer_chunk(btune_params, ctx->schunk, ctx->src, ctx->srcsize);
+    }
+    pipeline->buffer = buffer;
+    pipeline->capacity = ctx->srcsize;
+  }
+  memcpy(pipeline->buffer, ctx->src, ctx->srcsize);
+  int best = pipeline->result;
+  pipeline->result = -1;
+  pipeline->schunk = ctx->schunk;
+  pipeline->src = pipeline->buffer;
+  pipeline->size = ctx->srcsize;
+  pipeline->owner = pthread_self();
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return (best < 0) ? BTUNE_MODEL_NOT_READY : best;
+}
+
+void btune_model_pipeline_wait(blosc2_context * ctx) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  pipeline_t *pipeline = (pipeline_t *) btune_params->pipeline;
+  if (pipeline == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pipeline->lock);
+  // Wait until the helper is done with the chunk submitted by this thread
+  while (pipeline->src != NULL && pthread_equal(pipeline->owner, pthread_self())) {
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
   }
+  pthread_mutex_unlock(&pipeline->lock);
 }
 
 int btune_model_inference(
@@ -386,69 +1198,267 @@ int btune_model_inference(
 ) {
 
   btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
-  if (btune_params->interpreter == NULL || btune_params->metadata == NULL) {
-    return -1;
+  switch (model_status(btune_params)) {
+    case BTUNE_MODEL_READY:
+      break;
+    case BTUNE_MODEL_LOADING:
+      return BTUNE_MODEL_NOT_READY;
+    default:
+      return BTUNE_MODEL_UNAVAILABLE;
   }
-
-  // Get best category
-  tflite::Interpreter * interpreter = (tflite::Interpreter *)btune_params->interpreter;
   metadata_t * metadata = (metadata_t*)btune_params->metadata;
 
-  const void *src = (const void*)ctx->src;
-  int32_t size = ctx->srcsize;
-  int best = get_best_codec_for_chunk(ctx->schunk, src, size, interpreter, metadata);
+  int best;
+  if (btune_params->config.pipeline_inference) {
+    best = pipeline_infer(btune_params, ctx);
+  } else {
+    best = infer_chunk(btune_params, ctx->schunk, ctx->src, ctx->srcsize);
+  }
   if (best < 0) {
     return best;
   }
 
   // Return
   category_t *cat = &metadata->categories[best];
-  cat->count++;
   *compcode = cat->codec;
   *filter = cat->filter;
   *clevel = cat->clevel;
   *splitmode = cat->splitmode;
 
+  return best;
+}
+
+int btune_model_inference_batch(
+    blosc2_context * ctx,
+    const void * const * srcs, const int32_t * sizes, int nchunks,
+    int * categories
+) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  switch (model_status(btune_params)) {
+    case BTUNE_MODEL_READY:
+      break;
+    case BTUNE_MODEL_LOADING:
+      return BTUNE_MODEL_NOT_READY;
+    default:
+      return BTUNE_MODEL_UNAVAILABLE;
+  }
+  model_runtime_t * runtime = (model_runtime_t *)btune_params->runtime;
+  metadata_t * metadata = (metadata_t*)btune_params->metadata;
+
+  // Extract the features of every chunk, and keep track of the chunks with features
+  float *inputs = (float *) malloc(nchunks * metadata->schema.ninputs * sizeof(float));
+  int *rows = (int *) malloc(nchunks * sizeof(int));
+  int nrows = 0;
+  for (int i = 0; i < nchunks; i++) {
+    categories[i] = -1;
+    if (ensure_zeros_speed(btune_params, sizes[i]) < 0) {
+      continue;
+    }
+    if (get_chunk_features(ctx->schunk, srcs[i], sizes[i], metadata,
+                           inputs + nrows * metadata->schema.ninputs) < 0) {
+      continue;
+    }
+    rows[nrows] = i;
+    nrows++;
+  }
+
+  int rc = 0;
+  if (nrows > 0) {
+    interpreter_t * interpreter = interpreter_acquire(runtime);
+    int *best = (int *) malloc(nrows * sizeof(int));
+    float *probs = (float *) malloc(nrows * metadata->ncategories * sizeof(float));
+    rc = (interpreter == NULL) ? -1 : get_best_codecs(interpreter, inputs, nrows,
+                                                      metadata, best, probs);
+    if (interpreter != NULL) {
+      interpreter_release(runtime, interpreter);
+    }
+    if (rc == 0) {
+      pthread_mutex_lock(&btune_params->model_lock);
+      for (int i = 0; i < nrows; i++) {
+        categories[rows[i]] = best[i];
+        record_inference(btune_params, best[i], probs + i * metadata->ncategories);
+      }
+      pthread_mutex_unlock(&btune_params->model_lock);
+    }
+    free(best);
+    free(probs);
+  }
+  BTUNE_TRACE("Batched inference of %d chunks (%d with features)", nchunks, nrows);
+
+  free(inputs);
+  free(rows);
+  return rc;
+}
+
+int btune_model_probe(blosc2_context * ctx, float * cratio, float * speed) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  int rc = ensure_zeros_speed(btune_params, ctx->srcsize);
+  if (rc < 0) {
+    return rc;
+  }
+  return probe_chunk(ctx->schunk, ctx->src, ctx->srcsize, cratio, speed, NULL);
+}
+
+int btune_model_probe_filters(blosc2_context * ctx, float * cratios) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  int rc = ensure_zeros_speed(btune_params, ctx->srcsize);
+  if (rc < 0) {
+    return rc;
+  }
+  float cratio, speed;
+  return probe_chunk(ctx->schunk, ctx->src, ctx->srcsize, &cratio, &speed, cratios);
+}
+
+int btune_model_ncategories(blosc2_context * ctx) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  int status = model_status(btune_params);
+  if (status == BTUNE_MODEL_LOADING) {
+    return BTUNE_MODEL_NOT_READY;
+  }
+  if (status != BTUNE_MODEL_READY) {
+    return BTUNE_MODEL_UNAVAILABLE;
+  }
+  return ((metadata_t*)btune_params->metadata)->ncategories;
+}
+
+int btune_model_category(
+    blosc2_context * ctx, int category,
+    int * compcode, uint8_t * filter, int * clevel, int32_t * splitmode
+) {
+  btune_struct *btune_params = (btune_struct*) ctx->tuner_params;
+  metadata_t * metadata = (metadata_t*)btune_params->metadata;
+  if (__atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE) != BTUNE_MODEL_READY ||
+      category < 0 || category >= metadata->ncategories) {
+    return -1;
+  }
+  category_t *cat = &metadata->categories[category];
+  *compcode = cat->codec;
+  *filter = cat->filter;
+  *clevel = cat->clevel;
+  *splitmode = cat->splitmode;
   return 0;
 }
 
-int most_predicted(btune_struct *btune_params, int *compcode,
-                   uint8_t *filter, int *clevel, int32_t *splitmode) {
-  // Get most predicted category
+static void set_choice(btune_choice *choice, const category_t *cat) {
+  choice->compcode = cat->codec;
+  choice->filter = cat->filter;
+  choice->clevel = cat->clevel;
+  choice->splitmode = cat->splitmode;
+}
+
+void btune_model_score(btune_struct *btune_params, int category, double score) {
+  if (__atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE) != BTUNE_MODEL_READY) {
+    return;
+  }
+  pthread_mutex_lock(&btune_params->model_lock);
+  double *average = &btune_params->category_score[category];
+  if (*average == 0) {
+    *average = score;
+  } else {
+    *average += CATEGORY_SCORE_ALPHA * (score - *average);
+  }
+  pthread_mutex_unlock(&btune_params->model_lock);
+}
+
+int btune_model_best_categories(btune_struct *btune_params, btune_choice *choices,
+                                int maxchoices, float mass) {
+  if (__atomic_load_n(&btune_params->model_status, __ATOMIC_ACQUIRE) != BTUNE_MODEL_READY) {
+    printf("WARNING: Empty metadata, no inference performed\n");
+    return -1;
+  }
   metadata_t *meta = (metadata_t *) btune_params->metadata;
   if (meta == NULL) {
     printf("WARNING: Empty metadata, no inference performed\n");
     return -1;
   }
-  int best_idx = 0;
-  int max_count = meta->categories[best_idx].count;
-  int count;
-  for (int i = 1; i < meta->ncategories; ++i) {
-    count = meta->categories[i].count;
-    if (count > max_count) {
-      best_idx = i;
-      max_count = count;
+  int ncategories = meta->ncategories;
+  pthread_mutex_lock(&btune_params->model_lock);
+
+  // The score of a category relative to the best one (scores are lower the better)
+  double best_score = 0;
+  for (int i = 0; i < ncategories; ++i) {
+    double score = btune_params->category_score[i];
+    if (score > 0 && (best_score == 0 || score < best_score)) {
+      best_score = score;
+    }
+  }
+  double *utility = (double *) malloc(ncategories * sizeof(double));
+  double mean_factor = 0;
+  int nscored = 0;
+  for (int i = 0; i < ncategories; ++i) {
+    double score = btune_params->category_score[i];
+    if (score > 0) {
+      mean_factor += best_score / score;
+      nscored++;
     }
   }
-  // Set parameters
-  *compcode = meta->categories[best_idx].codec;
-  *filter = meta->categories[best_idx].filter;
-  *clevel = meta->categories[best_idx].clevel;
-  *splitmode = meta->categories[best_idx].splitmode;
+  mean_factor = (nscored > 0) ? mean_factor / nscored : 1;
+  // Recent predictions of categories which compressed well are worth the most.  The
+  // categories never measured get the average factor.
+  float total_mass = 0;
+  for (int i = 0; i < ncategories; ++i) {
+    double score = btune_params->category_score[i];
+    double factor = (score > 0) ? best_score / score : mean_factor;
+    utility[i] = btune_params->category_weight[i] * factor;
+    total_mass += btune_params->category_mass[i];
+  }
 
-  return 0;
+  // Take the categories with the highest utility, until they add up to the given
+  // probability mass
+  int nchoices = 0;
+  float accum = 0;
+  while (nchoices < maxchoices) {
+    int next = -1;
+    for (int i = 0; i < ncategories; ++i) {
+      if (utility[i] >= 0 && (next < 0 || utility[i] > utility[next])) {
+        next = i;
+      }
+    }
+    if (next < 0 || (nchoices > 0 && (utility[next] <= 0 || accum >= mass * total_mass))) {
+      break;
+    }
+    BTUNE_TRACE("Category %d: weight=%.3g mean score=%.3g probability=%.3g",
+                next, btune_params->category_weight[next], btune_params->category_score[next],
+                (total_mass > 0) ? btune_params->category_mass[next] / total_mass : 0.);
+    utility[next] = -1;
+    accum += btune_params->category_mass[next];
+    set_choice(&choices[nchoices], &meta->categories[next]);
+    nchoices++;
+  }
+  free(utility);
+  pthread_mutex_unlock(&btune_params->model_lock);
+
+  return nchoices;
 }
 
 void btune_model_free(blosc2_context * ctx) {
   btune_struct *btune_params = (btune_struct *) ctx->tuner_params;
+  btune_config *config = &btune_params->config;
 
-  delete btune_params->interpreter;
-  btune_params->interpreter = NULL;
-
-  metadata_t * metadata = (metadata_t *) btune_params->metadata;
-  if (metadata != nullptr) {
-    free(metadata->categories);
-    free(metadata);
-    btune_params->metadata = NULL;
+  if (btune_params->pipeline != NULL) {
+    pipeline_free((pipeline_t *) btune_params->pipeline);
+    btune_params->pipeline = NULL;
+  }
+  if (btune_params->model_thread_started) {
+    pthread_join(btune_params->model_thread, NULL);
+    btune_params->model_thread_started = false;
+  }
+  free(btune_params->model_dir);
+  btune_params->model_dir = NULL;
+  if (btune_params->runtime != NULL) {
+    model_runtime_release((model_runtime_t *) btune_params->runtime);
+    btune_params->runtime = NULL;
+  }
+  // The metadata belongs to the runtime
+  btune_params->metadata = NULL;
+  if (config->state_file != NULL && config->norm_prior >= 0 &&
+      btune_params->feature_stats[BTUNE_FEATURE_CRATIO].n > 0) {
+    btune_state_save(btune_params, config->state_file);
   }
+  free(btune_params->category_weight);
+  btune_params->category_weight = NULL;
+  free(btune_params->category_mass);
+  btune_params->category_mass = NULL;
+  free(btune_params->category_score);
+  btune_params->category_score = NULL;
 }
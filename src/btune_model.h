@@ -8,16 +8,75 @@
 extern "C" {
 #endif
 
+// Model loading status
+typedef enum {
+  BTUNE_MODEL_NONE,        // No model requested
+  BTUNE_MODEL_DEFERRED,    // To be loaded the first time inference is needed
+  BTUNE_MODEL_LOADING,     // Being loaded in background
+  BTUNE_MODEL_READY,       // Loaded and ready for inference
+  BTUNE_MODEL_FAILED,      // Model files could not be loaded
+} btune_model_status;
+
+// Return codes of btune_model_inference apart from 0 and blosc2 errors
+enum {
+  BTUNE_MODEL_NOT_READY = -100,    // Model still loading, retry with next chunk
+  BTUNE_MODEL_UNAVAILABLE = -101,  // No model, stop trying
+};
+
 void btune_model_init(blosc2_context * ctx);
 
+// Run inference on the chunk in ctx.  Returns the predicted category, or negative on error.
 int btune_model_inference(
   blosc2_context * ctx,
   int * compcode, uint8_t * filter, int * clevel, int32_t * splitmode);
 
+/*
+ * Run inference on a batch of chunks with a single model invocation.
+ *
+ * This is the backend of btune_infer_chunks.  On return, categories[i] holds
+ * the category predicted for srcs[i] (see btune_model_category), or -1 if the
+ * chunk could not be probed (e.g. it is too small).
+ */
+int btune_model_inference_batch(
+  blosc2_context * ctx,
+  const void * const * srcs, const int32_t * sizes, int nchunks,
+  int * categories);
+
+// Get the compression parameters of a category returned by btune_model_inference_batch
+int btune_model_category(
+  blosc2_context * ctx, int category,
+  int * compcode, uint8_t * filter, int * clevel, int32_t * splitmode);
+
+// Number of categories of the model (loading it if deferred), or BTUNE_MODEL_NOT_READY/UNAVAILABLE
+int btune_model_ncategories(blosc2_context * ctx);
+
+// Run the entropy probe on the chunk in ctx, without the model
+int btune_model_probe(blosc2_context * ctx, float * cratio, float * speed);
+
+// Estimate the cratio of the chunk in ctx after every filter (ENTROPY_PROBE_NFILTERS of them)
+int btune_model_probe_filters(blosc2_context * ctx, float * cratios);
+
+// Wait until the helper of the pipelined mode has probed the chunk submitted by this thread
+void btune_model_pipeline_wait(blosc2_context * ctx);
+
+// Probability of the last inferred category minus the one of the runner-up
+float btune_model_margin(btune_struct * btune_params);
+
 void btune_model_free(blosc2_context * ctx);
 
-int most_predicted(btune_struct *btune_params, int *compcode,
-                   uint8_t *filter, int *clevel, int32_t *splitmode);
+// Account for the score of a chunk compressed with the parameters of a category
+void btune_model_score(btune_struct *btune_params, int category, double score);
+
+/*
+ * Get the categories to use once inference has ended, up to maxchoices, until they
+ * add up to the given fraction of the probability mass.  Returns the number of
+ * choices, or -1.
+ *
+ * The categories are ranked by how often they have been predicted, weighting recent
+ * chunks more, and by how well the chunks compressed with them actually scored.
+ */
+int btune_model_best_categories(btune_struct *btune_params, btune_choice *choices,
+                                int maxchoices, float mass);
 
 #ifdef __cplusplus
 }
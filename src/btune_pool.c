@@ -0,0 +1,164 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include <blosc2.h>
+#include "btune.h"
+#include "btune_pool.h"
+
+
+// Largest number of workers, besides the threads submitting jobs
+#define POOL_MAX_WORKERS 256
+
+// The jobs submitted by a call of the backend
+typedef struct pool_batch {
+  void (*dojob)(void *);
+  // The job function
+  uint8_t *jobdata;
+  // The data of the jobs
+  size_t elsize;
+  // The size of the data of every job
+  int njobs;
+  // The number of jobs
+  int next;
+  // The next job to run
+  int pending;
+  // The jobs not finished yet
+  struct pool_batch *next_batch;
+  // The next batch with jobs to run
+} pool_batch;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+// The batches with jobs not started yet
+static pool_batch *pool_batches = NULL;
+static int pool_nworkers = 0;
+static bool installed = false;
+
+
+// Take the next job of batch, and unlink the batch when it has no more (with the lock held)
+static int take_job(pool_batch *batch) {
+  int job = batch->next++;
+  if (batch->next == batch->njobs) {
+    pool_batch **prev = &pool_batches;
+    while (*prev != batch) {
+      prev = &(*prev)->next_batch;
+    }
+    *prev = batch->next_batch;
+  }
+  return job;
+}
+
+// Run a job of batch, and tell its submitter when it is the last one (with the lock held)
+static void run_job(pool_batch *batch, int job) {
+  pthread_mutex_unlock(&pool_lock);
+  batch->dojob(batch->jobdata + job * batch->elsize);
+  pthread_mutex_lock(&pool_lock);
+  batch->pending--;
+  if (batch->pending == 0) {
+    pthread_cond_broadcast(&pool_done);
+  }
+}
+
+static void * pool_worker(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&pool_lock);
+  while (true) {
+    while (pool_batches == NULL) {
+      pthread_cond_wait(&pool_work, &pool_lock);
+    }
+    pool_batch *batch = pool_batches;
+    run_job(batch, take_job(batch));
+  }
+  return NULL;
+}
+
+static void pool_start(void) {
+  long ncores = 4;
+#if defined(_SC_NPROCESSORS_ONLN)
+  ncores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  // The submitting thread is one of the cores
+  int nworkers = (ncores - 1 > POOL_MAX_WORKERS) ? POOL_MAX_WORKERS : (int) ncores - 1;
+  for (int i = 0; i < nworkers; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    pool_nworkers++;
+  }
+}
+
+// The threading backend of blosc2: run njobs jobs, returning when all are done
+static void pool_run(void *callback_data, void (*dojob)(void *), int njobs, size_t elsize,
+                     void *jobdata) {
+  (void) callback_data;
+  if (njobs <= 0) {
+    return;
+  }
+  pool_batch batch = {dojob, (uint8_t *) jobdata, elsize, njobs, 0, njobs, NULL};
+  pthread_mutex_lock(&pool_lock);
+  if (njobs > 1 && pool_nworkers > 0) {
+    batch.next_batch = pool_batches;
+    pool_batches = &batch;
+    if (njobs - 1 >= pool_nworkers) {
+      pthread_cond_broadcast(&pool_work);
+    } else {
+      for (int i = 0; i < njobs - 1; i++) {
+        pthread_cond_signal(&pool_work);
+      }
+    }
+  } else {
+    // Nothing to share, run the jobs in this thread
+    batch.next = njobs;
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < njobs; i++) {
+      dojob((uint8_t *) jobdata + i * elsize);
+    }
+    return;
+  }
+
+  // This thread works on its own batch too
+  while (batch.next < batch.njobs) {
+    run_job(&batch, take_job(&batch));
+  }
+  while (batch.pending > 0) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// blosc2 reads its backend without synchronization, and a context that started threads
+// of its own would be torn down as if the pool had run them.  Hence this is only done
+// on request of the application, before any use of blosc2 (see btune_install_worker_pool).
+static void pool_install(void) {
+  pool_start();
+  blosc2_set_threads_callback(pool_run, NULL);
+  __atomic_store_n(&installed, true, __ATOMIC_RELEASE);
+  BTUNE_TRACE("Worker pool installed as the threading backend of blosc2");
+}
+
+int btune_install_worker_pool(void) {
+  pthread_once(&pool_once, pool_install);
+  return installed ? 0 : -1;
+}
+
+bool btune_pool_installed(void) {
+  return __atomic_load_n(&installed, __ATOMIC_ACQUIRE);
+}
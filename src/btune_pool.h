@@ -0,0 +1,40 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_pool.h
+ * @brief A persistent pool of workers, shared by all the blosc2 contexts.
+ *
+ * Once installed as the threading backend of blosc2, the contexts do not start
+ * and stop their own threads anymore: their jobs are run by the workers of the
+ * pool, which live as long as the process.  Changing the number of threads of
+ * a context then only changes the number of jobs it submits, so that tuning
+ * the threads is cheap.  The jobs of a context pull its blocks from a shared
+ * counter, so they are correct with fewer workers than jobs, and the jobs of
+ * several contexts can run at the same time.
+ */
+
+#ifndef BTUNE_POOL_H
+#define BTUNE_POOL_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The pool is installed by the application with btune_install_worker_pool (see btune.h)
+
+// Whether the pool is the threading backend of blosc2
+bool btune_pool_installed(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_POOL_H */
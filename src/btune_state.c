@@ -0,0 +1,265 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "btune_state.h"
+#include "json.h"
+
+
+// Version 1 keyed the entries by "comp" and "decomp" only
+#define BTUNE_STATE_VERSION 2
+
+static const char *feature_names[BTUNE_NFEATURES] = {"cratio", "speed"};
+
+void btune_running_stats_add(btune_running_stats *stats, double value) {
+  stats->n += 1;
+  double delta = value - stats->mean;
+  stats->mean += delta / stats->n;
+  stats->m2 += delta * (value - stats->mean);
+}
+
+// The entries are keyed by the model file, so that runs with other models do not mix
+// their statistics.  Returns a string to be freed, or NULL.
+static char * model_name(btune_struct *btune_params) {
+  const char *dirname = btune_params->config.models_dir;
+  if (dirname == NULL) {
+    return NULL;
+  }
+#if !defined(_WIN32)
+  char resolved[PATH_MAX];
+  if (realpath(dirname, resolved) != NULL) {
+    dirname = resolved;
+  }
+#endif
+  const char *fname = (btune_params->config.perf_mode == BTUNE_PERF_DECOMP) ?
+                      "model_decomp.tflite" : "model_comp.tflite";
+  size_t len = strlen(dirname) + 1 + strlen(fname) + 1;
+  char *name = malloc(len);
+  if (name != NULL) {
+    snprintf(name, len, "%s/%s", dirname, fname);
+  }
+  return name;
+}
+
+static json_value * json_get(json_value *json, const char *name) {
+  if (json == NULL || json->type != json_object) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < json->u.object.length; i++) {
+    if (strcmp(json->u.object.values[i].name, name) == 0) {
+      return json->u.object.values[i].value;
+    }
+  }
+  return NULL;
+}
+
+static double json_get_number(json_value *json, const char *name) {
+  json_value *value = json_get(json, name);
+  if (value == NULL) {
+    return 0;
+  }
+  return (value->type == json_integer) ? (double)value->u.integer : value->u.dbl;
+}
+
+static json_value * read_state(const char *fname) {
+  FILE *file = fopen(fname, "rt");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *buffer = malloc(size + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t nread = fread(buffer, 1, size, file);
+  fclose(file);
+  buffer[nread] = 0;
+  json_value *json = json_parse(buffer, nread);
+  free(buffer);
+  if (json != NULL && json->type != json_object) {
+    json_value_free(json);
+    return NULL;
+  }
+  return json;
+}
+
+int btune_state_load(btune_struct *btune_params, const char *fname) {
+  json_value *json = read_state(fname);
+  if (json == NULL) {
+    return -1;
+  }
+  if (json_get_number(json, "version") != BTUNE_STATE_VERSION) {
+    printf("WARNING: Unsupported version of the state file %s, ignoring it\n", fname);
+    json_value_free(json);
+    return -1;
+  }
+  char *name = model_name(btune_params);
+  json_value *features = (name != NULL) ? json_get(json_get(json, name), "features") : NULL;
+  free(name);
+  for (int i = 0; i < BTUNE_NFEATURES; i++) {
+    json_value *feature = json_get(features, feature_names[i]);
+    if (feature != NULL) {
+      btune_running_stats *stats = &btune_params->feature_stats[i];
+      stats->n = json_get_number(feature, "n");
+      stats->mean = json_get_number(feature, "mean");
+      stats->m2 = json_get_number(feature, "m2");
+    }
+  }
+  json_value_free(json);
+  return 0;
+}
+
+static void write_string(FILE *file, const char *str) {
+  fputc('"', file);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(file, "\\%c", *str);
+    } else if ((unsigned char)*str < 0x20) {
+      fprintf(file, "\\u%04x", *str);
+    } else {
+      fputc(*str, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// Write back a parsed value, so that unknown entries are preserved
+static void write_value(FILE *file, json_value *value) {
+  switch (value->type) {
+    case json_object:
+      fputc('{', file);
+      for (unsigned int i = 0; i < value->u.object.length; i++) {
+        if (i > 0) {
+          fputs(", ", file);
+        }
+        write_string(file, value->u.object.values[i].name);
+        fprintf(file, ": ");
+        write_value(file, value->u.object.values[i].value);
+      }
+      fputc('}', file);
+      break;
+    case json_array:
+      fputc('[', file);
+      for (unsigned int i = 0; i < value->u.array.length; i++) {
+        if (i > 0) {
+          fputs(", ", file);
+        }
+        write_value(file, value->u.array.values[i]);
+      }
+      fputc(']', file);
+      break;
+    case json_integer:
+      fprintf(file, "%lld", (long long)value->u.integer);
+      break;
+    case json_double:
+      fprintf(file, "%.17g", value->u.dbl);
+      break;
+    case json_string:
+      write_string(file, value->u.string.ptr);
+      break;
+    case json_boolean:
+      fputs(value->u.boolean ? "true" : "false", file);
+      break;
+    default:
+      fputs("null", file);
+      break;
+  }
+}
+
+// Create a temporary file next to fname, with a unique name so that processes saving
+// at the same time do not write the same one.  Returns NULL on error.
+static FILE * open_temporary(const char *fname, char *tmpname, size_t len) {
+  snprintf(tmpname, len, "%s.XXXXXX", fname);
+#if defined(_WIN32)
+  if (_mktemp_s(tmpname, len) != 0) {
+    return NULL;
+  }
+  return fopen(tmpname, "wt");
+#else
+  int fd = mkstemp(tmpname);
+  if (fd < 0) {
+    return NULL;
+  }
+  FILE *file = fdopen(fd, "wt");
+  if (file == NULL) {
+    close(fd);
+    remove(tmpname);
+  }
+  return file;
+#endif
+}
+
+int btune_state_save(btune_struct *btune_params, const char *fname) {
+  char *name = model_name(btune_params);
+  if (name == NULL) {
+    return -1;
+  }
+  json_value *old = read_state(fname);
+
+  // Write to a temporary file first, so that a crash does not leave a truncated state
+  size_t len = strlen(fname) + 8;
+  char *tmpname = malloc(len);
+  FILE *file = (tmpname != NULL) ? open_temporary(fname, tmpname, len) : NULL;
+  if (file == NULL) {
+    printf("WARNING: Cannot write the state file %s\n", fname);
+    free(tmpname);
+    free(name);
+    if (old != NULL) {
+      json_value_free(old);
+    }
+    return -1;
+  }
+
+  fprintf(file, "{\"version\": %d", BTUNE_STATE_VERSION);
+  // Keep the entries of other models, unless they were written by another version
+  if (old != NULL && json_get_number(old, "version") != BTUNE_STATE_VERSION) {
+    json_value_free(old);
+    old = NULL;
+  }
+  if (old != NULL) {
+    for (unsigned int i = 0; i < old->u.object.length; i++) {
+      const char *entry = old->u.object.values[i].name;
+      if (strcmp(entry, "version") != 0 && strcmp(entry, name) != 0) {
+        fprintf(file, ", ");
+        write_string(file, entry);
+        fprintf(file, ": ");
+        write_value(file, old->u.object.values[i].value);
+      }
+    }
+    json_value_free(old);
+  }
+  fprintf(file, ", ");
+  write_string(file, name);
+  fprintf(file, ": {\"features\": {");
+  free(name);
+  for (int i = 0; i < BTUNE_NFEATURES; i++) {
+    btune_running_stats *stats = &btune_params->feature_stats[i];
+    fprintf(file, "%s\"%s\": {\"n\": %.17g, \"mean\": %.17g, \"m2\": %.17g}",
+            (i > 0) ? ", " : "", feature_names[i], stats->n, stats->mean, stats->m2);
+  }
+  fprintf(file, "}}}\n");
+
+  int rc = (fclose(file) == 0) ? rename(tmpname, fname) : -1;
+  if (rc != 0) {
+    printf("WARNING: Cannot write the state file %s\n", fname);
+    remove(tmpname);
+  }
+  free(tmpname);
+  return rc;
+}
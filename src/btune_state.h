@@ -0,0 +1,40 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_state.h
+ * @brief Persistence of the tuner state between runs.
+ *
+ * The state is kept in a JSON file, with an entry per model file (comp or decomp, in
+ * every models directory), so that the runs using other models do not overwrite it.
+ */
+
+#ifndef BTUNE_STATE_H
+#define BTUNE_STATE_H
+
+#include "btune.h"
+#include "btune-private.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Load the state of the tuner from fname.  Returns 0 on success, -1 if there is no state.
+int btune_state_load(btune_struct *btune_params, const char *fname);
+
+// Save the state of the tuner to fname, keeping the entries of other models.  Returns 0 on success.
+int btune_state_save(btune_struct *btune_params, const char *fname);
+
+// Add an observation to running statistics
+void btune_running_stats_add(btune_running_stats *stats, double value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_STATE_H */
@@ -0,0 +1,122 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <stddef.h>
+#include "btune_threads.h"
+
+
+void btune_threads_fit_init(btune_threads_fit *fit, int max_threads) {
+  int n = 0;
+  for (int count = 1; count < max_threads && n < BTUNE_MAX_THREAD_SAMPLES - 1; count <<= 1) {
+    fit->counts[n++] = count;
+  }
+  fit->counts[n++] = max_threads;
+  fit->ncounts = n;
+  for (int i = 0; i < n; i++) {
+    fit->times[i] = 0;
+  }
+  fit->knee = 0;
+}
+
+bool btune_threads_fit_record(btune_threads_fit *fit, int nthreads, double time,
+                              double best_time) {
+  if (fit->knee > 0) {
+    return nthreads == fit->knee && time <= (1 + BTUNE_THREADS_KNEE_TOLERANCE) * best_time;
+  }
+  for (int i = 0; i < fit->ncounts; i++) {
+    if (fit->counts[i] != nthreads || fit->times[i] > 0) {
+      continue;
+    }
+    fit->times[i] = time;
+    if (i > 0 && fit->times[i - 1] > 0 &&
+        time > BTUNE_THREADS_SATURATION * fit->times[i - 1]) {
+      fit->ncounts = i + 1;
+    }
+    break;
+  }
+  return time < best_time;
+}
+
+bool btune_threads_fit_sampled(const btune_threads_fit *fit) {
+  for (int i = 0; i < fit->ncounts; i++) {
+    if (fit->times[i] == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The time with n threads modeled by the Universal Scalability Law
+static inline double usl_time(double time1, double sigma, double kappa, int n) {
+  return time1 * (1 + sigma * (n - 1) + kappa * n * (n - 1)) / n;
+}
+
+int btune_threads_fit_knee(const btune_threads_fit *fit, double *sigma_out, double *kappa_out) {
+  const int *counts = fit->counts;
+  const double *times = fit->times;
+  int ncounts = fit->ncounts;
+  // Least squares of n T(n) / T(1) - 1 = sigma x1 + kappa x2, with sigma, kappa >= 0
+  double s11 = 0, s12 = 0, s22 = 0, s1y = 0, s2y = 0;
+  for (int i = 1; i < ncounts; i++) {
+    double n = counts[i];
+    double x1 = n - 1;
+    double x2 = n * (n - 1);
+    double y = n * times[i] / times[0] - 1;
+    s11 += x1 * x1;
+    s12 += x1 * x2;
+    s22 += x2 * x2;
+    s1y += x1 * y;
+    s2y += x2 * y;
+  }
+  double sigma = 0, kappa = 0;
+  double det = s11 * s22 - s12 * s12;
+  if (det > 1e-9 * s11 * s22) {
+    sigma = (s1y * s22 - s2y * s12) / det;
+    kappa = (s11 * s2y - s12 * s1y) / det;
+  }
+  if (kappa <= 0) {
+    kappa = 0;
+    sigma = (s11 > 0) ? s1y / s11 : 0;
+  }
+  if (sigma < 0) {
+    sigma = 0;
+    kappa = (s22 > 0 && s2y > 0) ? s2y / s22 : 0;
+  }
+  if (sigma_out != NULL) {
+    *sigma_out = sigma;
+  }
+  if (kappa_out != NULL) {
+    *kappa_out = kappa;
+  }
+
+  // The curve is smooth, so a speedup stopping short (e.g. on the memory bandwidth) moves
+  // its knee past the counts that still scale: never go past the fastest count sampled
+  int limit = counts[0];
+  double fastest = times[0];
+  for (int i = 1; i < ncounts; i++) {
+    if (times[i] < fastest) {
+      fastest = times[i];
+      limit = counts[i];
+    }
+  }
+  double min_time = times[0];
+  for (int n = 1; n <= limit; n++) {
+    double modeled = usl_time(times[0], sigma, kappa, n);
+    if (modeled < min_time) {
+      min_time = modeled;
+    }
+  }
+  for (int n = 1; n <= limit; n++) {
+    double modeled = usl_time(times[0], sigma, kappa, n);
+    if (modeled <= (1 + BTUNE_THREADS_KNEE_TOLERANCE) * min_time) {
+      return n;
+    }
+  }
+  return limit;
+}
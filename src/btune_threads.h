@@ -0,0 +1,77 @@
+/**********************************************************************
+  Optimize Blosc2 parameters using deep/machine learning.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+/** @file  btune_threads.h
+ * @brief The scaling curve of the FIT thread search.
+ *
+ * The FIT thread search samples the time of a chunk with 1 thread, the powers
+ * of two and the most threads, fits the Universal Scalability Law to these
+ * times and tries the fewest threads whose modeled time is close to the
+ * minimum (the knee of the curve).  The sampling stops early when doubling the
+ * threads barely helps, e.g. when the memory bandwidth is saturated.
+ */
+
+#ifndef BTUNE_THREADS_H
+#define BTUNE_THREADS_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of thread counts sampled by the FIT thread search
+#define BTUNE_MAX_THREAD_SAMPLES 16
+
+// A count whose time is above this ratio of the one of half its threads ends the sampling
+#define BTUNE_THREADS_SATURATION 0.95
+
+// The knee is the fewest threads whose modeled time is within this tolerance of the minimum
+#define BTUNE_THREADS_KNEE_TOLERANCE 0.05
+
+typedef struct {
+  int counts[BTUNE_MAX_THREAD_SAMPLES];
+  // The numbers of threads sampled, in increasing order
+  double times[BTUNE_MAX_THREAD_SAMPLES];
+  // The time measured with every number of threads, 0 if not yet
+  int ncounts;
+  // The numbers of threads to sample (less if the speedup saturates)
+  int knee;
+  // The number of threads predicted by the scaling curve, 0 while sampling
+} btune_threads_fit;
+
+// Start sampling 1 thread, the powers of two and max_threads
+void btune_threads_fit_init(btune_threads_fit *fit, int max_threads);
+
+/*
+ * Record the time of a chunk compressed (or decompressed) with nthreads, and
+ * tell whether it improved on best_time.  While sampling, a count whose time is
+ * not clearly below the one of half its threads ends the sampling.  Once the
+ * knee is known, only the knee within BTUNE_THREADS_KNEE_TOLERANCE of best_time
+ * improves.
+ */
+bool btune_threads_fit_record(btune_threads_fit *fit, int nthreads, double time,
+                              double best_time);
+
+// Whether every count to sample has its time
+bool btune_threads_fit_sampled(const btune_threads_fit *fit);
+
+/*
+ * Fit the Universal Scalability Law, T(n) = T(1) * (1 + sigma (n - 1) + kappa n (n - 1)) / n,
+ * to the sampled times, and return the knee, up to the fastest count sampled.  sigma is the
+ * serial fraction (Amdahl) and kappa the cost of the threads talking to each other; they
+ * are stored in *sigma and *kappa when these are not NULL.
+ */
+int btune_threads_fit_knee(const btune_threads_fit *fit, double *sigma, double *kappa);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* BTUNE_THREADS_H */
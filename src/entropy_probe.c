@@ -1,6 +1,20 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define PROBE_HAVE_X86
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+  #define PROBE_HAVE_NEON
+#endif
 
 #include <blosc2.h>
 #include "entropy_probe.h"
@@ -33,8 +47,8 @@
         }                          \
     }
 
-static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
-  uint8_t x = ip[-1];
+// Get the end of the run of x bytes at ref
+static uint8_t *get_run_of(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref, uint8_t x) {
   int64_t value, value2;
   /* Broadcast the value for every byte in a 64-bit register */
   memset(&value, x, 8);
@@ -57,6 +71,10 @@ static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref
   return ip;
 }
 
+static uint8_t *get_run(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  return get_run_of(ip, ip_bound, ref, ip[-1]);
+}
+
 static uint8_t *get_match(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
   while (ip < (ip_bound - sizeof(int64_t))) {
     if (*(int64_t *) ref != *(int64_t *) ip) {
@@ -75,18 +93,157 @@ static uint8_t *get_match(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *r
   return ip;
 }
 
-static uint8_t *get_run_or_match(uint8_t *ip, uint8_t *ip_bound, const uint8_t *ref, bool run) {
-  if (run) {
-    ip = get_run(ip, ip_bound, ref);
-  } else {
-    ip = get_match(ip, ip_bound, ref);
+/*
+ * Vectorized match and run finders.  They must give exactly the same results
+ * as the scalar ones, so they compare whole vectors while these fit before
+ * ip_bound, and leave the rest to the narrower (and finally scalar) code.
+ */
+
+#if defined(PROBE_HAVE_X86)
+__attribute__((target("sse4.2")))
+static uint8_t *get_match_sse42(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  while (ip_bound - ip >= 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) ip), _mm_loadu_si128((const __m128i *) ref));
+    unsigned diff = (unsigned) _mm_movemask_epi8(eq) ^ 0xFFFFU;
+    if (diff) {
+      /* Past the byte that starts to differ, as get_match() */
+      return ip + __builtin_ctz(diff) + 1;
+    }
+    ip += 16;
+    ref += 16;
   }
+  return get_match(ip, ip_bound, ref);
+}
 
-  return ip;
+__attribute__((target("sse4.2")))
+static uint8_t *get_run_of_sse42(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref, uint8_t x) {
+  __m128i value = _mm_set1_epi8((char) x);
+  while (ip_bound - ip >= 16) {
+    __m128i eq = _mm_cmpeq_epi8(value, _mm_loadu_si128((const __m128i *) ref));
+    unsigned diff = (unsigned) _mm_movemask_epi8(eq) ^ 0xFFFFU;
+    if (diff) {
+      return ip + __builtin_ctz(diff);
+    }
+    ip += 16;
+    ref += 16;
+  }
+  return get_run_of(ip, ip_bound, ref, x);
 }
 
-// Get a guess for the compressed size of a buffer
-static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+__attribute__((target("sse4.2")))
+static uint8_t *get_run_sse42(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  return get_run_of_sse42(ip, ip_bound, ref, ip[-1]);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *get_match_avx2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  while (ip_bound - ip >= 32) {
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) ip),
+                                   _mm256_loadu_si256((const __m256i *) ref));
+    uint32_t diff = ~(uint32_t) _mm256_movemask_epi8(eq);
+    if (diff) {
+      return ip + __builtin_ctz(diff) + 1;
+    }
+    ip += 32;
+    ref += 32;
+  }
+  return get_match_sse42(ip, ip_bound, ref);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *get_run_of_avx2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref, uint8_t x) {
+  __m256i value = _mm256_set1_epi8((char) x);
+  while (ip_bound - ip >= 32) {
+    __m256i eq = _mm256_cmpeq_epi8(value, _mm256_loadu_si256((const __m256i *) ref));
+    uint32_t diff = ~(uint32_t) _mm256_movemask_epi8(eq);
+    if (diff) {
+      return ip + __builtin_ctz(diff);
+    }
+    ip += 32;
+    ref += 32;
+  }
+  return get_run_of_sse42(ip, ip_bound, ref, x);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *get_run_avx2(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  return get_run_of_avx2(ip, ip_bound, ref, ip[-1]);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint8_t *get_match_avx512(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  while (ip_bound - ip >= 64) {
+    uint64_t diff = ~(uint64_t) _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(ip), _mm512_loadu_si512(ref));
+    if (diff) {
+      return ip + __builtin_ctzll(diff) + 1;
+    }
+    ip += 64;
+    ref += 64;
+  }
+  return get_match_avx2(ip, ip_bound, ref);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint8_t *get_run_of_avx512(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref, uint8_t x) {
+  __m512i value = _mm512_set1_epi8((char) x);
+  while (ip_bound - ip >= 64) {
+    uint64_t diff = ~(uint64_t) _mm512_cmpeq_epi8_mask(value, _mm512_loadu_si512(ref));
+    if (diff) {
+      return ip + __builtin_ctzll(diff);
+    }
+    ip += 64;
+    ref += 64;
+  }
+  return get_run_of_avx2(ip, ip_bound, ref, x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint8_t *get_run_avx512(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  return get_run_of_avx512(ip, ip_bound, ref, ip[-1]);
+}
+
+#endif
+
+#if defined(PROBE_HAVE_NEON)
+// Index of the first zero byte of a comparison result, or 16 if there is none
+static inline int first_diff_neon(uint8x16_t eq) {
+  // Narrow every byte to 4 bits
+  uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+  return (~mask) ? __builtin_ctzll(~mask) >> 2 : 16;
+}
+
+static uint8_t *get_match_neon(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  while (ip_bound - ip >= 16) {
+    int diff = first_diff_neon(vceqq_u8(vld1q_u8(ip), vld1q_u8(ref)));
+    if (diff < 16) {
+      return ip + diff + 1;
+    }
+    ip += 16;
+    ref += 16;
+  }
+  return get_match(ip, ip_bound, ref);
+}
+
+static uint8_t *get_run_neon(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref) {
+  uint8_t x = ip[-1];
+  uint8x16_t value = vdupq_n_u8(x);
+  while (ip_bound - ip >= 16) {
+    int diff = first_diff_neon(vceqq_u8(value, vld1q_u8(ref)));
+    if (diff < 16) {
+      return ip + diff;
+    }
+    ip += 16;
+    ref += 16;
+  }
+  return get_run_of(ip, ip_bound, ref, x);
+}
+#endif
+
+typedef uint8_t * (*find_fn)(uint8_t *ip, const uint8_t *ip_bound, const uint8_t *ref);
+
+// Get a guess for the compressed size of a buffer, finding the matches and runs with the given kernels
+static inline __attribute__((always_inline))
+float get_cratio_with(const uint8_t *ibase, int maxlen, int minlen, int ipshift, find_fn match, find_fn run) {
   const uint8_t *ip = ibase;
   int32_t oc = 0;
   const uint16_t hashlen = (1U << (uint8_t)HASH_LOG);
@@ -144,7 +301,11 @@ static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshif
     distance--;
 
     /* get runs or matches; zero distance means a run */
-    ip = get_run_or_match((uint8_t *) ip, (uint8_t *) ip_bound, ref, !distance);
+    if (!distance) {
+      ip = run((uint8_t *) ip, ip_bound, ref);
+    } else {
+      ip = match((uint8_t *) ip, ip_bound, ref);
+    }
 
     ip -= ipshift;
     int32_t len = (int32_t)(ip - anchor);
@@ -186,6 +347,98 @@ static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshif
   return ic / (float) oc;
 }
 
+static float get_cratio_scalar(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  return get_cratio_with(ibase, maxlen, minlen, ipshift, get_match, get_run);
+}
+
+#if defined(PROBE_HAVE_X86)
+__attribute__((target("sse4.2")))
+static float get_cratio_sse42(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  return get_cratio_with(ibase, maxlen, minlen, ipshift, get_match_sse42, get_run_sse42);
+}
+
+__attribute__((target("avx2")))
+static float get_cratio_avx2(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  return get_cratio_with(ibase, maxlen, minlen, ipshift, get_match_avx2, get_run_avx2);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float get_cratio_avx512(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  return get_cratio_with(ibase, maxlen, minlen, ipshift, get_match_avx512, get_run_avx512);
+}
+#endif
+
+#if defined(PROBE_HAVE_NEON)
+static float get_cratio_neon(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  return get_cratio_with(ibase, maxlen, minlen, ipshift, get_match_neon, get_run_neon);
+}
+#endif
+
+typedef float (*cratio_fn)(const uint8_t *ibase, int maxlen, int minlen, int ipshift);
+
+typedef struct {
+  const char *name;
+  cratio_fn cratio;
+} probe_kernel;
+
+// Maximum number of kernels compiled in
+#define MAX_KERNELS 4
+
+// The kernels compiled in which this CPU supports, from the narrowest to the widest
+static probe_kernel kernels[MAX_KERNELS] = {{"scalar", get_cratio_scalar}};
+static int nkernels = 1;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#if defined(PROBE_HAVE_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    kernels[nkernels++] = (probe_kernel) {"sse4.2", get_cratio_sse42};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[nkernels++] = (probe_kernel) {"avx2", get_cratio_avx2};
+  }
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    kernels[nkernels++] = (probe_kernel) {"avx512", get_cratio_avx512};
+  }
+#endif
+#if defined(PROBE_HAVE_NEON)
+  kernels[nkernels++] = (probe_kernel) {"neon", get_cratio_neon};
+#endif
+}
+
+const char * entropy_probe_kernel_name(void) {
+  pthread_once(&kernel_once, select_kernels);
+  return kernels[nkernels - 1].name;
+}
+
+int entropy_probe_nkernels(void) {
+  pthread_once(&kernel_once, select_kernels);
+  return nkernels;
+}
+
+const char * entropy_probe_kernel_name_at(int kernel) {
+  pthread_once(&kernel_once, select_kernels);
+  return (kernel >= 0 && kernel < nkernels) ? kernels[kernel].name : NULL;
+}
+
+float entropy_probe_kernel_cratio(int kernel, const uint8_t *src, int32_t srcsize) {
+  pthread_once(&kernel_once, select_kernels);
+  if (kernel < 0 || kernel >= nkernels) {
+    return -1;
+  }
+  return kernels[kernel].cratio(src, srcsize, 3, 3);
+}
+
+// The shortest input the probe can scan
+#define PROBE_MIN_LEN 16
+
+// Estimate the cratio with the widest kernel
+static float get_cratio(const uint8_t *ibase, int maxlen, int minlen, int ipshift) {
+  pthread_once(&kernel_once, select_kernels);
+  return kernels[nkernels - 1].cratio(ibase, maxlen, minlen, ipshift);
+}
+
 static int encoder(const uint8_t *input, int32_t input_len,
                    uint8_t *output, int32_t output_len,
                    uint8_t meta,
@@ -211,29 +464,550 @@ void register_entropy_codec(blosc2_codec *codec) {
 }
 
 
-// Get entropy speed for a zeros chunk
-float get_zeros_speed(int32_t chunksize) {
+// Virtual filters, applied to a window of the probe into a scratch buffer
+
+// Shuffle the n items of typesize bytes in src, and apply bytedelta to every byte
+// plane if delta (both in a single pass).  The remainder bytes are copied.
+static void shuffle_window(const uint8_t *src, int32_t len, int32_t typesize, bool delta,
+                           uint8_t *dest) {
+  int32_t n = len / typesize;
+  for (int32_t p = 0; p < typesize; p++) {
+    const uint8_t *ip = src + p;
+    uint8_t *op = dest + p * n;
+    uint8_t prev = 0;
+    for (int32_t j = 0; j < n; j++) {
+      uint8_t x = ip[j * typesize];
+      op[j] = delta ? (uint8_t)(x - prev) : x;
+      prev = x;
+    }
+  }
+  memcpy(dest + n * typesize, src + n * typesize, len - n * typesize);
+}
+
+// Transpose the 8x8 bit matrix made of the 8 bytes of x
+static inline uint64_t transpose_bits(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// Bitshuffle the items of typesize bytes in src, in groups of 8 items as blosc2
+// does.  The remainder bytes are copied.
+static void bitshuffle_window(const uint8_t *src, int32_t len, int32_t typesize, uint8_t *dest) {
+  int32_t n = (len / typesize) & ~7;
+  int32_t nrow = n / 8;
+  for (int32_t j = 0; j < nrow; j++) {
+    const uint8_t *ip = src + j * 8 * typesize;
+    for (int32_t p = 0; p < typesize; p++) {
+      // Byte p of the 8 items of the group
+      uint64_t x = 0;
+      for (int k = 0; k < 8; k++) {
+        x |= (uint64_t)ip[k * typesize + p] << (8 * k);
+      }
+      x = transpose_bits(x);
+      // Bit b of the 8 items goes to the row of bit plane (p, b)
+      uint8_t *op = dest + p * 8 * nrow + j;
+      for (int b = 0; b < 8; b++) {
+        op[b * nrow] = (uint8_t)(x >> (8 * b));
+      }
+    }
+  }
+  memcpy(dest + n * typesize, src + n * typesize, len - n * typesize);
+}
+
+// Add the estimated compressed size of a window after every filter to outsizes
+// (but the one without filters)
+static void probe_filters(const uint8_t *window, int32_t len, int32_t typesize, float cratio,
+                          double *outsizes) {
+  uint8_t scratch[ENTROPY_PROBE_MAX_WINDOW];
+  if (typesize > 1 && typesize <= len) {
+    shuffle_window(window, len, typesize, false, scratch);
+    outsizes[ENTROPY_PROBE_SHUFFLE] += len / get_cratio(scratch, len, 3, 3);
+  }
+  else {
+    // Shuffling bytes does nothing
+    outsizes[ENTROPY_PROBE_SHUFFLE] += len / cratio;
+  }
+  if (typesize <= len / 8) {
+    bitshuffle_window(window, len, typesize, scratch);
+    outsizes[ENTROPY_PROBE_BITSHUFFLE] += len / get_cratio(scratch, len, 3, 3);
+  }
+  else {
+    outsizes[ENTROPY_PROBE_BITSHUFFLE] += len / cratio;
+  }
+  shuffle_window(window, len, (typesize <= len) ? typesize : 1, true, scratch);
+  outsizes[ENTROPY_PROBE_BYTEDELTA] += len / get_cratio(scratch, len, 3, 3);
+}
+
+
+// Codec family proxies: a greedy LZ parse of sampled windows, with the cost of
+// its literals and matches in the formats of every codec family
+
+// Size of the windows sampled by the proxies (the window of deflate)
+#define PROXY_WINDOW (32 * 1024)
+#define PROXY_HASH_LOG 14U
+// Shortest match of the parse
+#define PROXY_MINMATCH 4
+// Number of symbols of the deflate literal/length alphabet, and of its distance alphabet
+#define DEFLATE_NLITLEN (256 + 29)
+#define DEFLATE_NDIST 30
+// Number of symbols of the zstd literal length, match length and offset codes
+#define ZSTD_NLL 36
+#define ZSTD_NML 53
+#define ZSTD_NOF 32
+
+typedef struct {
+  uint32_t litlen[DEFLATE_NLITLEN];
+  // Histogram of the literal bytes, followed by the one of the deflate length codes
+  uint32_t dist[DEFLATE_NDIST];
+  // Histogram of the deflate distance codes
+  uint32_t ll[ZSTD_NLL];
+  uint32_t ml[ZSTD_NML];
+  uint32_t of[ZSTD_NOF];
+  // Histograms of the zstd sequence codes
+  uint64_t nliterals;
+  // Number of literals
+  double lz4_bytes;
+  // Size of the sequences (token, offset and lengths) in the LZ4 format
+  double zlib_extra;
+  double zstd_extra;
+  // Extra bits of the length and distance codes, which are not entropy coded
+} proxy_stats;
+
+static int compare_counts(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Size in bits of the nsymbols of hist coded with an order-0 Huffman code (the
+// sum of the weights of the internal nodes of the tree), plus its description
+static double huffman_bits(const uint32_t *hist, int nsymbols) {
+  uint32_t leaves[DEFLATE_NLITLEN];
+  int n = 0;
+  for (int i = 0; i < nsymbols; i++) {
+    if (hist[i] > 0) {
+      leaves[n++] = hist[i];
+    }
+  }
+  if (n <= 1) {
+    // A single symbol is stored as a run
+    return 8 * n;
+  }
+  qsort(leaves, n, sizeof(uint32_t), compare_counts);
+  // Two-queue construction: the sorted leaves, and the internal nodes (created in order)
+  uint64_t nodes[DEFLATE_NLITLEN];
+  int li = 0, ni = 0, nn = 0;
+  double bits = 0;
+  for (int k = 0; k < n - 1; k++) {
+    uint64_t pair[2];
+    for (int j = 0; j < 2; j++) {
+      if (ni == nn || (li < n && leaves[li] <= nodes[ni])) {
+        pair[j] = leaves[li++];
+      }
+      else {
+        pair[j] = nodes[ni++];
+      }
+    }
+    nodes[nn++] = pair[0] + pair[1];
+    bits += (double)(pair[0] + pair[1]);
+  }
+  // About 4 bits to describe the code length of every symbol
+  return bits + 4 * n;
+}
+
+static inline int log2_floor(uint32_t x) {
+  int n = 0;
+  while (x >>= 1) {
+    n++;
+  }
+  return n;
+}
+
+// Bytes of an LZ4 length field beyond the 4 bits of the token
+static inline int lz4_extra(int32_t len) {
+  return (len >= 15) ? 1 + (len - 15) / 255 : 0;
+}
+
+// Bucket a length as deflate and zstd do: direct codes up to ndirect, and then
+// 2^shift codes per power of two, with the remaining bits as extra bits
+static inline int length_code(uint32_t len, uint32_t ndirect, int shift, int *extra) {
+  if (len < ndirect) {
+    *extra = 0;
+    return (int)len;
+  }
+  int nb = log2_floor(len);
+  *extra = nb - shift;
+  int code = (int)ndirect + ((nb - log2_floor(ndirect)) << shift) +
+             (int)((len >> *extra) & ((1U << shift) - 1));
+  return code;
+}
+
+static void proxy_sequence(proxy_stats *stats, int32_t litlen, int32_t mlen, int32_t dist,
+                           int32_t *rep) {
+  int extra;
+  // LZ4: token, 2-byte offset and extra length bytes (the literals are counted apart)
+  stats->lz4_bytes += 1 + 2 + lz4_extra(litlen) + lz4_extra(mlen - PROXY_MINMATCH);
+
+  // Deflate: length and distance codes, with matches longer than 258 bytes split
+  for (int32_t left = mlen; left > 0; left -= 258) {
+    int32_t len = (left > 258) ? 258 : left;
+    if (len < 3) {
+      break;
+    }
+    int code = length_code((uint32_t)(len - 3), 8, 2, &extra);
+    stats->litlen[256 + ((code < 28) ? code : 28)]++;
+    stats->zlib_extra += extra;
+    code = length_code((uint32_t)(dist - 1), 4, 1, &extra);
+    stats->dist[(code < DEFLATE_NDIST) ? code : DEFLATE_NDIST - 1]++;
+    stats->zlib_extra += extra;
+  }
+
+  // Zstd: literal length, match length and offset codes, with a repeat offset
+  int code = length_code((uint32_t)litlen, 16, 0, &extra);
+  stats->ll[(code < ZSTD_NLL) ? code : ZSTD_NLL - 1]++;
+  stats->zstd_extra += extra;
+  code = length_code((uint32_t)(mlen - 3), 32, 0, &extra);
+  stats->ml[(code < ZSTD_NML) ? code : ZSTD_NML - 1]++;
+  stats->zstd_extra += extra;
+  if (dist == *rep) {
+    stats->of[0]++;
+  }
+  else {
+    code = log2_floor((uint32_t)(dist + 3));
+    stats->of[code]++;
+    stats->zstd_extra += code;
+    *rep = dist;
+  }
+}
+
+static void proxy_window(const uint8_t *ibase, int32_t len, proxy_stats *stats) {
+  uint16_t htab[1U << PROXY_HASH_LOG];
+  // Positions are stored plus one, so that 0 means empty
+  memset(htab, 0, sizeof(htab));
+  int32_t ip = 0;
+  int32_t anchor = 0;
+  int32_t rep = 0;
+  int32_t limit = len - PROXY_MINMATCH;
+  while (ip <= limit) {
+    uint32_t seq;
+    memcpy(&seq, ibase + ip, 4);
+    uint32_t hval;
+    HASH_FUNCTION(hval, seq, PROXY_HASH_LOG)
+    int32_t ref = (int32_t)htab[hval] - 1;
+    htab[hval] = (uint16_t)(ip + 1);
+    uint32_t refseq;
+    if (ref < 0 || (memcpy(&refseq, ibase + ref, 4), refseq != seq)) {
+      ip++;
+      continue;
+    }
+    int32_t mlen = PROXY_MINMATCH;
+    while (ip + mlen < len && ibase[ref + mlen] == ibase[ip + mlen]) {
+      mlen++;
+    }
+    for (int32_t i = anchor; i < ip; i++) {
+      stats->litlen[ibase[i]]++;
+    }
+    stats->nliterals += ip - anchor;
+    proxy_sequence(stats, ip - anchor, mlen, ip - ref, &rep);
+    ip += mlen;
+    anchor = ip;
+  }
+  // Last literals
+  for (int32_t i = anchor; i < len; i++) {
+    stats->litlen[ibase[i]]++;
+  }
+  stats->nliterals += len - anchor;
+  stats->lz4_bytes += 1 + lz4_extra(len - anchor);
+}
+
+int entropy_probe_codecs(const uint8_t *src, int32_t srcsize, int32_t sample_size, float *cratios) {
+  if (src == NULL || srcsize < PROBE_MIN_LEN) {
+    return -1;
+  }
+  int32_t window = (srcsize < PROXY_WINDOW) ? srcsize : PROXY_WINDOW;
+  int32_t nwindows = sample_size / window;
+  if (nwindows < 1) {
+    nwindows = 1;
+  }
+  if (nwindows > srcsize / window) {
+    nwindows = srcsize / window;
+  }
+  proxy_stats *stats = calloc(1, sizeof(proxy_stats));
+  if (stats == NULL) {
+    return -1;
+  }
+  double insize = 0;
+  double blosclz_bytes = 0;
+  for (int32_t w = 0; w < nwindows; w++) {
+    // Windows at the start of nwindows equal strata
+    const uint8_t *ibase = src + (int64_t)w * (srcsize / nwindows);
+    proxy_window(ibase, window, stats);
+    // BloscLZ is the probe itself, on the part of the window it can scan
+    int32_t blen = (window < ENTROPY_PROBE_MAX_WINDOW) ? window : ENTROPY_PROBE_MAX_WINDOW;
+    blosclz_bytes += window / get_cratio(ibase, blen, 3, 3);
+    insize += window;
+  }
+  double literal_bits = huffman_bits(stats->litlen, 256);
+  double lz4_bytes = stats->nliterals + stats->lz4_bytes;
+  double zlib_bytes = (huffman_bits(stats->litlen, DEFLATE_NLITLEN) +
+                       huffman_bits(stats->dist, DEFLATE_NDIST) + stats->zlib_extra) / 8;
+  double zstd_bytes = (literal_bits + huffman_bits(stats->ll, ZSTD_NLL) +
+                       huffman_bits(stats->ml, ZSTD_NML) + huffman_bits(stats->of, ZSTD_NOF) +
+                       stats->zstd_extra) / 8;
+  free(stats);
+  // A window which does not compress is stored as is
+  cratios[ENTROPY_PROBE_BLOSCLZ] = (float)(insize / blosclz_bytes);
+  cratios[ENTROPY_PROBE_LZ4] = (float)(insize / ((lz4_bytes < insize) ? lz4_bytes : insize));
+  cratios[ENTROPY_PROBE_ZLIB] = (float)(insize / ((zlib_bytes < insize) ? zlib_bytes : insize));
+  cratios[ENTROPY_PROBE_ZSTD] = (float)(insize / ((zstd_bytes < insize) ? zstd_bytes : insize));
+  return 0;
+}
+
+int entropy_probe_rank_codecs(const uint8_t *src, int32_t srcsize, int32_t sample_size,
+                              entropy_probe_rank *ranking) {
+  static const int compcodes[ENTROPY_PROBE_NCODECS] = {
+    BLOSC_BLOSCLZ, BLOSC_LZ4, BLOSC_ZLIB, BLOSC_ZSTD,
+  };
+  float cratios[ENTROPY_PROBE_NCODECS];
+  int rc = entropy_probe_codecs(src, srcsize, sample_size, cratios);
+  if (rc < 0) {
+    return rc;
+  }
+  // Insertion sort, best first
+  for (int i = 0; i < ENTROPY_PROBE_NCODECS; i++) {
+    int j = i;
+    while (j > 0 && ranking[j - 1].cratio < cratios[i]) {
+      ranking[j] = ranking[j - 1];
+      j--;
+    }
+    ranking[j].compcode = compcodes[i];
+    ranking[j].cratio = cratios[i];
+  }
+  return ENTROPY_PROBE_NCODECS;
+}
+
+
+// Direct probing of the blocks of a buffer, on a process-wide thread pool
+
+// Maximum number of threads probing the blocks of a buffer
+#define PROBE_MAX_THREADS 8
+// Minimum number of blocks for a helper thread to be worth waking up
+#define PROBE_MIN_BLOCKS_PER_THREAD 4
+
+typedef struct {
+  const uint8_t *src;
+  int32_t srcsize;
+  int32_t blocksize;
+  int nblocks;
+  entropy_probe_sampling sampling;
+  entropy_probe_block *results;
+  int next;
+  // The next block to probe (atomic)
+  int nhelpers;
+  // Number of helper threads still wanted for the job
+  int active;
+  // Number of helper threads working on the job
+} probe_job;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes the jobs, a caller finding the pool busy probes on its own
+static pthread_mutex_t pool_submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static probe_job *pool_job = NULL;
+static int pool_nhelpers = 0;
+
+// Place the window w of the nwindows ones of a block, and return its start
+static int32_t place_window(const entropy_probe_sampling *sampling, int32_t bsize, int nwindows,
+                            int w, uint32_t *seed, int32_t *len_out) {
+  int32_t stratum = bsize / nwindows;
+  int32_t start = w * stratum;
+  int32_t len = (w == nwindows - 1) ? bsize - start : stratum;
+  if (len > sampling->window_size) {
+    if (sampling->random) {
+      // xorshift, seeded with the block index so that estimates are reproducible
+      *seed ^= *seed << 13;
+      *seed ^= *seed >> 17;
+      *seed ^= *seed << 5;
+      start += (int32_t)(*seed % (uint32_t)(len - sampling->window_size + 1));
+    }
+    len = sampling->window_size;
+  }
+  *len_out = len;
+  return start;
+}
+
+static void probe_block(const probe_job *job, int i) {
+  const uint8_t *block = job->src + (int64_t)i * job->blocksize;
+  int32_t bsize = job->srcsize - i * job->blocksize;
+  if (bsize > job->blocksize) {
+    bsize = job->blocksize;
+  }
+  entropy_probe_block *result = &job->results[i];
+  result->special = memcmp(block, block + 1, bsize - 1) == 0;
+  if (result->special || bsize < PROBE_MIN_LEN) {
+    // Too short for the probe, count it as incompressible
+    result->cratio = result->special ? 0 : 1;
+    result->cspeed = 0;
+    for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+      result->filter_cratio[f] = result->cratio;
+    }
+    return;
+  }
+  const entropy_probe_sampling *sampling = &job->sampling;
+  // Probe one window per stratum, and add up their (estimated) compressed sizes
+  double insize = 0;
+  double outsize = 0;
+  // Strata shorter than the minimum the probe needs are merged
+  int nwindows = (sampling->nwindows < bsize / 16) ? sampling->nwindows : bsize / 16;
+  uint32_t seed = 2654435761U * (uint32_t)(i + 1);
   blosc_timestamp_t t0, t1;
-  // Build artificial zeros chunk
-  uint8_t *zeros_chunk = (uint8_t *) malloc(chunksize);
-  memset(zeros_chunk, 0, chunksize);
-  // Compress
-  uint8_t *cdata = (uint8_t *) malloc(chunksize + BLOSC2_MAX_OVERHEAD);
-  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
-  cparams.nthreads = 4;
-  blosc2_context *cctx = blosc2_create_cctx(cparams);
   blosc_set_timestamp(&t0);
-  int csize = blosc2_compress_ctx(cctx, zeros_chunk, chunksize, cdata, chunksize + BLOSC2_MAX_OVERHEAD);
+  for (int w = 0; w < nwindows; w++) {
+    int32_t len;
+    int32_t start = place_window(sampling, bsize, nwindows, w, &seed, &len);
+    // minlen and ipshift as in the entropy_probe codec
+    float cratio = get_cratio(block + start, len, 3, 3);
+    insize += len;
+    outsize += len / cratio;
+  }
   blosc_set_timestamp(&t1);
-  blosc2_free_ctx(cctx);
+  result->cratio = (float) (insize / outsize);
+  double secs = blosc_elapsed_secs(t0, t1);
+  // The time the probe would have taken on the start of the block only,
+  // so that the speed does not depend on the sampling
+  int32_t first = (bsize < ENTROPY_PROBE_MAX_WINDOW) ? bsize : ENTROPY_PROBE_MAX_WINDOW;
+  secs *= first / insize;
+  // Guard against the resolution of the clock
+  result->cspeed = (float) bsize / (float) ((secs > 1e-9) ? secs : 1e-9);
+
+  // Probe the same windows after every filter (out of the timing above)
+  for (int f = 0; f < ENTROPY_PROBE_NFILTERS; f++) {
+    result->filter_cratio[f] = result->cratio;
+  }
+  if (sampling->typesize > 0) {
+    double outsizes[ENTROPY_PROBE_NFILTERS] = {0};
+    seed = 2654435761U * (uint32_t)(i + 1);
+    for (int w = 0; w < nwindows; w++) {
+      int32_t len;
+      int32_t start = place_window(sampling, bsize, nwindows, w, &seed, &len);
+      probe_filters(block + start, len, sampling->typesize, result->cratio, outsizes);
+    }
+    for (int f = ENTROPY_PROBE_SHUFFLE; f < ENTROPY_PROBE_NFILTERS; f++) {
+      result->filter_cratio[f] = (float) (insize / outsizes[f]);
+    }
+  }
+}
 
-  free(zeros_chunk);
-  free(cdata);
+static void run_job(probe_job *job) {
+  while (true) {
+    int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->nblocks) {
+      break;
+    }
+    probe_block(job, i);
+  }
+}
+
+static void * pool_thread(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&pool_lock);
+  while (true) {
+    while (pool_job == NULL || pool_job->nhelpers == 0) {
+      pthread_cond_wait(&pool_work, &pool_lock);
+    }
+    probe_job *job = pool_job;
+    job->nhelpers--;
+    job->active++;
+    pthread_mutex_unlock(&pool_lock);
+
+    run_job(job);
+
+    pthread_mutex_lock(&pool_lock);
+    job->active--;
+    if (job->active == 0) {
+      pthread_cond_broadcast(&pool_done);
+    }
+  }
+  return NULL;
+}
+
+static void pool_start(void) {
+  long ncores = 4;
+#if defined(_SC_NPROCESSORS_ONLN)
+  ncores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  int nthreads = (ncores > PROBE_MAX_THREADS) ? PROBE_MAX_THREADS : (int) ncores;
+  // The caller is one of the threads
+  for (int i = 0; i < nthreads - 1; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    pool_nhelpers++;
+  }
+}
 
-  if (csize < 0) {
-    fprintf(stderr, "Error %d compressing zeros chunk\n", csize);
-    return csize;
+int entropy_probe_blocks(const uint8_t *src, int32_t srcsize, int32_t blocksize,
+                         const entropy_probe_sampling *sampling, entropy_probe_block *results) {
+  if (src == NULL || srcsize <= 0 || blocksize <= 0) {
+    return -1;
+  }
+  probe_job job = {0};
+  job.src = src;
+  job.srcsize = srcsize;
+  job.blocksize = blocksize;
+  job.sampling.nwindows = 1;
+  job.sampling.window_size = ENTROPY_PROBE_MAX_WINDOW;
+  if (sampling != NULL) {
+    job.sampling = *sampling;
+    if (job.sampling.nwindows < 1) {
+      job.sampling.nwindows = 1;
+    }
+    if (job.sampling.window_size < 16 || job.sampling.window_size > ENTROPY_PROBE_MAX_WINDOW) {
+      job.sampling.window_size = ENTROPY_PROBE_MAX_WINDOW;
+    }
   }
+  job.nblocks = (int) ((srcsize + (int64_t) blocksize - 1) / blocksize);
+  job.results = results;
 
-  return (float) chunksize / (float) blosc_elapsed_secs(t0, t1);
+  int nhelpers = job.nblocks / PROBE_MIN_BLOCKS_PER_THREAD - 1;
+  if (nhelpers > 0) {
+    pthread_once(&pool_once, pool_start);
+  }
+  if (nhelpers > pool_nhelpers) {
+    nhelpers = pool_nhelpers;
+  }
+  if (nhelpers <= 0 || pthread_mutex_trylock(&pool_submit_lock) != 0) {
+    // Not worth it, or another buffer is being probed
+    run_job(&job);
+    return job.nblocks;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  job.nhelpers = nhelpers;
+  pool_job = &job;
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+
+  run_job(&job);
+
+  pthread_mutex_lock(&pool_lock);
+  // Helpers which did not wake up in time are not needed anymore
+  job.nhelpers = 0;
+  while (job.active > 0) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pool_job = NULL;
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_unlock(&pool_submit_lock);
+  return job.nblocks;
 }
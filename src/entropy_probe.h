@@ -10,7 +10,101 @@ extern "C" {
 #define ENTROPY_PROBE_ID 244
 void register_entropy_codec(blosc2_codec *codec);
 #define FILTER_STOP 3
-float get_zeros_speed(int32_t chunksize);
+
+// The filters whose effect the probe can estimate
+typedef enum {
+  ENTROPY_PROBE_NOFILTER,
+  ENTROPY_PROBE_SHUFFLE,
+  ENTROPY_PROBE_BITSHUFFLE,
+  ENTROPY_PROBE_BYTEDELTA,
+  // Shuffle followed by bytedelta
+  ENTROPY_PROBE_NFILTERS,
+} entropy_probe_filter;
+
+// The features of a block given by the entropy probe
+typedef struct {
+  float cratio;
+  // The estimated compression ratio
+  float cspeed;
+  // The speed of the probe, in bytes/s
+  bool special;
+  // Whether the block is a run of a single value
+  float filter_cratio[ENTROPY_PROBE_NFILTERS];
+  // The estimated compression ratio after every filter (only with a sampling typesize)
+} entropy_probe_block;
+
+// The largest window the probe can scan with a single hash table
+#define ENTROPY_PROBE_MAX_WINDOW 8192
+
+// Where the probe looks into every block
+typedef struct {
+  int nwindows;
+  // Number of windows per block, one in each of nwindows equal strata of the block
+  int window_size;
+  // The size of every window, at most ENTROPY_PROBE_MAX_WINDOW
+  bool random;
+  // Whether the windows are at a (reproducible) random offset of their stratum, instead of its start
+  int32_t typesize;
+  // If > 0, the windows are also probed after every filter, with this typesize
+} entropy_probe_sampling;
+
+/*
+ * Run the entropy probe directly on every block of src, without going through
+ * a blosc2 compression and decompression.  The blocks are spread over an
+ * internal thread pool, sized after the number of blocks and cores.
+ * If sampling is NULL, only the start of every block is probed.
+ * results must have room for (srcsize + blocksize - 1) / blocksize entries.
+ * Returns the number of blocks, or a negative value on error.
+ */
+int entropy_probe_blocks(const uint8_t *src, int32_t srcsize, int32_t blocksize,
+                         const entropy_probe_sampling *sampling, entropy_probe_block *results);
+
+// The codec families whose cratio the probe can estimate
+typedef enum {
+  ENTROPY_PROBE_BLOSCLZ,
+  ENTROPY_PROBE_LZ4,
+  ENTROPY_PROBE_ZLIB,
+  ENTROPY_PROBE_ZSTD,
+  ENTROPY_PROBE_NCODECS,
+} entropy_probe_codec;
+
+/*
+ * Estimate the cratio every codec family would reach on src, with a greedy LZ
+ * parse of windows spread over it (sample_size bytes in all).  BloscLZ is the
+ * estimate of the probe itself, LZ4 is costed by its literals and sequences, and
+ * ZLIB and ZSTD add an order-0 Huffman code for the literals.  cratios must have room for ENTROPY_PROBE_NCODECS
+ * entries.  Returns 0, or a negative value on error or when src is too short to
+ * probe (less than 16 bytes).
+ */
+int entropy_probe_codecs(const uint8_t *src, int32_t srcsize, int32_t sample_size, float *cratios);
+
+// A blosc2 codec, and its estimated cratio
+typedef struct {
+  int compcode;
+  float cratio;
+} entropy_probe_rank;
+
+/*
+ * Rank the codecs by the cratio estimated by entropy_probe_codecs, best first.
+ * ranking must have room for ENTROPY_PROBE_NCODECS entries.
+ * Returns the number of codecs ranked, or a negative value on error.
+ */
+int entropy_probe_rank_codecs(const uint8_t *src, int32_t srcsize, int32_t sample_size,
+                              entropy_probe_rank *ranking);
+
+// The name of the vectorized kernels used by the probe on this CPU
+const char * entropy_probe_kernel_name(void);
+
+/*
+ * The kernels compiled in which this CPU supports, the scalar one (index 0) first and
+ * the one used by the probe last.  They must give identical estimates, which
+ * tests/test_probe_kernels.c checks with entropy_probe_kernel_cratio.
+ */
+int entropy_probe_nkernels(void);
+const char * entropy_probe_kernel_name_at(int kernel);
+
+// Estimate the cratio of the first ENTROPY_PROBE_MAX_WINDOW bytes of src with the given kernel
+float entropy_probe_kernel_cratio(int kernel, const uint8_t *src, int32_t srcsize);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,234 @@
+/**********************************************************************
+  Check the readers of the CPUs available to the process on fixture trees of
+  the sysfs, cgroup (v1 and v2) and proc files of Linux, and the ceiling of
+  threads derived from them.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "btune_cpus.h"
+
+#define MB (1024 * 1024)
+
+static int nfailed = 0;
+static int nchecked = 0;
+
+static void check(const char *what, double value, double expected) {
+  nchecked++;
+  if (value < expected - 1e-6 || value > expected + 1e-6) {
+    fprintf(stderr, "FAILED: %s is %g, expected %g\n", what, value, expected);
+    nfailed++;
+  }
+}
+
+// Write the file root/path, creating its directories
+static void write_file(const char *root, const char *path, const char *content) {
+  char fname[1024];
+  snprintf(fname, sizeof(fname), "%s/%s", root, path);
+  for (char *slash = strchr(fname + strlen(root) + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(fname, 0755);
+    *slash = '/';
+  }
+  FILE *file = fopen(fname, "w");
+  if (file == NULL) {
+    fprintf(stderr, "FAILED: cannot write %s\n", fname);
+    nfailed++;
+    return;
+  }
+  fprintf(file, "%s\n", content);
+  fclose(file);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  return remove(path);
+}
+
+static void make_root(char *root) {
+  const char *tmpdir = getenv("TMPDIR");
+  snprintf(root, 256, "%s/test_cpus.XXXXXX", (tmpdir != NULL) ? tmpdir : "/tmp");
+  if (mkdtemp(root) == NULL) {
+    fprintf(stderr, "FAILED: cannot create %s\n", root);
+    exit(1);
+  }
+}
+
+static void remove_root(const char *root) {
+  nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * The sysfs of ncpus CPUs whose SMT siblings are smt CPUs apart (0 for no SMT), with
+ * a level 1, 2 and 3 cache, the L3 shared by l3_cpus consecutive cores (and their
+ * siblings) and of l3_size.
+ */
+static void write_sysfs(const char *root, int ncpus, int smt, int l3_cpus, const char *l3_size) {
+  char path[256];
+  char list[64];
+  snprintf(list, sizeof(list), "0-%d", ncpus - 1);
+  write_file(root, "sys/devices/system/cpu/online", list);
+  int ncores = (smt > 0) ? smt : ncpus;
+  for (int cpu = 0; cpu < ncpus; cpu++) {
+    int core = cpu % ncores;
+    snprintf(path, sizeof(path), "sys/devices/system/cpu/cpu%d/topology/core_cpus_list", cpu);
+    if (smt > 0) {
+      snprintf(list, sizeof(list), "%d,%d", core, core + smt);
+    } else {
+      snprintf(list, sizeof(list), "%d", cpu);
+    }
+    write_file(root, path, list);
+    for (int index = 0; index < 3; index++) {
+      snprintf(path, sizeof(path), "sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+      write_file(root, path, (index == 2) ? "3" : (index == 1) ? "2" : "1");
+    }
+    snprintf(path, sizeof(path), "sys/devices/system/cpu/cpu%d/cache/index2/size", cpu);
+    write_file(root, path, l3_size);
+    int first = core - core % l3_cpus;
+    if (smt > 0) {
+      snprintf(list, sizeof(list), "%d-%d,%d-%d", first, first + l3_cpus - 1, first + smt,
+               first + smt + l3_cpus - 1);
+    } else {
+      snprintf(list, sizeof(list), "%d-%d", first, first + l3_cpus - 1);
+    }
+    snprintf(path, sizeof(path), "sys/devices/system/cpu/cpu%d/cache/index2/shared_cpu_list", cpu);
+    write_file(root, path, list);
+  }
+}
+
+static void read_cpus(const char *root, const char *affinity, btune_cpus *cpus) {
+  nchecked++;
+  if (btune_cpus_read(root, affinity, cpus) < 0) {
+    fprintf(stderr, "FAILED: reading the CPUs %s\n", affinity);
+    nfailed++;
+    memset(cpus, 0, sizeof(*cpus));
+  }
+}
+
+// 8 CPUs on 4 cores with SMT and one L3, in a cgroup v2 nested in one with a quota of 2 CPUs
+static void check_v2(void) {
+  char root[256];
+  make_root(root);
+  write_sysfs(root, 8, 4, 4, "32768K");
+  write_file(root, "proc/self/cgroup", "0::/user.slice/job");
+  write_file(root, "proc/loadavg", "3.50 2.00 1.00 4/500 1234");
+  write_file(root, "sys/fs/cgroup/cpu.max", "max 100000");
+  write_file(root, "sys/fs/cgroup/user.slice/cpu.max", "200000 100000");
+  write_file(root, "sys/fs/cgroup/user.slice/job/cpu.max", "max 100000");
+
+  btune_cpus cpus;
+  read_cpus(root, "0-7", &cpus);
+  check("v2 online", cpus.online, 8);
+  check("v2 affinity", cpus.affinity, 8);
+  check("v2 cores", cpus.cores, 4);
+  check("v2 L3 cores", cpus.l3_cores, 4);
+  check("v2 L3 size", (double) cpus.l3_size, 32 * MB);
+  check("v2 quota of the parent", cpus.quota, 2);
+  check("v2 load average", cpus.loadavg, 3.5);
+  // The quota is the limit, when the whole load is the one of the process
+  check("v2 ceiling without other load", btune_cpus_ceiling(&cpus, 0, 3.5f), 2);
+  check("v2 ceiling with other load", btune_cpus_ceiling(&cpus, 0, 0), 1);
+
+  // Affinity masks with and without SMT siblings
+  read_cpus(root, "0,4", &cpus);
+  check("v2 affinity of two siblings", cpus.affinity, 2);
+  check("v2 cores of two siblings", cpus.cores, 1);
+  read_cpus(root, "0-1,4", &cpus);
+  check("v2 affinity of a list", cpus.affinity, 3);
+  check("v2 cores of a list", cpus.cores, 2);
+
+  // Malformed and empty affinity lists
+  btune_cpus dummy;
+  const char *malformed[] = {"0-", "a", "1,,2", "3-1", ""};
+  for (int i = 0; i < (int) (sizeof(malformed) / sizeof(malformed[0])); i++) {
+    nchecked++;
+    if (btune_cpus_read(root, malformed[i], &dummy) >= 0) {
+      fprintf(stderr, "FAILED: accepted the CPU list \"%s\"\n", malformed[i]);
+      nfailed++;
+    }
+  }
+  remove_root(root);
+}
+
+// A cgroup v2 namespace without quota, and nested quotas whose child is the tighter one
+static void check_v2_nested(void) {
+  char root[256];
+  make_root(root);
+  write_sysfs(root, 4, 0, 4, "8M");
+  write_file(root, "proc/self/cgroup", "0::/");
+  write_file(root, "sys/fs/cgroup/cpu.max", "max 100000");
+  btune_cpus cpus;
+  read_cpus(root, "0-3", &cpus);
+  check("v2 max quota", cpus.quota, 0);
+  check("v2 cores without SMT", cpus.cores, 4);
+  check("v2 L3 size in MB", (double) cpus.l3_size, 8 * MB);
+  check("v2 unknown load average", cpus.loadavg, -1);
+  check("v2 ceiling without quota nor load", btune_cpus_ceiling(&cpus, 0, 0), 4);
+
+  write_file(root, "proc/self/cgroup", "0::/a/b");
+  write_file(root, "sys/fs/cgroup/a/cpu.max", "400000 100000");
+  write_file(root, "sys/fs/cgroup/a/b/cpu.max", "150000 100000");
+  read_cpus(root, "0-3", &cpus);
+  check("v2 quota of the child", cpus.quota, 1.5);
+  check("v2 ceiling of a fractional quota", btune_cpus_ceiling(&cpus, 0, 0), 1);
+  remove_root(root);
+}
+
+// A cgroup v1 cpu controller, with a quota in the cgroup of the process and none above
+static void check_v1(void) {
+  char root[256];
+  make_root(root);
+  write_sysfs(root, 8, 0, 4, "8192K");
+  write_file(root, "proc/self/cgroup", "5:memory:/docker/abc\n4:cpu,cpuacct:/docker/abc");
+  write_file(root, "proc/loadavg", "0.00 0.00 0.00 1/100 99");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "-1");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", "100000");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/docker/cpu.cfs_quota_us", "-1");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/docker/cpu.cfs_period_us", "100000");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/docker/abc/cpu.cfs_quota_us", "300000");
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/docker/abc/cpu.cfs_period_us", "100000");
+
+  btune_cpus cpus;
+  read_cpus(root, "0-7", &cpus);
+  check("v1 quota", cpus.quota, 3);
+  check("v1 cores", cpus.cores, 8);
+  check("v1 L3 cores", cpus.l3_cores, 4);
+  check("v1 ceiling of the quota", btune_cpus_ceiling(&cpus, 0, 0), 3);
+
+  // Without quota, chunks fitting in an L3 keep the threads within its cores
+  write_file(root, "sys/fs/cgroup/cpu,cpuacct/docker/abc/cpu.cfs_quota_us", "-1");
+  read_cpus(root, "0-7", &cpus);
+  check("v1 without quota", cpus.quota, 0);
+  check("v1 ceiling of small chunks", btune_cpus_ceiling(&cpus, MB, 0), 4);
+  check("v1 ceiling of large chunks", btune_cpus_ceiling(&cpus, 8 * MB, 0), 8);
+  // The load of the other processes is counted on the share of the CPUs of the mask
+  cpus.loadavg = 6;
+  check("v1 ceiling with the load of the process", btune_cpus_ceiling(&cpus, 0, 2), 4);
+  read_cpus(root, "0-3", &cpus);
+  cpus.loadavg = 6;
+  check("v1 ceiling with the load on half the CPUs", btune_cpus_ceiling(&cpus, 0, 2), 2);
+  remove_root(root);
+}
+
+int main(void) {
+  check_v2();
+  check_v2_nested();
+  check_v1();
+  check("process time", btune_cpus_process_time() >= 0, 1);
+
+  printf("%d checks, %d failed\n", nchecked, nfailed);
+  return nfailed > 0 ? 1 : 0;
+}
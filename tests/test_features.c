@@ -0,0 +1,183 @@
+/**********************************************************************
+  Check the byte statistics of the models on buffers whose statistics are
+  known, and the parsing of the input schema of the model metadata.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btune_features.h"
+
+// Whole windows of the statistics, so that every pattern below is seen complete
+#define SIZE (64 * 1024)
+#define TOLERANCE 1e-5
+
+static int nfailed = 0;
+static int nchecked = 0;
+
+static void check(const char *what, double value, double expected) {
+  nchecked++;
+  if (fabs(value - expected) > TOLERANCE) {
+    fprintf(stderr, "FAILED: %s is %g, expected %g\n", what, value, expected);
+    nfailed++;
+  }
+}
+
+static void stats_of(const uint8_t *buf, int32_t typesize, btune_byte_stats *stats) {
+  if (btune_byte_stats_compute(buf, SIZE, typesize, SIZE, stats) < 0) {
+    fprintf(stderr, "FAILED: computing the statistics with typesize %d\n", typesize);
+    nfailed++;
+  }
+}
+
+static void check_stats(uint8_t *buf) {
+  btune_byte_stats stats;
+
+  // Every byte value equally often: 8 bits per byte, deltas of 1
+  for (int i = 0; i < SIZE; i++) {
+    buf[i] = (uint8_t) i;
+  }
+  stats_of(buf, 1, &stats);
+  check("entropy of all the byte values", stats.entropy, 1);
+  check("delta entropy of a ramp", stats.delta_entropy, 0);
+  check("zeros of all the byte values", stats.zeros, 1. / 256);
+  check("runs of all the byte values", stats.runs, 0);
+
+  // A constant
+  memset(buf, 7, SIZE);
+  stats_of(buf, 1, &stats);
+  check("entropy of a constant", stats.entropy, 0);
+  check("zeros of a constant", stats.zeros, 0);
+  // The first byte of every window has no previous one
+  check("runs of a constant", stats.runs, 1 - 1. / 4096);
+
+  // Pairs of equal bytes, two values: 1 bit per byte
+  for (int i = 0; i < SIZE; i++) {
+    buf[i] = (uint8_t) ((i / 2) % 2);
+  }
+  stats_of(buf, 1, &stats);
+  check("entropy of two values", stats.entropy, 1. / 8);
+  check("zeros of two values", stats.zeros, 0.5);
+  check("runs of pairs", stats.runs, 0.5);
+
+  // 4-byte items whose first byte takes every value and the others are 0: only
+  // one of the four byte planes has entropy (8 bits)
+  memset(buf, 0, SIZE);
+  for (int i = 0; i < SIZE; i += 4) {
+    buf[i] = (uint8_t) (i / 4);
+  }
+  stats_of(buf, 4, &stats);
+  check("plane entropy of one varying plane", stats.plane_entropy, 0.25);
+  check("zeros of one varying plane", stats.zeros, 0.75 + 0.25 / 256);
+  // The deltas are 1 in the ramp plane and 0 in the others
+  check("delta entropy of one ramp plane", stats.delta_entropy,
+        -(0.25 * log2(0.25) + 0.75 * log2(0.75)) / 8);
+  check("exponent spread of small integers", stats.exponent_spread, 0);
+
+  // Floats 1.0 and 4.0 alternating: exponents 127 and 129
+  for (int i = 0; i < SIZE / 4; i++) {
+    float value = (i % 2) ? 4.f : 1.f;
+    memcpy(buf + 4 * i, &value, 4);
+  }
+  stats_of(buf, 4, &stats);
+  check("exponent spread of 1.0 and 4.0 floats", stats.exponent_spread, 1);
+
+  // Floats with the same exponent
+  for (int i = 0; i < SIZE / 4; i++) {
+    float value = 1.f + (float) (i % 1000) / 1000;
+    memcpy(buf + 4 * i, &value, 4);
+  }
+  stats_of(buf, 4, &stats);
+  check("exponent spread of floats in [1, 2)", stats.exponent_spread, 0);
+
+  // Doubles 1.0, 2.0, 4.0 and 8.0 in turn: exponents 1023 to 1026
+  for (int i = 0; i < SIZE / 8; i++) {
+    double value = (double) (1 << (i % 4));
+    memcpy(buf + 8 * i, &value, 8);
+  }
+  stats_of(buf, 8, &stats);
+  check("exponent spread of 1.0 to 8.0 doubles", stats.exponent_spread, sqrt(1.25));
+
+  nchecked++;
+  if (btune_byte_stats_compute(buf, 0, 1, SIZE, &stats) >= 0) {
+    fprintf(stderr, "FAILED: statistics of an empty buffer\n");
+    nfailed++;
+  }
+}
+
+// Parse an input schema, returning the code of btune_input_schema_read
+static int read_schema(const char *text, btune_input_schema *schema) {
+  json_value *json = json_parse(text, strlen(text));
+  if (json == NULL) {
+    fprintf(stderr, "FAILED: cannot parse %s\n", text);
+    nfailed++;
+    return 0;
+  }
+  btune_input_schema_default(schema);
+  int rc = btune_input_schema_read(json, schema);
+  json_value_free(json);
+  return rc;
+}
+
+static void check_rejected(const char *text) {
+  btune_input_schema schema;
+  nchecked++;
+  if (read_schema(text, &schema) >= 0) {
+    fprintf(stderr, "FAILED: accepted the schema %s\n", text);
+    nfailed++;
+  }
+}
+
+static void check_schema(void) {
+  btune_input_schema schema;
+
+  int rc = read_schema("{\"version\": 1, \"features\": [\"cratio\", \"speed\", \"tradeoff\", "
+                       "\"entropy\", \"lz4_cratio\"], \"norms\": {\"entropy\": {\"mean\": 0.5, \"std\": 2}}}",
+                       &schema);
+  check("schema read", rc, 0);
+  check("schema inputs", schema.ninputs, 5);
+  check("fourth input", schema.inputs[3], BTUNE_INPUT_ENTROPY);
+  check("fifth input", schema.inputs[4], BTUNE_INPUT_LZ4_CRATIO);
+  check("entropy mean", schema.norms[3].mean, 0.5);
+  check("entropy std", schema.norms[3].std, 2);
+  check("lz4_cratio mean", schema.norms[4].mean, 0);
+  check("lz4_cratio std", schema.norms[4].std, 1);
+  check("byte statistics needed", schema.byte_stats, 1);
+  check("filter probe needed", schema.filter_probe, 0);
+  check("codec probe needed", schema.codec_probe, 1);
+
+  // Without features, the inputs of the models without a schema are kept
+  rc = read_schema("{\"version\": 1}", &schema);
+  check("schema without features read", rc, 0);
+  check("default inputs", schema.ninputs, 3);
+  check("default third input", schema.inputs[2], BTUNE_INPUT_TRADEOFF);
+
+  char text[256];
+  snprintf(text, sizeof(text), "{\"version\": %d, \"features\": [\"cratio\"]}",
+           BTUNE_INPUT_SCHEMA_VERSION + 1);
+  check_rejected(text);
+  snprintf(text, sizeof(text), "{\"version\": %d}", BTUNE_INPUT_SCHEMA_VERSION + 1);
+  check_rejected(text);
+  check_rejected("{\"version\": 1, \"features\": [\"cratio\", \"colour\"]}");
+  check_rejected("{\"version\": 1, \"features\": [\"cratio\", 3]}");
+  check_rejected("{\"version\": 1, \"features\": [\"cratio\", \"cratio\", \"cratio\", \"cratio\", "
+                 "\"cratio\", \"cratio\", \"cratio\", \"cratio\", \"cratio\", \"cratio\", \"cratio\", "
+                 "\"cratio\", \"cratio\", \"cratio\", \"cratio\", \"cratio\", \"cratio\"]}");
+}
+
+int main(void) {
+  uint8_t *buf = malloc(SIZE);
+  check_stats(buf);
+  free(buf);
+  check_schema();
+
+  printf("%d checks, %d failed\n", nchecked, nfailed);
+  return nfailed > 0 ? 1 : 0;
+}
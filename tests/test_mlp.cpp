@@ -0,0 +1,309 @@
+/**********************************************************************
+  Check that the built-in inference engine reproduces the outputs of the
+  models: against a plain double precision evaluation of their layers and,
+  when built with TensorFlow Lite, against the TF Lite interpreter.
+
+  Usage: test_mlp <models dir> [<int8 models dir>]
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#if defined(BTUNE_USE_TFLITE)
+#include <tensorflow/lite/core/interpreter.h>
+#include <tensorflow/lite/kernels/register.h>
+#include <tensorflow/lite/model.h>
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btune_mlp.h"
+
+#define NROWS 256
+// The engine and the reference only differ in the order of the sums
+#define REFERENCE_TOLERANCE 1e-4
+// TF Lite quantizes the activations of int8 models with fixed scales, and the engine per row
+#define INT8_TOLERANCE 0.1
+
+static uint32_t next_random(uint32_t *state) {
+  *state = *state * 1664525U + 1013904223U;
+  return *state >> 8;
+}
+
+// Normalized features are mostly within a few standard deviations
+static void fill_inputs(float *inputs, int n) {
+  uint32_t state = 1;
+  for (int i = 0; i < n; i++) {
+    inputs[i] = (float)(next_random(&state) % 6001) / 1000.f - 3.f;
+  }
+}
+
+// Quantize the input of an int8 layer as the engine does, with a symmetric scale per row
+static void quantize_input(double *input, int n) {
+  float max = 0;
+  for (int i = 0; i < n; i++) {
+    max = (fabsf((float) input[i]) > max) ? fabsf((float) input[i]) : max;
+  }
+  float scale = (max > 0) ? max / 127 : 1;
+  for (int i = 0; i < n; i++) {
+    input[i] = (double) lrintf((float) input[i] / scale) * scale;
+  }
+}
+
+// Evaluate the layers of the model in double precision, with the int8 weights dequantized
+static void reference_predict(const btune_mlp *mlp, const float *inputs, int nrows, double *outputs) {
+  double *layer_input = (double *) malloc(mlp->max_width * sizeof(double));
+  double *row_input = (double *) malloc(mlp->ninputs * sizeof(double));
+  double *buffers[2];
+  buffers[0] = (double *) malloc(mlp->max_width * sizeof(double));
+  buffers[1] = (double *) malloc(mlp->max_width * sizeof(double));
+  for (int row = 0; row < nrows; row++) {
+    for (int i = 0; i < mlp->ninputs; i++) {
+      row_input[i] = inputs[row * mlp->ninputs + i];
+    }
+    const double *input = row_input;
+    double *output = NULL;
+    for (int l = 0; l < mlp->nlayers; l++) {
+      const mlp_layer *layer = &mlp->layers[l];
+      output = buffers[l % 2];
+      if (layer->qweights != NULL) {
+        memcpy(layer_input, input, layer->ninputs * sizeof(double));
+        quantize_input(layer_input, layer->ninputs);
+        input = layer_input;
+      }
+      for (int j = 0; j < layer->noutputs; j++) {
+        double value = layer->bias[j];
+        for (int i = 0; i < layer->ninputs; i++) {
+          double weight = (layer->qweights != NULL) ?
+                          (double) layer->qweights[j * layer->ninputs + i] * layer->scales[j] :
+                          (double) layer->weights[j * layer->ninputs + i];
+          value += weight * input[i];
+        }
+        switch (layer->activation) {
+          case MLP_RELU:
+            value = (value > 0) ? value : 0;
+            break;
+          case MLP_RELU6:
+            value = (value > 0) ? ((value < 6) ? value : 6) : 0;
+            break;
+          case MLP_TANH:
+            value = tanh(value);
+            break;
+          default:
+            break;
+        }
+        output[j] = value;
+      }
+      input = output;
+    }
+    double *dest = outputs + row * mlp->noutputs;
+    memcpy(dest, output, mlp->noutputs * sizeof(double));
+    if (mlp->softmax) {
+      double max = dest[0];
+      for (int j = 1; j < mlp->noutputs; j++) {
+        max = (dest[j] > max) ? dest[j] : max;
+      }
+      double sum = 0;
+      for (int j = 0; j < mlp->noutputs; j++) {
+        dest[j] = exp(mlp->softmax_beta * (dest[j] - max));
+        sum += dest[j];
+      }
+      for (int j = 0; j < mlp->noutputs; j++) {
+        dest[j] /= sum;
+      }
+    }
+  }
+  free(buffers[1]);
+  free(buffers[0]);
+  free(row_input);
+  free(layer_input);
+}
+
+#if defined(BTUNE_USE_TFLITE)
+// Run the model with the TF Lite interpreter, quantizing the inputs and outputs of int8 models
+static int tflite_predict(const char *fname, const float *inputs, int nrows, int ninputs,
+                          int noutputs, double *outputs) {
+  std::unique_ptr<tflite::FlatBufferModel> model = tflite::FlatBufferModel::BuildFromFile(fname);
+  if (model == nullptr) {
+    return -1;
+  }
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  std::unique_ptr<tflite::Interpreter> interpreter;
+  tflite::InterpreterBuilder(*model, resolver)(&interpreter);
+  if (interpreter == nullptr ||
+      interpreter->ResizeInputTensor(interpreter->inputs()[0], {nrows, ninputs}) != kTfLiteOk ||
+      interpreter->AllocateTensors() != kTfLiteOk) {
+    return -1;
+  }
+  TfLiteTensor *input_tensor = interpreter->input_tensor(0);
+  for (int i = 0; i < nrows * ninputs; i++) {
+    if (input_tensor->type == kTfLiteInt8) {
+      float value = roundf(inputs[i] / input_tensor->params.scale) + (float) input_tensor->params.zero_point;
+      input_tensor->data.int8[i] = (int8_t) ((value < -128) ? -128 : (value > 127) ? 127 : value);
+    }
+    else {
+      input_tensor->data.f[i] = inputs[i];
+    }
+  }
+  if (interpreter->Invoke() != kTfLiteOk) {
+    return -1;
+  }
+  const TfLiteTensor *output_tensor = interpreter->output_tensor(0);
+  for (int i = 0; i < nrows * noutputs; i++) {
+    if (output_tensor->type == kTfLiteInt8) {
+      outputs[i] = (double) (output_tensor->data.int8[i] - output_tensor->params.zero_point) *
+                   output_tensor->params.scale;
+    }
+    else {
+      outputs[i] = output_tensor->data.f[i];
+    }
+  }
+  return 0;
+}
+#endif
+
+static int argmax(const double *values, int n) {
+  int best = 0;
+  for (int i = 1; i < n; i++) {
+    best = (values[i] > values[best]) ? i : best;
+  }
+  return best;
+}
+
+// Compare the outputs of the engine with the expected ones.  The best category must be
+// the same, unless the expected probabilities of both are within the tolerance.
+static int compare(const char *fname, const char *against, const float *outputs,
+                   const double *expected, int nrows, int noutputs, double tolerance) {
+  int nfailed = 0;
+  double max_diff = 0;
+  double *got = (double *) malloc(noutputs * sizeof(double));
+  for (int row = 0; row < nrows; row++) {
+    const double *want = expected + row * noutputs;
+    for (int j = 0; j < noutputs; j++) {
+      got[j] = outputs[row * noutputs + j];
+      double diff = fabs(got[j] - want[j]);
+      max_diff = (diff > max_diff) ? diff : max_diff;
+    }
+    int best = argmax(got, noutputs);
+    int want_best = argmax(want, noutputs);
+    if (best != want_best && want[want_best] - want[best] > tolerance) {
+      fprintf(stderr, "FAILED: %s, row %d: category %d instead of %d (%s)\n",
+              fname, row, best, want_best, against);
+      nfailed++;
+    }
+  }
+  free(got);
+  if (max_diff > tolerance) {
+    fprintf(stderr, "FAILED: %s: outputs differ by %g from %s\n", fname, max_diff, against);
+    nfailed++;
+  }
+  printf("%s: %d rows, max difference %.3g against %s\n", fname, nrows, max_diff, against);
+  return nfailed;
+}
+
+// Quantize the weights of a float model to int8 in place, with a scale per row, so that
+// the int8 kernels are checked even without int8 model files
+static void quantize_weights(btune_mlp *mlp) {
+  for (int l = 0; l < mlp->nlayers; l++) {
+    mlp_layer *layer = &mlp->layers[l];
+    layer->qweights = (int8_t *) malloc((size_t) layer->noutputs * layer->ninputs);
+    layer->scales = (float *) malloc(layer->noutputs * sizeof(float));
+    for (int j = 0; j < layer->noutputs; j++) {
+      const float *row = layer->weights + j * layer->ninputs;
+      float max = 0;
+      for (int i = 0; i < layer->ninputs; i++) {
+        max = (fabsf(row[i]) > max) ? fabsf(row[i]) : max;
+      }
+      layer->scales[j] = (max > 0) ? max / 127 : 1;
+      for (int i = 0; i < layer->ninputs; i++) {
+        layer->qweights[j * layer->ninputs + i] = (int8_t) lrintf(row[i] / layer->scales[j]);
+      }
+    }
+    free(layer->weights);
+    layer->weights = NULL;
+  }
+  mlp->quantized = true;
+}
+
+typedef enum {
+  FLOAT_MODEL,
+  // A float model file
+  QUANTIZED_HERE,
+  // A float model file, quantized by quantize_weights
+  INT8_MODEL,
+  // An int8 model file
+} model_kind;
+
+static int check_model(const char *dirname, const char *name, model_kind kind) {
+  char fname[1024];
+  snprintf(fname, sizeof(fname), "%s/%s", dirname, name);
+  btune_mlp *mlp = btune_mlp_load(fname);
+  if (mlp == NULL) {
+    fprintf(stderr, "FAILED: cannot load %s\n", fname);
+    return 1;
+  }
+  if (mlp->quantized != (kind == INT8_MODEL)) {
+    fprintf(stderr, "FAILED: %s is not a%s model\n", fname, (kind == INT8_MODEL) ? "n int8" : " float");
+    btune_mlp_free(mlp);
+    return 1;
+  }
+  if (kind == QUANTIZED_HERE) {
+    quantize_weights(mlp);
+    strncat(fname, " (int8 weights)", sizeof(fname) - strlen(fname) - 1);
+  }
+  float *inputs = (float *) malloc(NROWS * mlp->ninputs * sizeof(float));
+  float *outputs = (float *) malloc(NROWS * mlp->noutputs * sizeof(float));
+  double *expected = (double *) malloc(NROWS * mlp->noutputs * sizeof(double));
+  fill_inputs(inputs, NROWS * mlp->ninputs);
+  btune_mlp_workspace *workspace = btune_mlp_workspace_new(mlp);
+  btune_mlp_predict(workspace, inputs, NROWS, outputs);
+  btune_mlp_workspace_free(workspace);
+
+  reference_predict(mlp, inputs, NROWS, expected);
+  int nfailed = compare(fname, "the reference", outputs, expected, NROWS, mlp->noutputs,
+                        REFERENCE_TOLERANCE);
+#if defined(BTUNE_USE_TFLITE)
+  if (kind != QUANTIZED_HERE) {
+    if (tflite_predict(fname, inputs, NROWS, mlp->ninputs, mlp->noutputs, expected) < 0) {
+      fprintf(stderr, "FAILED: cannot run %s with TF Lite\n", fname);
+      nfailed++;
+    }
+    else {
+      double tolerance = (kind == INT8_MODEL) ? INT8_TOLERANCE : REFERENCE_TOLERANCE;
+      nfailed += compare(fname, "TF Lite", outputs, expected, NROWS, mlp->noutputs, tolerance);
+    }
+  }
+#endif
+
+  free(expected);
+  free(outputs);
+  free(inputs);
+  btune_mlp_free(mlp);
+  return nfailed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <models dir> [<int8 models dir>]\n", argv[0]);
+    return 2;
+  }
+  printf("Kernels: %s\n", btune_mlp_kernel_name());
+  static const char *names[] = {"model_comp.tflite", "model_decomp.tflite"};
+  int nfailed = 0;
+  for (int i = 0; i < 2; i++) {
+    nfailed += check_model(argv[1], names[i], FLOAT_MODEL);
+    nfailed += check_model(argv[1], names[i], QUANTIZED_HERE);
+    if (argc > 2) {
+      nfailed += check_model(argv[2], names[i], INT8_MODEL);
+    }
+  }
+  if (argc < 3) {
+    printf("No int8 model files given (see examples/quantize_models.py)\n");
+  }
+  printf("%d failures\n", nfailed);
+  return nfailed > 0 ? 1 : 0;
+}
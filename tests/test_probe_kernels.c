@@ -0,0 +1,109 @@
+/**********************************************************************
+  Check that the vectorized kernels of the entropy probe give the same
+  estimates as the scalar one.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "entropy_probe.h"
+
+// Room for a window at every offset tried
+#define BUFSIZE (ENTROPY_PROBE_MAX_WINDOW + 64)
+
+typedef void (*fill_fn)(uint8_t *buf, int size);
+
+static uint32_t next_random(uint32_t *state) {
+  *state = *state * 1664525U + 1013904223U;
+  return *state >> 8;
+}
+
+static void fill_zeros(uint8_t *buf, int size) {
+  memset(buf, 0, size);
+}
+
+static void fill_random(uint8_t *buf, int size) {
+  uint32_t state = 1;
+  for (int i = 0; i < size; i++) {
+    buf[i] = (uint8_t) next_random(&state);
+  }
+}
+
+// Runs of every length, so that they end at every position of a vector
+static void fill_runs(uint8_t *buf, int size) {
+  int i = 0;
+  for (int len = 1; i < size; len = len % 97 + 1) {
+    for (int j = 0; j < len && i < size; j++) {
+      buf[i++] = (uint8_t) len;
+    }
+  }
+}
+
+// Repeated words with random mutations, so that matches end at every position
+static void fill_text(uint8_t *buf, int size) {
+  static const char words[] = "the quick brown fox jumps over the lazy dog ";
+  uint32_t state = 2;
+  for (int i = 0; i < size; i++) {
+    buf[i] = (uint8_t) words[i % (sizeof(words) - 1)];
+    if (next_random(&state) % 53 == 0) {
+      buf[i] = (uint8_t) next_random(&state);
+    }
+  }
+}
+
+static void fill_floats(uint8_t *buf, int size) {
+  for (int i = 0; i + 4 <= size; i += 4) {
+    float x = (float) (i / 4) * 0.25f;
+    memcpy(buf + i, &x, 4);
+  }
+}
+
+int main(void) {
+  static const fill_fn fills[] = {fill_zeros, fill_random, fill_runs, fill_text, fill_floats};
+  static const char *fill_names[] = {"zeros", "random", "runs", "text", "floats"};
+  static const int sizes[] = {16, 63, 100, 1000, 4097, ENTROPY_PROBE_MAX_WINDOW};
+  static const int offsets[] = {0, 1, 3, 7, 31};
+  int nfills = sizeof(fills) / sizeof(fills[0]);
+  int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  int noffsets = sizeof(offsets) / sizeof(offsets[0]);
+
+  int nkernels = entropy_probe_nkernels();
+  printf("Kernels:");
+  for (int k = 0; k < nkernels; k++) {
+    printf(" %s", entropy_probe_kernel_name_at(k));
+  }
+  printf("\n");
+
+  uint8_t *buf = malloc(BUFSIZE);
+  int nfailed = 0;
+  int nchecked = 0;
+  for (int f = 0; f < nfills; f++) {
+    fills[f](buf, BUFSIZE);
+    for (int s = 0; s < nsizes; s++) {
+      for (int o = 0; o < noffsets; o++) {
+        const uint8_t *src = buf + offsets[o];
+        float expected = entropy_probe_kernel_cratio(0, src, sizes[s]);
+        for (int k = 1; k < nkernels; k++) {
+          float cratio = entropy_probe_kernel_cratio(k, src, sizes[s]);
+          nchecked++;
+          if (cratio != expected) {
+            fprintf(stderr, "FAILED: %s kernel, %s data, size %d, offset %d: cratio %g != %g (scalar)\n",
+                    entropy_probe_kernel_name_at(k), fill_names[f], sizes[s], offsets[o],
+                    (double) cratio, (double) expected);
+            nfailed++;
+          }
+        }
+      }
+    }
+  }
+  free(buf);
+
+  printf("%d estimates checked, %d failed\n", nchecked, nfailed);
+  return nfailed > 0 ? 1 : 0;
+}
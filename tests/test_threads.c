@@ -0,0 +1,161 @@
+/**********************************************************************
+  Check the FIT thread search on synthetic timings: the Universal Scalability
+  Law fitted to them, the knee chosen and the end of the sampling when the
+  speedup saturates.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include "btune_threads.h"
+
+#define TOLERANCE 1e-6
+
+static int nfailed = 0;
+static int nchecked = 0;
+
+static void check(const char *what, double value, double expected, double tolerance) {
+  nchecked++;
+  if (fabs(value - expected) > tolerance) {
+    fprintf(stderr, "FAILED: %s is %g, expected %g\n", what, value, expected);
+    nfailed++;
+  }
+}
+
+static double usl(double sigma, double kappa, int n) {
+  return (1 + sigma * (n - 1) + kappa * n * (n - 1)) / n;
+}
+
+// The time of a chunk bound by the memory bandwidth from 4 threads on
+static double saturated(double sigma, double kappa, int n) {
+  (void) sigma;
+  (void) kappa;
+  return 1. / (n < 4 ? n : 4);
+}
+
+/*
+ * Sample the counts of a search with max_threads as btune does, in order, with the times
+ * of curve, and return the knee fitted to them.
+ */
+static int search(const char *name, double (*curve)(double, double, int), double sigma,
+                  double kappa, int max_threads, btune_threads_fit *fit, double *best_time) {
+  btune_threads_fit_init(fit, max_threads);
+  *best_time = INFINITY;
+  for (int i = 0; i < fit->ncounts; i++) {
+    int n = fit->counts[i];
+    double time = curve(sigma, kappa, n);
+    if (btune_threads_fit_record(fit, n, time, *best_time)) {
+      *best_time = time;
+    }
+  }
+  nchecked++;
+  if (!btune_threads_fit_sampled(fit)) {
+    fprintf(stderr, "FAILED: %s not sampled after every count\n", name);
+    nfailed++;
+    return 0;
+  }
+  double fit_sigma, fit_kappa;
+  int knee = btune_threads_fit_knee(fit, &fit_sigma, &fit_kappa);
+  if (curve == usl) {
+    char what[64];
+    snprintf(what, sizeof(what), "sigma of %s", name);
+    check(what, fit_sigma, sigma, TOLERANCE);
+    snprintf(what, sizeof(what), "kappa of %s", name);
+    check(what, fit_kappa, kappa, TOLERANCE);
+  }
+  return knee;
+}
+
+static void check_counts(void) {
+  btune_threads_fit fit;
+  btune_threads_fit_init(&fit, 12);
+  check("counts up to 12 threads", fit.ncounts, 5, 0);
+  check("last count up to 12 threads", fit.counts[4], 12, 0);
+  btune_threads_fit_init(&fit, 1);
+  check("counts of 1 thread", fit.ncounts, 1, 0);
+  check("count of 1 thread", fit.counts[0], 1, 0);
+}
+
+static void check_amdahl(void) {
+  btune_threads_fit fit;
+  double best_time;
+  // 10% serial: T(16) = 2.5 / 16, and (0.9 + 0.1 n) / n is within 5% of it from n = 15
+  int knee = search("Amdahl", usl, 0.1, 0, 16, &fit, &best_time);
+  check("samples of Amdahl", fit.ncounts, 5, 0);
+  check("knee of Amdahl", knee, 15, 0);
+  check("best time of Amdahl", best_time, usl(0.1, 0, 16), TOLERANCE);
+
+  // Without a serial part every thread helps
+  knee = search("linear speedup", usl, 0, 0, 8, &fit, &best_time);
+  check("knee of linear speedup", knee, 8, 0);
+}
+
+static void check_usl(void) {
+  btune_threads_fit fit;
+  double best_time;
+  // 5% serial and some crosstalk: the time is lowest at sqrt(0.95 / 0.002) ~ 22 threads,
+  // but 32 threads are slower than 16, the fastest count sampled, and T(16) is within 5%
+  // of T(14)
+  int knee = search("USL", usl, 0.05, 0.002, 32, &fit, &best_time);
+  check("samples of USL", fit.ncounts, 6, 0);
+  check("knee of USL", knee, 14, 0);
+  check("best time of USL", best_time, usl(0.05, 0.002, 16), TOLERANCE);
+
+  // Heavy crosstalk: T(n) = 0.9 / n + 0.1 n is lowest at 3 threads, and 4 threads
+  // barely beat 2, which ends the sampling
+  knee = search("USL with crosstalk", usl, 0.1, 0.1, 16, &fit, &best_time);
+  check("samples of USL with crosstalk", fit.ncounts, 3, 0);
+  check("knee of USL with crosstalk", knee, 3, 0);
+}
+
+static void check_saturated(void) {
+  btune_threads_fit fit;
+  double best_time;
+  // Bound by the memory bandwidth from 4 threads: 8 threads end the sampling, 16 are
+  // not tried, and the knee is not past 4 threads, although the fitted curve still
+  // falls up to 6
+  int knee = search("saturated bandwidth", saturated, 0, 0, 16, &fit, &best_time);
+  check("samples of saturated bandwidth", fit.ncounts, 4, 0);
+  check("last count of saturated bandwidth", fit.counts[fit.ncounts - 1], 8, 0);
+  check("knee of saturated bandwidth", knee, 4, 0);
+  check("best time of saturated bandwidth", best_time, 0.25, TOLERANCE);
+
+  // Once the knee is known, only the knee close to the best time improves
+  fit.knee = 4;
+  nchecked++;
+  if (!btune_threads_fit_record(&fit, 4, 1.04 * best_time, best_time) ||
+      btune_threads_fit_record(&fit, 4, 1.06 * best_time, best_time) ||
+      btune_threads_fit_record(&fit, 8, 0.5 * best_time, best_time)) {
+    fprintf(stderr, "FAILED: improvements of the knee\n");
+    nfailed++;
+  }
+}
+
+static void check_out_of_order(void) {
+  btune_threads_fit fit;
+  // Chunks in flight may report in any order, and twice for the same count
+  btune_threads_fit_init(&fit, 4);
+  btune_threads_fit_record(&fit, 4, usl(0.1, 0, 4), INFINITY);
+  btune_threads_fit_record(&fit, 2, usl(0.1, 0, 2), INFINITY);
+  check("sampled before 1 thread", btune_threads_fit_sampled(&fit), 0, 0);
+  btune_threads_fit_record(&fit, 1, 1, INFINITY);
+  btune_threads_fit_record(&fit, 2, 10, INFINITY);
+  check("sampled out of order", btune_threads_fit_sampled(&fit), 1, 0);
+  check("time kept for a count reported twice", fit.times[1], usl(0.1, 0, 2), TOLERANCE);
+  check("knee sampled out of order", btune_threads_fit_knee(&fit, NULL, NULL), 4, 0);
+}
+
+int main(void) {
+  check_counts();
+  check_amdahl();
+  check_usl();
+  check_saturated();
+  check_out_of_order();
+
+  printf("%d checks, %d failed\n", nchecked, nfailed);
+  return nfailed > 0 ? 1 : 0;
+}
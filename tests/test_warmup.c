@@ -0,0 +1,199 @@
+/**********************************************************************
+  Check, end to end with libblosc2, that the chunks which pay for starting
+  up (the first one, and those which start or stop the threads) have their
+  timing discarded and their cparams retried with the next chunk, and that
+  the overhead of the thread starts is measured.
+
+  Copyright (c) 2023 The Blosc Developers <blosc@blosc.org>
+  License: GNU Affero General Public License v3.0
+
+  See COPYING.txt for details about copyright and rights to use.
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blosc2.h"
+#include "btune.h"
+#include "btune-private.h"
+
+#define NCHUNKS 200
+#define CHUNKSIZE (256 * 1024)
+#define NTHREADS 4
+// A user tuner id, so that the plugin is not loaded from a Python package
+#define TUNER_ID BLOSC2_USER_REGISTERED_TUNER_START
+// The exit code of a skipped test for ctest
+#define SKIPPED 77
+
+static int nfailed = 0;
+static int nchecked = 0;
+
+static void check(const char *what, long value, long expected) {
+  nchecked++;
+  if (value != expected) {
+    fprintf(stderr, "FAILED: %s is %ld, expected %ld\n", what, value, expected);
+    nfailed++;
+  }
+}
+
+// The cparams given to a chunk
+typedef struct {
+  int compcode;
+  int clevel;
+  int filter;
+  int splitmode;
+  int nthreads;
+} chunk_cparams;
+
+static chunk_cparams current;
+// The cparams of the chunk being compressed
+static bool starting;
+// Whether the chunk being compressed starts (or stops) the threads
+static bool retrying;
+// Whether the chunk being compressed must retry the cparams of the previous one
+static chunk_cparams discarded;
+// The cparams of the last chunk whose timing was discarded
+static bool mismatch = false;
+// Whether the contexts of libblosc2 are not laid out as in src/context.h
+static int nchunks = 0;
+static int ndiscarded = 0;
+static int nstarting = 0;
+static int nretried = 0;
+
+static int init(void *config, blosc2_context *cctx, blosc2_context *dctx) {
+  // The plugin reads the contexts through src/context.h, which must match libblosc2
+  if (cctx->tuner_id != TUNER_ID || cctx->typesize != sizeof(float) ||
+      cctx->nthreads != NTHREADS) {
+    mismatch = true;
+    return 0;
+  }
+  btune_init(config, cctx, dctx);
+  return 0;
+}
+
+static int next_blocksize(blosc2_context *context) {
+  if (!mismatch) {
+    btune_next_blocksize(context);
+  }
+  return 0;
+}
+
+static int next_cparams(blosc2_context *context) {
+  if (mismatch) {
+    return 0;
+  }
+  btune_next_cparams(context);
+  current.compcode = context->compcode;
+  current.clevel = context->clevel;
+  current.filter = context->filters[BLOSC2_MAX_FILTERS - 1];
+  current.splitmode = context->splitmode;
+  current.nthreads = context->new_nthreads;
+  if (context->new_nthreads != context->nthreads) {
+    starting = context->new_nthreads > 1 || context->nthreads > 1;
+  } else {
+    starting = context->new_nthreads > 1 && context->threads_started == 0;
+  }
+  if (retrying) {
+    nchecked++;
+    if (memcmp(&current, &discarded, sizeof(current)) != 0) {
+      fprintf(stderr, "FAILED: chunk %d does not retry the cparams of the discarded one\n",
+              nchunks);
+      nfailed++;
+    }
+    nretried++;
+  }
+  return 0;
+}
+
+static int update(blosc2_context *context, double ctime) {
+  if (mismatch) {
+    return 0;
+  }
+  btune_struct *btune_params = (btune_struct *) context->tuner_params;
+  bool stopped = btune_params->state == STOP;
+  uint64_t warmups = btune_params->stats.warmups;
+  btune_update(context, ctime);
+  bool discard = btune_params->stats.warmups > warmups;
+
+  // The first chunk and those starting the threads are discarded, but not their retries
+  bool warmup = !retrying && (nchunks == 0 || starting) && !stopped;
+  nchecked++;
+  if (discard != warmup) {
+    fprintf(stderr, "FAILED: chunk %d (%d threads) %s discarded\n", nchunks, current.nthreads,
+            discard ? "is" : "is not");
+    nfailed++;
+  }
+  retrying = discard;
+  if (discard) {
+    discarded = current;
+    ndiscarded++;
+    nstarting += starting;
+  }
+  nchunks++;
+  return 0;
+}
+
+static int tuner_free(blosc2_context *context) {
+  if (mismatch) {
+    return 0;
+  }
+  btune_struct *btune_params = (btune_struct *) context->tuner_params;
+  // Only the thread starts of the compression are timed, decompression is not measured
+  check("thread starts measured", (long) btune_params->stats.respawns, nstarting);
+  btune_free(context);
+  return 0;
+}
+
+int main(void) {
+  // The overhead of starting up is only measured for the trace
+  setenv("BTUNE_TRACE", "1", 1);
+  blosc2_init();
+  blosc2_tuner tuner = {init, next_blocksize, next_cparams, update, tuner_free, TUNER_ID,
+                        "btune_test"};
+  if (blosc2_register_tuner(&tuner) < 0) {
+    fprintf(stderr, "FAILED: cannot register the tuner\n");
+    return 1;
+  }
+
+  btune_config config = BTUNE_CONFIG_DEFAULTS;
+  config.perf_mode = BTUNE_PERF_COMP;
+  config.behaviour.nhards_before_stop = 3;
+  blosc2_cparams cparams = BLOSC2_CPARAMS_DEFAULTS;
+  cparams.typesize = sizeof(float);
+  cparams.nthreads = NTHREADS;
+  cparams.tuner_id = TUNER_ID;
+  cparams.tuner_params = &config;
+  blosc2_dparams dparams = BLOSC2_DPARAMS_DEFAULTS;
+  blosc2_storage storage = {.cparams = &cparams, .dparams = &dparams};
+  blosc2_schunk *schunk = blosc2_schunk_new(&storage);
+  if (mismatch) {
+    printf("libblosc2 %s does not match src/context.h, skipping\n", blosc2_get_version_string());
+    blosc2_schunk_free(schunk);
+    blosc2_destroy();
+    return SKIPPED;
+  }
+
+  float *data = malloc(CHUNKSIZE);
+  int rc = 0;
+  for (int nchunk = 0; nchunk < NCHUNKS && rc >= 0; nchunk++) {
+    for (int i = 0; i < CHUNKSIZE / (int) sizeof(float); i++) {
+      data[i] = (float) (nchunk * 1000 + i % 1000) + (float) (i % 7) * .25f;
+    }
+    rc = (int) blosc2_schunk_append_buffer(schunk, data, CHUNKSIZE);
+  }
+  check("appending the chunks", rc >= 0, 1);
+  blosc2_schunk_free(schunk);
+  free(data);
+  blosc2_destroy();
+
+  check("chunks tuned", nchunks, NCHUNKS);
+  check("discarded chunks retried", nretried, ndiscarded - (retrying ? 1 : 0));
+  nchecked++;
+  if (ndiscarded < 2) {
+    fprintf(stderr, "FAILED: no chunk started the threads after the first one\n");
+    nfailed++;
+  }
+  printf("%d chunks, %d discarded (%d starting the threads)\n", nchunks, ndiscarded, nstarting);
+  printf("%d checks, %d failed\n", nchecked, nfailed);
+  return nfailed > 0 ? 1 : 0;
+}